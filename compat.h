@@ -90,6 +90,10 @@ typedef int _Bool;
 #define SIZE_MAX SIZE_T_MAX
 #endif
 
+#ifndef NAME_MAX
+#define NAME_MAX 255
+#endif
+
 #ifndef nitems
 #define nitems(x) (sizeof((x)) / sizeof((x)[0]))
 #endif
@@ -106,6 +110,14 @@ typedef int _Bool;
 #endif
 #endif
 
+/* struct kevent is declared slightly differently on the different BSDs.
+ * This macros will help to avoid cast warnings on the supported platforms. */
+#if defined (__NetBSD__)
+#define PTR_TO_UDATA(X) ((intptr_t)X)
+#else
+#define PTR_TO_UDATA(X) (X)
+#endif
+
 #ifndef AT_FDCWD
 #define AT_FDCWD		-100
 #endif
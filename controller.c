@@ -29,8 +29,11 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h> /* INT_MAX */
 #include <pthread.h>
+#include <sched.h> /* sched_yield */
 #include <stddef.h> /* NULL */
+#include <stdlib.h> /* calloc, free */
 #include <unistd.h>
 
 #include "sys/inotify.h"
@@ -40,30 +43,126 @@
 #include "worker.h"
 
 
-static struct workers_list workers = SLIST_HEAD_INITIALIZER (&workers);
+#define WORKER_TABLE_MIN 64
+
+/**
+ * Table of workers indexed by inotify instance file descriptor.
+ *
+ * Lookups are lock-free. Modifications are serialized with workers_mtx.
+ * Removed workers and replaced tables are freed only after grace period,
+ * i.e. when all lookups which could see them are finished.
+ **/
+struct worker_table {
+    int size;                 /* number of slots */
+    atomic_uintptr_t slots[]; /* pointers to workers */
+};
+
+static atomic_uintptr_t workers = ATOMIC_VAR_INIT (0); /* worker_table */
 static atomic_uint nworkers = ATOMIC_VAR_INIT (0);
-static pthread_rwlock_t workers_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t workers_mtx = PTHREAD_MUTEX_INITIALIZER;
 static unsigned int max_workers = IN_DEF_MAX_USER_INSTANCES;
 
+/* Grace period tracking. Lookups are counted in slot of current epoch */
+static atomic_uint workers_epoch = ATOMIC_VAR_INIT (0);
+static atomic_uint workers_readers[2] = {
+    ATOMIC_VAR_INIT (0),
+    ATOMIC_VAR_INIT (0),
+};
+
 static inline void
-workerset_rlock (void)
+workerset_lock (void)
 {
-    pthread_rwlock_rdlock (&workers_rwlock);
+    pthread_mutex_lock (&workers_mtx);
 }
 
 static inline void
-workerset_wlock (void)
+workerset_unlock (void)
 {
-    pthread_rwlock_wrlock (&workers_rwlock);
+    pthread_mutex_unlock (&workers_mtx);
+}
+
+static inline unsigned int
+workerset_read_begin (void)
+{
+    unsigned int epoch = atomic_load (&workers_epoch) & 1;
+
+    atomic_fetch_add (&workers_readers[epoch], 1);
+    return epoch;
 }
 
 static inline void
-workerset_unlock (void)
+workerset_read_end (unsigned int epoch)
 {
-    pthread_rwlock_unlock (&workers_rwlock);
+    atomic_fetch_sub (&workers_readers[epoch], 1);
 }
 
+/**
+ * Wait for all the lookups started before the call to finish.
+ *
+ * Epoch is advanced twice as lookup may be counted in either slot
+ * if it has fetched epoch number before the call.
+ * Must be called with workers_mtx held.
+ **/
+static void
+workerset_synchronize (void)
+{
+    unsigned int epoch;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        epoch = atomic_fetch_add (&workers_epoch, 1) & 1;
+        while (atomic_load (&workers_readers[epoch]) > 0) {
+            sched_yield ();
+        }
+    }
+}
+
+/**
+ * Make sure that the table of workers has a slot for given descriptor.
+ * Must be called with workers_mtx held.
+ *
+ * @param[in] fd Inotify instance file descriptor.
+ * @return A pointer to the table on success, NULL on failure.
+ **/
+static struct worker_table *
+workerset_reserve (int fd)
+{
+    struct worker_table *wt, *new_wt;
+    int i, size;
+
+    wt = (struct worker_table *)atomic_load (&workers);
+    if (wt != NULL && fd < wt->size) {
+        return wt;
+    }
+
+    size = wt != NULL ? wt->size : WORKER_TABLE_MIN;
+    while (size <= fd) {
+        size *= 2;
+    }
+    new_wt = calloc (1, sizeof (struct worker_table) +
+                        size * sizeof (atomic_uintptr_t));
+    if (new_wt == NULL) {
+        return NULL;
+    }
+    new_wt->size = size;
+    for (i = 0; i < size; i++) {
+        atomic_init (&new_wt->slots[i],
+                     wt != NULL && i < wt->size ?
+                         atomic_load (&wt->slots[i]) : 0);
+    }
+
+    atomic_store (&workers, (uintptr_t)new_wt);
+    if (wt != NULL) {
+        /* Old table can be still read by concurrent lookups */
+        workerset_synchronize ();
+        free (wt);
+    }
+    return new_wt;
+}
+
+static struct worker *worker_lookup (int fd);
 static int     worker_exec (int fd, struct worker_cmd *cmd);
+static int     worker_exec_async (int fd, struct worker_cmd *cmd);
 
 /**
  * Create a new inotify instance.
@@ -93,13 +192,14 @@ inotify_init (void)
 int
 inotify_init1 (int flags)
 {
+    struct worker_table *wt;
     struct worker *wrk, *iter;
     int lfd = -1;
 
 #ifdef O_CLOEXEC
-    if (flags & ~(IN_CLOEXEC|O_CLOEXEC|IN_NONBLOCK|O_NONBLOCK)) {
+    if (flags & ~(IN_CLOEXEC|O_CLOEXEC|IN_NONBLOCK|O_NONBLOCK|IN_SHMRING)) {
 #else
-    if (flags & ~(IN_CLOEXEC|IN_NONBLOCK|O_NONBLOCK)) {
+    if (flags & ~(IN_CLOEXEC|IN_NONBLOCK|O_NONBLOCK|IN_SHMRING)) {
 #endif
         errno = EINVAL;
         return -1;
@@ -124,16 +224,25 @@ inotify_init1 (int flags)
      * the worker has not been removed from a list yet. The fd is free, and
      * when we create a new worker, we can * receive the same fd. So check
      * for duplicates and remove them now. */
-    workerset_wlock ();
-    SLIST_FOREACH (iter, &workers, next) {
-        if (iter->io[INOTIFY_FD] == lfd) {
-            iter->io[INOTIFY_FD] = -1;
-            perror_msg (("Collision found: fd %d", lfd));
-            break;
-        }
+    workerset_lock ();
+    wt = workerset_reserve (lfd);
+    if (wt == NULL) {
+        workerset_unlock ();
+        perror_msg (("Failed to grow table of workers"));
+        /* Worker thread erases the worker on close */
+        close (lfd);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    iter = (struct worker *)atomic_load (&wt->slots[lfd]);
+    if (iter != NULL) {
+        /* Displaced worker can not be found by lookup anymore */
+        iter->io[INOTIFY_FD] = -1;
+        perror_msg (("Collision found: fd %d", lfd));
     }
 
-    SLIST_INSERT_HEAD (&workers, wrk, next);
+    atomic_store (&wt->slots[lfd], (uintptr_t)wrk);
     workerset_unlock ();
 
     return lfd;
@@ -184,6 +293,120 @@ inotify_add_watch (int         fd,
     return worker_exec (fd, &cmd);
 }
 
+/**
+ * Add or modify a watch asynchronously.
+ *
+ * Returns right after the request is passed to the worker. Result of the
+ * request is reported later with IN_ADD_COMPLETE event.
+ *
+ * @param[in] fd   A file descriptor of an inotify instance.
+ * @param[in] name A path to a file to watch.
+ * @param[in] mask A combination of inotify flags.
+ * @param[in] tag  A user tag to be reported in cookie of completion event.
+ * @return 0 if request is accepted, -1 on failure.
+ **/
+int
+inotify_add_watch_async (int         fd,
+                         const char *name,
+                         uint32_t    mask,
+                         uint32_t    tag)
+{
+    struct stat st;
+    struct worker_cmd *cmd;
+
+    if (!is_opened (fd)) {
+        return -1;	/* errno = EBADF */
+    }
+
+    /* Bad paths are reported at once like in inotify_add_watch() */
+    if (lstat (name, &st) == -1) {
+        perror_msg (("failed to lstat watch %s",
+                     errno != EFAULT ? name : "<bad addr>"));
+        return -1;
+    }
+
+    if (mask == 0) {
+        perror_msg (("Failed to open watch %s. Bad event mask %x", name, mask));
+        errno = EINVAL;
+        return -1;
+    }
+
+    cmd = worker_cmd_add_async (name, mask, tag);
+    if (cmd == NULL) {
+        perror_msg (("Failed to allocate asynchronous command"));
+        return -1;
+    }
+
+    if (worker_exec_async (fd, cmd) == -1) {
+        worker_cmd_free (cmd);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Add or modify a vector of watches with a single worker round-trip.
+ *
+ * Every element of the wds array receives either an id of the watch
+ * added for the corresponding path or a negated errno value on failure.
+ *
+ * @param[in]  fd    A file descriptor of an inotify instance.
+ * @param[in]  names An array of paths to files to watch.
+ * @param[in]  masks An array of combinations of inotify flags.
+ * @param[out] wds   An array to store watch ids or negated errno values to.
+ * @param[in]  n     A number of elements in the arrays.
+ * @return A number of successfully added watches, -1 on failure.
+ **/
+int
+inotify_add_watches (int                fd,
+                     const char *const  names[],
+                     const uint32_t     masks[],
+                     int                wds[],
+                     size_t             n)
+{
+    struct stat st;
+    struct worker_cmd cmd;
+    size_t i, pending = 0;
+
+    if (!is_opened (fd)) {
+        return -1;	/* errno = EBADF */
+    }
+
+    if (n == 0) {
+        return 0;
+    }
+
+    if (names == NULL || masks == NULL || wds == NULL || n > INT_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Same checks as in inotify_add_watch() but done for each path */
+    for (i = 0; i < n; i++) {
+        if (lstat (names[i], &st) == -1) {
+            perror_msg (("failed to lstat watch %s",
+                         errno != EFAULT ? names[i] : "<bad addr>"));
+            wds[i] = -errno;
+        } else if (masks[i] == 0) {
+            perror_msg (("Failed to open watch %s. Bad event mask %x",
+                         names[i], masks[i]));
+            wds[i] = -EINVAL;
+        } else {
+            /* 0 is never returned as watch id, mark entry as pending */
+            wds[i] = 0;
+            ++pending;
+        }
+    }
+
+    if (pending == 0) {
+        return 0;
+    }
+
+    worker_cmd_add_many (&cmd, names, masks, wds, n);
+    return worker_exec (fd, &cmd);
+}
+
 /**
  * Remove a watch.
  *
@@ -237,8 +460,28 @@ inotify_set_param (int fd, int param, intptr_t value)
         max_workers = value;
         return 0;
 
+    case IN_WORKER_THREADS:
+        if (fd != -1) {
+            errno = EINVAL;
+            return -1;
+        }
+        return worker_pool_set_size (value);
+
+    case IN_KEVENT_BATCH:
+        if (fd == -1) {
+            /* Batch of worker thread pool is shared by instances */
+            return worker_pool_set_kevent_batch (value);
+        }
+        /* FALLTHROUGH */
     case IN_SOCKBUFSIZE:
+    case IN_SOCKBUFSIZE_MAX:
     case IN_MAX_QUEUED_EVENTS:
+    case IN_MAX_WATCH_FDS:
+    case IN_READDIR_BUFSIZE:
+    case IN_MAX_QUEUED_BYTES:
+    case IN_COALESCE_WINDOW:
+    case IN_LATENCY:
+    case IN_LATENCY_HIST:
         /* Or pass per-instance parameters to workers */
         if (!is_opened (fd)) {
             return -1;	/* errno = EBADF */
@@ -254,23 +497,149 @@ inotify_set_param (int fd, int param, intptr_t value)
 }
 
 /**
- * Erase a worker from a list of workers.
- * 
+ * Collect activity counters of inotify instance.
+ *
+ * @param[in]  fd    Inotify instance file descriptor.
+ * @param[out] stats A pointer to #inotify_stats to fill.
+ * @return 0 on success, -1 on failure.
+ **/
+int
+inotify_get_stats (int fd, struct inotify_stats *stats)
+{
+    struct worker_cmd cmd;
+
+    if (stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!is_opened (fd)) {
+        return -1;	/* errno = EBADF */
+    }
+
+    worker_cmd_stats (&cmd, stats);
+    return worker_exec (fd, &cmd);
+}
+
+/**
+ * Collect latency histograms of inotify instance.
+ *
+ * @param[in]  fd  Inotify instance file descriptor.
+ * @param[out] lat A pointer to #inotify_latency to fill.
+ * @return 0 on success, -1 on failure.
+ **/
+int
+inotify_get_latency (int fd, struct inotify_latency *lat)
+{
+    struct worker_cmd cmd;
+
+    if (lat == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!is_opened (fd)) {
+        return -1;	/* errno = EBADF */
+    }
+
+    worker_cmd_latency (&cmd, lat);
+    return worker_exec (fd, &cmd);
+}
+
+/**
+ * Get shared memory event ring of inotify instance.
+ *
+ * The ring is created along with the instance and is freed when its file
+ * descriptor is closed.
+ *
+ * @param[in] fd Inotify instance file descriptor.
+ * @return A pointer to #inotify_ring on success, NULL on failure.
+ **/
+struct inotify_ring *
+inotify_map_ring (int fd)
+{
+    struct inotify_ring *ring;
+    struct worker *wrk;
+
+    if (!is_opened (fd)) {
+        return NULL;	/* errno = EBADF */
+    }
+
+    wrk = worker_lookup (fd);
+    if (wrk == NULL) {
+        return NULL;
+    }
+
+    ring = wrk->eq.ring;
+    worker_unref (wrk);
+    if (ring == NULL) {
+        errno = EINVAL;
+    }
+    return ring;
+}
+
+/**
+ * Erase a worker from a table of workers.
+ *
+ * Returns after all the lookups which could find the worker are finished,
+ * so worker can not be referenced by new API calls after that.
+ *
  * @param[in] wrk A pointer to a worker
  **/
 void
 worker_erase (struct worker *wrk)
 {
+    struct worker_table *wt;
+    int fd;
+
     assert (wrk != NULL);
 
-    workerset_wlock ();
-    SLIST_REMOVE (&workers, wrk, worker, next);
+    workerset_lock ();
+    wt = (struct worker_table *)atomic_load (&workers);
+    fd = wrk->io[INOTIFY_FD];
+    /* Slot of displaced worker is owned by the new one already */
+    if (fd != -1 && wt != NULL && fd < wt->size &&
+        atomic_load (&wt->slots[fd]) == (uintptr_t)wrk) {
+        atomic_store (&wt->slots[fd], 0);
+    }
     wrk->io[INOTIFY_FD] = -1;
     assert (atomic_load (&nworkers) > 0);
     atomic_fetch_sub (&nworkers, 1);
+    workerset_synchronize ();
     workerset_unlock ();
 }
 
+/**
+ * Find a worker by inotify instance file descriptor and reference it.
+ *
+ * @param[in] fd Inotify instance file descriptor.
+ * @return A pointer to referenced #worker or NULL with errno set.
+ **/
+static struct worker *
+worker_lookup (int fd)
+{
+    struct worker_table *wt;
+    struct worker *wrk = NULL;
+    unsigned int epoch;
+
+    epoch = workerset_read_begin ();
+
+    wt = (struct worker_table *)atomic_load (&workers);
+    if (wt != NULL && fd >= 0 && fd < wt->size) {
+        wrk = (struct worker *)atomic_load (&wt->slots[fd]);
+        if (wrk != NULL) {
+            /* Worker is not freed until the reference is dropped */
+            worker_ref (wrk);
+        }
+    }
+
+    workerset_read_end (epoch);
+    if (wrk == NULL) {
+        errno = EINVAL;
+    }
+    return wrk;
+}
+
 /**
  * Execute command in context of working thread.
  *
@@ -283,41 +652,49 @@ worker_exec (int fd, struct worker_cmd *cmd)
 {
     struct worker *wrk;
 
-    workerset_rlock ();
+    wrk = worker_lookup (fd);
+    if (wrk == NULL) {
+        return -1;
+    }
 
-    /* look up for an appropriate worker */
-    SLIST_FOREACH (wrk, &workers, next) {
-        if (wrk->io[INOTIFY_FD] == fd) {
-            worker_ref (wrk);
-            workerset_unlock ();
-            worker_cmd_lock (wrk);
-            if (wrk->io[INOTIFY_FD] != fd) {
-                /* RACE: worker thread overwrote inotify descriptor in between
-                   obtaining pointer on wrk and locking its mutex. */
-                perror_msg (("race detected. fd: %d", fd));
-                worker_cmd_unlock (wrk);
-                worker_unref (wrk);
-                errno = EBADF;
-                return -1;
-            }
-
-            cmd->retval = -1;
-            cmd->error = EBADF;
-
-            if (worker_notify (wrk, cmd) >= 0) {
-                worker_wait (wrk);
-            }
-
-            worker_cmd_unlock (wrk);
-            worker_unref (wrk);
-            if (cmd->retval == -1) {
-                errno = cmd->error;
-            }
-            return cmd->retval;
-        }
+    cmd->retval = -1;
+    cmd->error = EBADF;
+
+    /* Submission fails with EBADF if worker is already closed */
+    if (worker_submit (wrk, cmd) == 0) {
+        worker_wait (wrk, cmd);
+    } else {
+        cmd->error = errno;
     }
 
-    workerset_unlock ();
-    errno = EINVAL;
-    return -1;
+    worker_unref (wrk);
+    if (cmd->retval == -1) {
+        errno = cmd->error;
+    }
+    return cmd->retval;
+}
+
+/**
+ * Pass command to working thread without waiting for its completion.
+ *
+ * Command is released by working thread on success.
+ *
+ * @param[in] fd  Inotify instance file descriptor.
+ * @param[in] cmd Pointer to #worker_cmd
+ * @return 0 on success, -1 on failure with errno set.
+ **/
+static int
+worker_exec_async (int fd, struct worker_cmd *cmd)
+{
+    struct worker *wrk;
+    int retval;
+
+    wrk = worker_lookup (fd);
+    if (wrk == NULL) {
+        return -1;
+    }
+
+    retval = worker_submit (wrk, cmd);
+    worker_unref (wrk);
+    return retval;
 }
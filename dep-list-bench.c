@@ -0,0 +1,187 @@
+/*******************************************************************************
+  Copyright (c) 2014-2018 Vladimir Kondratyev <vladimir@kondratyev.su>
+  SPDX-License-Identifier: MIT
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+/*
+ * Directory diffing benchmark.
+ *
+ * Feeds dl_calculate() with synthetic directory listings where every file
+ * has been renamed between scans, every 4th file has been deleted and the
+ * same number of files has been created. Prints time spent per diff.
+ *
+ * Usage: dep-list-bench [files ...]
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stddef.h> /* offsetof */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "compat.h"
+#include "config.h"
+#include "dep-list.h"
+#include "slab.h"
+
+struct bench_counters {
+    size_t added;
+    size_t removed;
+    size_t replaced;
+    size_t moved;
+};
+
+static struct dep_item *
+bench_item (const char *path, ino_t inode, struct slab_pool *pool)
+{
+    size_t pathlen = strlen (path) + 1;
+    struct dep_item *di;
+
+    di = slab_pool_alloc (pool, offsetof (struct dep_item, path) + pathlen);
+    if (di == NULL) {
+        perror ("slab_pool_alloc");
+        exit (1);
+    }
+    memcpy (di->path, path, pathlen);
+    di->inode = inode;
+    di->type = S_IFREG;
+    return di;
+}
+
+static struct chg_list *
+bench_listing (size_t nfiles, int after, struct slab_pool *pool)
+{
+    struct chg_list *head;
+    struct dep_item *di;
+    char path[64];
+    size_t i;
+
+    head = calloc (1, sizeof (struct chg_list));
+    if (head == NULL) {
+        perror ("calloc");
+        exit (1);
+    }
+    SLIST_INIT (head);
+
+    for (i = 0; i < nfiles; i++) {
+        /* Every 4th file is deleted in "after" listing */
+        if (after && i % 4 == 0) {
+            continue;
+        }
+        snprintf (path, sizeof (path), after ? "file%zu.1" : "file%zu", i);
+        di = bench_item (path, i + 1, pool);
+        SLIST_INSERT_HEAD (head, di, u.s.list_link);
+    }
+    /* Same number of files is created */
+    for (i = 0; after && i < nfiles; i += 4) {
+        snprintf (path, sizeof (path), "new%zu", i);
+        di = bench_item (path, nfiles + i + 1, pool);
+        SLIST_INSERT_HEAD (head, di, u.s.list_link);
+    }
+    return head;
+}
+
+static void
+bench_single (void *udata, struct dep_item *di)
+{
+    ++*(size_t *)udata;
+}
+
+static void
+bench_added (void *udata, struct dep_item *di)
+{
+    bench_single (&((struct bench_counters *)udata)->added, di);
+}
+
+static void
+bench_removed (void *udata, struct dep_item *di)
+{
+    bench_single (&((struct bench_counters *)udata)->removed, di);
+}
+
+static void
+bench_replaced (void *udata, struct dep_item *di)
+{
+    bench_single (&((struct bench_counters *)udata)->replaced, di);
+}
+
+static void
+bench_moved (void *udata, struct dep_item *from_di, struct dep_item *to_di)
+{
+    bench_single (&((struct bench_counters *)udata)->moved, to_di);
+}
+
+static const struct traverse_cbs bench_cbs = {
+    bench_added,
+    bench_removed,
+    bench_replaced,
+    bench_moved,
+};
+
+static double
+bench_run (size_t nfiles, struct bench_counters *cnt)
+{
+    struct dep_list before;
+    struct chg_list *after;
+    struct slab_pool pool;
+    struct timespec start, end;
+
+    slab_pool_init (&pool, DI_POOL_MIN_SIZE);
+    dl_init (&before);
+    dl_join (&before, bench_listing (nfiles, 0, &pool));
+    after = bench_listing (nfiles, 1, &pool);
+
+    memset (cnt, 0, sizeof (*cnt));
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    dl_calculate (&before, after, &bench_cbs, cnt, &pool);
+    clock_gettime (CLOCK_MONOTONIC, &end);
+
+    dl_free (&before, &pool);
+    slab_pool_destroy (&pool);
+
+    return (end.tv_sec - start.tv_sec) * 1e3 +
+           (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+int
+main (int argc, char *argv[])
+{
+    static const size_t def_sizes[] = { 100, 1000, 10000, 50000 };
+    struct bench_counters cnt;
+    size_t i, nfiles, nsizes;
+    double ms;
+
+    nsizes = argc > 1 ? (size_t)argc - 1 : nitems (def_sizes);
+
+    printf ("%10s %10s %10s %10s %12s\n",
+            "files", "moved", "removed", "added", "msec");
+    for (i = 0; i < nsizes; i++) {
+        nfiles = argc > 1 ? strtoul (argv[i + 1], NULL, 10) : def_sizes[i];
+        ms = bench_run (nfiles, &cnt);
+        printf ("%10zu %10zu %10zu %10zu %12.3f\n",
+                nfiles, cnt.moved, cnt.removed, cnt.added, ms);
+    }
+
+    return 0;
+}
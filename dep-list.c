@@ -27,16 +27,26 @@
 #include <errno.h>   /* errno */
 #include <fcntl.h>   /* open */
 #include <stddef.h>  /* offsetof */
-#include <stdlib.h>  /* calloc */
-#include <string.h>  /* strcmp */
+#include <stdint.h>  /* uint64_t */
+#include <stdlib.h>  /* calloc, malloc, qsort */
+#include <string.h>  /* memcpy, strcmp */
 #include <unistd.h>  /* close */
 
 #include "compat.h"
 #include "config.h"
 #include "dep-list.h"
+#include "slab.h"
 #include "utils.h"
 
-static inline void di_free (struct dep_item *di);
+/*
+ * Minimal size of current directory listing to use inode hash table for
+ * move detection. Smaller listings are scanned linearly.
+ */
+#ifndef DL_MOVE_HASH_MIN
+#define DL_MOVE_HASH_MIN 16
+#endif
+
+static inline void di_free (struct dep_item *di, struct slab_pool *pool);
 static int dep_item_cmp (struct dep_item *di1, struct dep_item *di2);
 
 RB_GENERATE_INSERT_COLOR(dep_list, dep_item, u.tree_link, static)
@@ -65,14 +75,16 @@ dl_init (struct dep_list* dl)
  * @param[in] path  A name of a file (the string is not copied!).
  * @param[in] inode A file's inode number.
  * @param[in] type  A file`s type (compatible with mode_t values)
+ * @param[in] pool  A pointer to #slab_pool to allocate from or NULL.
  * @return A pointer to a new item or NULL in the case of error.
  **/
 static inline struct dep_item*
-di_create (const char *path, ino_t inode, mode_t type)
+di_create (const char *path, ino_t inode, mode_t type, struct slab_pool *pool)
 {
     size_t pathlen = strlen (path) + 1;
 
-    struct dep_item *di = calloc (1, offsetof (struct dep_item, path) + pathlen);
+    struct dep_item *di = slab_pool_alloc (pool,
+        offsetof (struct dep_item, path) + pathlen);
     if (di == NULL) {
         perror_msg (("Failed to create a new dep-list item"));
         return NULL;
@@ -103,18 +115,19 @@ dl_insert (struct dep_list* dl, struct dep_item* di)
 /**
  * Remove specified item from a list.
  *
- * @param[in] dl A pointer to a list.
- * @param[in] di A pointer to a list item to remove.
+ * @param[in] dl   A pointer to a list.
+ * @param[in] di   A pointer to a list item to remove.
+ * @param[in] pool A pointer to #slab_pool the item is allocated from or NULL.
  **/
 static inline void
-dl_remove (struct dep_list* dl, struct dep_item* di)
+dl_remove (struct dep_list* dl, struct dep_item* di, struct slab_pool *pool)
 {
     assert (dl != NULL);
     assert (di != NULL);
     assert (RB_FIND (dep_list, dl, di) != NULL);
 
     RB_REMOVE (dep_list, dl, di);
-    di_free (di);
+    di_free (di, pool);
 }
 
 /**
@@ -122,12 +135,16 @@ dl_remove (struct dep_list* dl, struct dep_item* di)
  *
  * This function will free the memory used by a list item.
  *
- * @param[in] dn A pointer to a list item. May be NULL.
+ * @param[in] dn   A pointer to a list item. May be NULL.
+ * @param[in] pool A pointer to #slab_pool the item is allocated from or NULL.
  **/
 static inline void
-di_free (struct dep_item *di)
+di_free (struct dep_item *di, struct slab_pool *pool)
 {
-    free (di);
+    if (di != NULL) {
+        slab_pool_free (pool, di,
+            offsetof (struct dep_item, path) + strlen (di->path) + 1);
+    }
 }
 
 /**
@@ -135,10 +152,11 @@ di_free (struct dep_item *di)
  *
  * This function will rmove and free all list items
  *
- * @param[in] dl A pointer to a list.
+ * @param[in] dl   A pointer to a list.
+ * @param[in] pool A pointer to #slab_pool the items are allocated from or NULL.
  **/
 void
-dl_free (struct dep_list *dl)
+dl_free (struct dep_list *dl, struct slab_pool *pool)
 {
     struct dep_item *di;
 
@@ -146,7 +164,7 @@ dl_free (struct dep_list *dl)
 
     while (!RB_EMPTY (dl)) {
         di = RB_MIN (dep_list, dl);
-        dl_remove (dl, di);
+        dl_remove (dl, di, pool);
     }
 }
 
@@ -214,101 +232,390 @@ dl_find (struct dep_list *dl, const char *path)
     return (RB_FIND (dep_list, dl, &find));
 }
 
+/* Size of a block of packed directory listing records */
+#define DL_BLOCK_SIZE 65536
+
+/* Directory entry packed into a listing snapshot together with its name */
+struct dl_record {
+    ino_t inode;
+    mode_t type;
+    char name[FLEXIBLE_ARRAY_MEMBER];
+};
+
+struct dl_block {
+    struct dl_block *next;
+    size_t used;
+    char data[FLEXIBLE_ARRAY_MEMBER];
+};
+
+/* Raw directory listing to be sorted and merged with previous listing */
+struct dl_snapshot {
+    struct dl_block *blocks;  /* blocks of packed records, last one first */
+    struct dl_record **recs;  /* records in order of addition */
+    size_t count;             /* number of records */
+    size_t size;              /* capacity of the records array */
+};
+
 /**
- * Create a directory listing from DIR stream and return it as a linked list.
+ * Free the memory allocated for a listing snapshot.
  *
- * @param[in] dir    A pointer to valid directory stream created with opendir().
- * @param[in] before A pointer to previous directory listing. If nonNULL value
- *                   is specified, unchanged entries are not included in
- *                   resulting list but marked as unchanged in before list.
- * @return A pointer to a list. May return NULL, check errno in this case.
+ * @param[in] ds A pointer to #dl_snapshot.
  **/
-struct chg_list*
-dl_readdir (DIR *dir, struct dep_list* before)
+static void
+ds_free (struct dl_snapshot *ds)
+{
+    struct dl_block *block;
+
+    while (ds->blocks != NULL) {
+        block = ds->blocks;
+        ds->blocks = block->next;
+        free (block);
+    }
+    free (ds->recs);
+}
+
+/**
+ * Pack a directory entry into a listing snapshot.
+ *
+ * @param[in] ds    A pointer to #dl_snapshot.
+ * @param[in] name  A name of a file.
+ * @param[in] inode A file's inode number.
+ * @param[in] type  A file`s type (compatible with mode_t values)
+ * @return 0 on success, -1 otherwise.
+ **/
+static int
+ds_add (struct dl_snapshot *ds, const char *name, ino_t inode, mode_t type)
+{
+    const size_t align = sizeof (ino_t);
+    struct dl_block *block = ds->blocks;
+    struct dl_record *rec, **recs;
+    size_t namelen, len;
+
+    namelen = strlen (name) + 1;
+    len = offsetof (struct dl_record, name) + namelen;
+    len = (len + align - 1) / align * align;
+
+    if (block == NULL ||
+        block->used + len > DL_BLOCK_SIZE - offsetof (struct dl_block, data)) {
+        block = malloc (DL_BLOCK_SIZE);
+        if (block == NULL) {
+            return -1;
+        }
+        block->next = ds->blocks;
+        block->used = 0;
+        ds->blocks = block;
+    }
+
+    if (ds->count == ds->size) {
+        ds->size = ds->size != 0 ? ds->size * 2 : 256;
+        recs = realloc (ds->recs, ds->size * sizeof (struct dl_record *));
+        if (recs == NULL) {
+            return -1;
+        }
+        ds->recs = recs;
+    }
+
+    rec = (struct dl_record *)(block->data + block->used);
+    block->used += len;
+    rec->inode = inode;
+    rec->type = type;
+    memcpy (rec->name, name, namelen);
+    ds->recs[ds->count++] = rec;
+
+    return 0;
+}
+
+/**
+ * Compare two listing snapshot records by file name.
+ *
+ * @param[in] p1 A pointer to the pointer to first #dl_record.
+ * @param[in] p2 A pointer to the pointer to second #dl_record.
+ * @return Result of strcmp() on record names.
+ **/
+static int
+ds_cmp (const void *p1, const void *p2)
+{
+    const struct dl_record *rec1 = *(struct dl_record * const *)p1;
+    const struct dl_record *rec2 = *(struct dl_record * const *)p2;
+
+    return strcmp (rec1->name, rec2->name);
+}
+
+/**
+ * Pack a directory entry read from directory into a listing snapshot.
+ *
+ * Dot entries, whiteouts and entries without inode are skipped.
+ *
+ * @param[in] ds  A pointer to #dl_snapshot.
+ * @param[in] ent A pointer to directory entry.
+ * @return 0 on success, -1 otherwise.
+ **/
+static int
+ds_add_dirent (struct dl_snapshot *ds, const struct dirent *ent)
 {
-    struct dirent *ent;
-    struct dep_item *item, *before_item;
-    struct chg_list *head;
     mode_t type;
 
-    assert (dir != NULL);
+    if (ent->d_ino == 0 ||
+        !strcmp (ent->d_name, ".") || !strcmp (ent->d_name, "..")) {
+        return 0;
+    }
 
-    head = calloc (1, sizeof (struct dep_list));
-    if (head == NULL) {
-        perror_msg (("Failed to allocate list during directory listing"));
-        return NULL;
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+#ifdef DT_WHT
+    if (ent->d_type == DT_WHT) {
+        return 0;
     }
-    SLIST_INIT (head);
+#endif
+    if (ent->d_type != DT_UNKNOWN)
+        type = DTTOIF (ent->d_type) & S_IFMT;
+    else
+#endif
+        type = S_IFUNK;
+
+    return ds_add (ds, ent->d_name, ent->d_ino, type);
+}
+
+/**
+ * Read directory entries from DIR stream into a listing snapshot.
+ *
+ * @param[in] ds  A pointer to #dl_snapshot.
+ * @param[in] dir A pointer to valid directory stream created with opendir().
+ * @return 0 on success, -1 otherwise.
+ **/
+static int
+ds_readdir (struct dl_snapshot *ds, DIR *dir)
+{
+    struct dirent *ent;
 
     while ((ent = readdir (dir)) != NULL) {
-        if (!strcmp (ent->d_name, ".") || !strcmp (ent->d_name, "..")) {
-            continue;
+        if (ds_add_dirent (ds, ent) == -1) {
+            perror_msg (("Failed to allocate a new item during listing"));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+#if defined (HAVE_GETDENTS) && \
+    (READDIR_DOES_OPENDIR < 2 || defined (HAVE_OPENAT))
+#define DL_HAVE_GETDENTS
+/**
+ * Read directory entries into a listing snapshot with getdents(2).
+ *
+ * Unlike readdir(3) it does not allocate a DIR stream and its buffer on
+ * each call but fills the buffer owned by caller.
+ *
+ * @param[in] ds  A pointer to #dl_snapshot.
+ * @param[in] fd  A file descriptor of a directory.
+ * @param[in] buf A pointer to #dl_dirbuf.
+ * @return 0 on success, -1 otherwise.
+ **/
+static int
+ds_getdents (struct dl_snapshot *ds, int fd, struct dl_dirbuf *buf)
+{
+    struct dirent *ent;
+    ssize_t len, pos;
+    int dirfd, ret = 0;
+
+    if (buf->data == NULL) {
+        buf->data = malloc (buf->size);
+        if (buf->data == NULL) {
+            perror_msg (("Failed to allocate directory read buffer"));
+            return -1;
         }
+    }
 
-#ifdef HAVE_STRUCT_DIRENT_D_TYPE
-        if (ent->d_type != DT_UNKNOWN)
-            type = DTTOIF (ent->d_type) & S_IFMT;
-        else
+#if (READDIR_DOES_OPENDIR == 2)
+    /* Watch descriptor can not be read, open the directory once again */
+    dirfd = openat (fd, ".", O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd == -1) {
+        return -1;
+    }
+#else
+    dirfd = fd;
+    if (lseek (dirfd, 0, SEEK_SET) == -1) {
+        return -1;
+    }
 #endif
-            type = S_IFUNK;
 
-        /*
-         * Detect files remained unmoved between directory scans.
-         * This produces both intersection and symmetric diffrence of two sets.
-         * The same items will be marked as UNCHANGED in previous list and
-         * missed in returned set. Items are compared by name and inode number.
-         */
-        before_item = NULL;
-        if (before != NULL) {
-            before_item = dl_find (before, ent->d_name);
-            if (before_item != NULL && before_item->inode == ent->d_ino) {
-                before_item->type |= DI_UNCHANGED;
-                continue;
+    while ((len = getdents (dirfd, buf->data, buf->size)) > 0) {
+        for (pos = 0; pos < len; pos += ent->d_reclen) {
+            ent = (struct dirent *)(buf->data + pos);
+            if (ds_add_dirent (ds, ent) == -1) {
+                perror_msg (("Failed to allocate a new item during listing"));
+                len = -1;
+                break;
             }
         }
+        if (len == -1) {
+            break;
+        }
+    }
+    if (len == -1) {
+        ret = -1;
+    }
+
+#if (READDIR_DOES_OPENDIR == 2)
+    close (dirfd);
+#endif
+
+    return ret;
+}
+#endif /* HAVE_GETDENTS */
+
+/**
+ * Convert listing snapshot to a linked list of changes.
+ *
+ * Snapshot is sorted by name and merged with previous listing in a single
+ * pass over both of them rather than looked up in previous listing one by
+ * one. Snapshot is freed on return.
+ *
+ * @param[in] ds     A pointer to #dl_snapshot.
+ * @param[in] before A pointer to previous directory listing or NULL.
+ * @param[in] pool   A pointer to #slab_pool to allocate items from or NULL.
+ * @return A pointer to a list. May return NULL, check errno in this case.
+ **/
+static struct chg_list*
+ds_merge (struct dl_snapshot *ds, struct dep_list* before, struct slab_pool *pool)
+{
+    struct dep_item *item, *before_item, *last = NULL;
+    struct dl_record *rec;
+    struct chg_list *head;
+    size_t i;
+    int cmp;
+
+    head = calloc (1, sizeof (struct dep_list));
+    if (head == NULL) {
+        perror_msg (("Failed to allocate list during directory listing"));
+        ds_free (ds);
+        return NULL;
+    }
+    SLIST_INIT (head);
+
+    qsort (ds->recs, ds->count, sizeof (struct dl_record *), ds_cmp);
+
+    /*
+     * Detect files remained unmoved between directory scans.
+     * This produces both intersection and symmetric diffrence of two sets.
+     * The same items will be marked as UNCHANGED in previous list and
+     * missed in returned set. Items are compared by name and inode number.
+     * Both the snapshot and previous list are sorted by name, so merge them.
+     */
+    before_item = before != NULL ? RB_MIN (dep_list, before) : NULL;
+    for (i = 0; i < ds->count; i++) {
+        rec = ds->recs[i];
+
+        cmp = -1;
+        while (before_item != NULL &&
+               (cmp = strcmp (before_item->path, rec->name)) < 0) {
+            before_item = RB_NEXT (dep_list, before, before_item);
+        }
+        if (before_item != NULL && cmp == 0 &&
+            before_item->inode == rec->inode) {
+            before_item->type |= DI_UNCHANGED;
+            continue;
+        }
 
-        item = di_create (ent->d_name, ent->d_ino, type);
+        item = di_create (rec->name, rec->inode, rec->type, pool);
         if (item == NULL) {
             perror_msg (("Failed to allocate a new item during listing"));
             goto error;
         }
 
         /* File was overwritten between scans. Cache reference on old entry. */
-        if (before_item != NULL) {
+        if (before_item != NULL && cmp == 0) {
             item->type |= DI_READDED;
             item->u.s.replacee = before_item;
         }
 
-        SLIST_INSERT_HEAD (head, item, u.s.list_link);
+        /* Keep the resulting list sorted by name */
+        if (last == NULL) {
+            SLIST_INSERT_HEAD (head, item, u.s.list_link);
+        } else {
+            SLIST_INSERT_AFTER (last, item, u.s.list_link);
+        }
+        last = item;
     }
+    ds_free (ds);
     return head;
 
 error:
+    ds_free (ds);
     if (before != NULL) {
         dl_clearflags (before);
     }
     while (!SLIST_EMPTY (head)) {
         item = SLIST_FIRST (head);
         SLIST_REMOVE_HEAD (head, u.s.list_link);
-        di_free (item);
+        di_free (item, pool);
     }
     free (head);
     return NULL;
 }
 
+/**
+ * Create a directory listing from DIR stream and return it as a linked list.
+ *
+ * @param[in] dir    A pointer to valid directory stream created with opendir().
+ * @param[in] before A pointer to previous directory listing. If nonNULL value
+ *                   is specified, unchanged entries are not included in
+ *                   resulting list but marked as unchanged in before list.
+ * @param[in] pool   A pointer to #slab_pool to allocate items from or NULL.
+ * @return A pointer to a list. May return NULL, check errno in this case.
+ **/
+struct chg_list*
+dl_readdir (DIR *dir, struct dep_list* before, struct slab_pool *pool)
+{
+    struct dl_snapshot ds;
+
+    assert (dir != NULL);
+
+    memset (&ds, 0, sizeof (ds));
+    if (ds_readdir (&ds, dir) == -1) {
+        ds_free (&ds);
+        return NULL;
+    }
+
+    return ds_merge (&ds, before, pool);
+}
+
 /**
  * Create a directory listing and return it as a list.
  *
+ * If a read buffer is given, directory entries are read with getdents(2)
+ * into it where supported. readdir(3) is used otherwise or as a fallback.
+ *
+ * @param[in] fd     A file descriptor of a directory.
+ * @param[in] before A pointer to previous directory listing or NULL.
+ * @param[in] pool   A pointer to #slab_pool to allocate items from or NULL.
+ * @param[in] buf    A pointer to #dl_dirbuf to read directory with or NULL.
  * @return A pointer to a list. May return NULL, check errno in this case.
  **/
 struct chg_list*
-dl_listing (int fd, struct dep_list* before)
+dl_listing (int fd,
+            struct dep_list* before,
+            struct slab_pool *pool,
+            struct dl_dirbuf *buf)
 {
     DIR *dir = NULL;
     struct chg_list *head;
 
     assert (fd >= 0);
 
+#ifdef DL_HAVE_GETDENTS
+    if (buf != NULL && buf->size != 0) {
+        struct dl_snapshot ds;
+
+        memset (&ds, 0, sizeof (ds));
+        if (ds_getdents (&ds, fd, buf) == 0) {
+            return ds_merge (&ds, before, pool);
+        }
+        ds_free (&ds);
+        perror_msg (("getdents failed on %d, falling back to readdir", fd));
+    }
+#endif
+
     dir = fdreopendir (fd);
     if (dir == NULL) {
         if (errno == ENOENT) {
@@ -324,7 +631,7 @@ dl_listing (int fd, struct dep_list* before)
         return NULL;
     }
 
-    head = dl_readdir (dir, before);
+    head = dl_readdir (dir, before, pool);
 
 #if READDIR_DOES_OPENDIR > 0
     closedir (dir);
@@ -336,6 +643,160 @@ dl_listing (int fd, struct dep_list* before)
 }
 
 
+/**
+ * Initialize a directory read buffer.
+ *
+ * Memory is allocated on first use of the buffer.
+ *
+ * @param[in] buf  A pointer to #dl_dirbuf.
+ * @param[in] size A buffer size in bytes. 0 disables use of the buffer.
+ **/
+void
+dl_dirbuf_init (struct dl_dirbuf *buf, size_t size)
+{
+    assert (buf != NULL);
+
+    buf->data = NULL;
+    buf->size = size;
+}
+
+/**
+ * Free the memory allocated for a directory read buffer.
+ *
+ * @param[in] buf A pointer to #dl_dirbuf.
+ **/
+void
+dl_dirbuf_free (struct dl_dirbuf *buf)
+{
+    assert (buf != NULL);
+
+    free (buf->data);
+    buf->data = NULL;
+}
+
+/**
+ * Mark a pair of items of previous and current listings as moved.
+ *
+ * @param[in] di_from A pointer to item of previous listing.
+ * @param[in] di_to   A pointer to item of current listing.
+ **/
+static inline void
+dl_mark_moved (struct dep_item *di_from, struct dep_item *di_to)
+{
+    /* Detect replacements in the watched directory */
+    if (di_to->type & DI_READDED) {
+        di_to->u.s.replacee->type |= DI_REPLACED;
+    }
+
+    /* Now we can mark item as moved in the watched directory */
+    di_to->type |= DI_MOVED;
+    di_to->u.s.moved_from = di_from;
+    di_from->type |= DI_MOVED;
+}
+
+/**
+ * Calculate inode hash table slot.
+ *
+ * @param[in] inode A file's inode number.
+ * @param[in] bits  A binary logarithm of hash table size.
+ * @return A hash table slot number.
+ **/
+static inline size_t
+dl_inode_hash (ino_t inode, unsigned int bits)
+{
+    /* Fibonacci hashing. Inode numbers are often sequential */
+    return (size_t)(((uint64_t)inode * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+}
+
+/**
+ * Detect files renamed inside the watched directory.
+ *
+ * Items of previous listing are matched against current listing by inode
+ * number. Current listing is indexed with open addressing hash table, so
+ * matching is linear in number of items. Linear probing keeps items with
+ * equal inode numbers in the listing order, so pairing is the same as with
+ * sequential scan of the current listing. Sequential scan is still used
+ * for short listings and as a fallback if hash table can not be allocated.
+ *
+ * @param[in] before The previous contents of the directory.
+ * @param[in] after  The current contents of the directory.
+ * @return A number of detected moves.
+ **/
+static size_t
+dl_detect_moves (struct dep_list *before, struct chg_list *after)
+{
+    struct dep_item *di_from, *di_to, **table = NULL;
+    size_t n_after = 0, n_moves = 0, mask, slot;
+    unsigned int bits = 1;
+
+    CL_FOREACH (di_to, after) {
+        ++n_after;
+    }
+    if (n_after == 0) {
+        return 0;
+    }
+
+    if (n_after >= DL_MOVE_HASH_MIN) {
+        /* Keep load factor at or below 1/2 */
+        while (((size_t)1 << bits) < n_after * 2) {
+            ++bits;
+        }
+        table = calloc ((size_t)1 << bits, sizeof (struct dep_item *));
+        if (table == NULL) {
+            perror_msg (("Failed to allocate move detection hash table"));
+        }
+    }
+
+    if (table == NULL) {
+        DL_FOREACH (di_from, before) {
+            /* Skip unchanged files. They do not produce any events. */
+            if (di_from->type & DI_UNCHANGED) {
+                continue;
+            }
+
+            CL_FOREACH (di_to, after) {
+                if (di_from->inode == di_to->inode &&
+                    !(di_to->type & DI_MOVED)) {
+                    dl_mark_moved (di_from, di_to);
+                    ++n_moves;
+                    break;
+                }
+            }
+        }
+        return n_moves;
+    }
+
+    mask = ((size_t)1 << bits) - 1;
+    CL_FOREACH (di_to, after) {
+        slot = dl_inode_hash (di_to->inode, bits);
+        while (table[slot] != NULL) {
+            slot = (slot + 1) & mask;
+        }
+        table[slot] = di_to;
+    }
+
+    DL_FOREACH (di_from, before) {
+        /* Skip unchanged files. They do not produce any events. */
+        if (di_from->type & DI_UNCHANGED) {
+            continue;
+        }
+
+        slot = dl_inode_hash (di_from->inode, bits);
+        while ((di_to = table[slot]) != NULL) {
+            if (di_from->inode == di_to->inode &&
+                !(di_to->type & DI_MOVED)) {
+                dl_mark_moved (di_from, di_to);
+                ++n_moves;
+                break;
+            }
+            slot = (slot + 1) & mask;
+        }
+    }
+
+    free (table);
+    return n_moves;
+}
+
 /**
  * Recognize all the changes in the directory, invoke the appropriate callbacks.
  *
@@ -346,12 +807,14 @@ dl_listing (int fd, struct dep_list* before)
  * @param[in] after  The current contents of the directory.
  * @param[in] cbs    A pointer to user callbacks (#traverse_callbacks).
  * @param[in] udata  A pointer to user data.
+ * @param[in] pool   A pointer to #slab_pool the items are allocated from or NULL.
  **/
 void
 dl_calculate (struct dep_list           *before,
               struct chg_list           *after,
               const struct traverse_cbs *cbs,
-              void                      *udata)
+              void                      *udata,
+              struct slab_pool          *pool)
 {
     struct dep_item *di_from, *di_to, *tmp;
     size_t n_moves = 0;
@@ -371,30 +834,8 @@ dl_calculate (struct dep_list           *before,
      *             moved and then overwrote other file.
      */
     if (after != NULL) {
-        DL_FOREACH (di_from, before) {
-            /* Skip unchanged files. They do not produce any events. */
-            if (di_from->type & DI_UNCHANGED) {
-                continue;
-            }
-
-            /* Detect and notify about moves in the watched directory. */
-            CL_FOREACH (di_to, after) {
-                if (di_from->inode == di_to->inode &&
-                    !(di_to->type & DI_MOVED)) {
-                    /* Detect replacements in the watched directory */
-                    if (di_to->type & DI_READDED) {
-                        di_to->u.s.replacee->type |= DI_REPLACED;
-                    }
-
-                    /* Now we can mark item as moved in the watched directory */
-                    di_to->type |= DI_MOVED;
-                    di_to->u.s.moved_from = di_from;
-                    di_from->type |= DI_MOVED;
-                    ++n_moves;
-                    break;
-                }
-            }
-        }
+        /* Detect and notify about moves in the watched directory. */
+        n_moves = dl_detect_moves (before, after);
     }
 
     /* Traverse lists and invoke a callback for each item.
@@ -470,7 +911,7 @@ dl_calculate (struct dep_list           *before,
     /* Replace all changed items from before list with items from after list */
     DL_FOREACH_SAFE (di_from, before, tmp) {
         if (!(di_from->type & DI_UNCHANGED)) {
-            dl_remove (before, di_from);
+            dl_remove (before, di_from, pool);
         }
     }
     if (after != NULL) {
@@ -40,6 +40,9 @@
 
 #define DI_PARENT    NULL    /* Faked dependency item for parent watch */
 
+/* Smallest size class of dependency items slab pool */
+#define DI_POOL_MIN_SIZE 64
+
 #define S_IFUNK 0000000 /* mode_t extension. File type is unknown */
 #define S_ISUNK(m) (((m) & S_IFMT) == S_IFUNK)
 
@@ -78,19 +81,36 @@ struct traverse_cbs {
     dual_entry_cb    moved;
 };
 
+/* Reusable buffer to read raw directory entries into */
+struct dl_dirbuf {
+    char *data;  /* buffer memory, allocated on first use */
+    size_t size; /* buffer size, 0 to read directories with readdir(3) */
+};
+
+struct slab_pool;
+
 void             dl_init    (struct dep_list *dl);
-void             dl_free    (struct dep_list *dl);
+void             dl_free    (struct dep_list *dl, struct slab_pool *pool);
 void             dl_join    (struct dep_list *dl_target,
                              struct chg_list *dl_source);
 struct dep_item* dl_find    (struct dep_list *dl, const char *path);
-struct chg_list* dl_readdir (DIR *dir, struct dep_list *before);
-struct chg_list* dl_listing (int fd, struct dep_list *before);
+struct chg_list* dl_readdir (DIR *dir,
+                             struct dep_list *before,
+                             struct slab_pool *pool);
+struct chg_list* dl_listing (int fd,
+                             struct dep_list *before,
+                             struct slab_pool *pool,
+                             struct dl_dirbuf *buf);
+
+void dl_dirbuf_init (struct dl_dirbuf *buf, size_t size);
+void dl_dirbuf_free (struct dl_dirbuf *buf);
 
 void
 dl_calculate (struct dep_list           *before,
               struct chg_list           *after,
               const struct traverse_cbs *cbs,
-              void                      *udata);
+              void                      *udata,
+              struct slab_pool          *pool);
 
 static inline void
 di_settype (struct dep_item *di, mode_t type)
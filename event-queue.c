@@ -24,14 +24,13 @@
 #include "compat.h"
 
 #include <sys/types.h> /* uint32_t */
-#include <sys/ioctl.h> /* ioctl */
 #include <sys/socket.h>/* SO_NOSIGPIPE */
 #include <sys/uio.h>   /* iovec */
 
 #include <assert.h>    /* assert */
 #include <stddef.h>    /* offsetof */
-#include <stdlib.h>    /* realloc */
-#include <string.h>    /* memmove */
+#include <stdlib.h>    /* malloc */
+#include <string.h>    /* memcpy */
 
 #include "sys/inotify.h"
 
@@ -44,16 +43,43 @@
  * Initialize resources associated with inotify event queue.
  *
  * @param[in] eq A pointer to #event_queue.
+ * @return 0 on success, -1 otherwise.
  **/
-void
+int
 event_queue_init (struct event_queue *eq)
 {
-    eq->allocated = 0;
     eq->sb_events = 0;
+    eq->sb_unread = false;
     eq->mem_events = 0;
-    eq->iov = NULL;
+    eq->head = 0;
+    eq->tail = 0;
+    eq->wrap = 0;
+    eq->prev = 0;
     eq->last = NULL;
+    memset (&eq->stats, 0, sizeof (eq->stats));
+    eq->ring = NULL;
+    eq->ring_last = 0;
+    eq->lat = NULL;
+    eq->mem_bytes = 0;
+    eq->overflow = false;
+    eq->seq = 0;
+    eq->win_start = 1;
+    eq->win_events = 0;
+    eq->merge = false;
+    eq->win_mask = 0;
+    eq->window = NULL;
+    eq->max_bytes = IN_DEF_MAX_QUEUED_BYTES;
     event_queue_set_max_events (eq, IN_DEF_MAX_QUEUED_EVENTS);
+
+    eq->size = EQ_INIT_SIZE;
+    eq->buf = malloc (eq->size);
+    if (eq->buf == NULL) {
+        perror_msg (("Failed to allocate event queue of %zu bytes", eq->size));
+        eq->size = 0;
+        return -1;
+    }
+
+    return 0;
 }
 
 /**
@@ -64,68 +90,381 @@ event_queue_init (struct event_queue *eq)
 void
 event_queue_free (struct event_queue *eq)
 {
-    int i;
-
-    for (i = 0; i < eq->mem_events; i++) {
-        free (eq->iov[i].iov_base);
-    }
-    free (eq->iov);
-    free (eq->last);
+    free (eq->buf);
+    eq->buf = NULL;
+    eq->size = 0;
+    free (eq->window);
+    eq->window = NULL;
+    event_ring_free (eq->ring);
+    eq->ring = NULL;
+    latency_hist_free (eq->lat);
+    eq->lat = NULL;
 }
 
 /**
- * Set maximum length for inotify event queue
+ * Make event queue send events to shared memory ring instead of socket.
  *
- * @param[in] eq         A pointer to #event_queue.
- * @param[in] max_events A maximal length of queue (in events)
+ * @param[in] eq A pointer to #event_queue.
  * @return 0 on success, -1 otherwise.
  **/
 int
-event_queue_set_max_events (struct event_queue *eq, int max_events)
+event_queue_map_ring (struct event_queue *eq)
 {
-    if (max_events <= 0) {
-        errno = EINVAL;
+    assert (eq->ring == NULL);
+
+    eq->ring = event_ring_create ();
+    return (eq->ring != NULL ? 0 : -1);
+}
+
+/**
+ * Read the header of inotify event stored in the ring buffer.
+ * Events are packed in the ring buffer without any alignment so do not
+ * dereference them directly.
+ *
+ * @param[in]  eq     A pointer to #event_queue.
+ * @param[in]  offset An offset of the event in the ring buffer.
+ * @param[out] ie     A pointer to #inotify_event to fill.
+ * @return Size of the event in bytes.
+ **/
+static inline size_t
+event_queue_peek (struct event_queue *eq,
+                  size_t offset,
+                  struct inotify_event *ie)
+{
+    memcpy (ie, eq->buf + offset, offsetof (struct inotify_event, name));
+    return (offsetof (struct inotify_event, name) + ie->len);
+}
+
+/**
+ * Calculate offset of queued event after the ring buffer is unwrapped.
+ *
+ * @param[in] eq     A pointer to #event_queue.
+ * @param[in] offset An offset of the event in the ring buffer.
+ * @param[in] top    A size of data at the top of the ring buffer.
+ * @return An offset of the event in unwrapped buffer.
+ **/
+static inline size_t
+event_queue_move_offset (struct event_queue *eq, size_t offset, size_t top)
+{
+    return (offset >= eq->head ? offset - eq->head : offset + top);
+}
+
+/**
+ * Move queued events to the new ring buffer.
+ *
+ * Events are copied to the beginning of the new buffer so the ring buffer
+ * is unwrapped on return.
+ *
+ * @param[in] eq          A pointer to #event_queue.
+ * @param[in] to_allocate A size of the new ring buffer in bytes.
+ * @return 0 on success, -1 otherwise.
+ **/
+static int
+event_queue_realloc (struct event_queue *eq, size_t to_allocate)
+{
+    size_t top, used, i;
+    char *buf;
+
+    top = (eq->wrap != 0 ? eq->wrap : eq->tail) - eq->head;
+    used = top + (eq->wrap != 0 ? eq->tail : 0);
+    assert (to_allocate >= used);
+
+    buf = malloc (to_allocate);
+    if (buf == NULL) {
+        perror_msg (("Failed to resize event queue to %zu bytes", to_allocate));
         return -1;
     }
-    /* TODO: Implement event queue truncation */
-    eq->max_events = max_events;
+
+    memcpy (buf, eq->buf + eq->head, top);
+    if (eq->wrap != 0) {
+        memcpy (buf + top, eq->buf, eq->tail);
+    }
+    eq->prev = event_queue_move_offset (eq, eq->prev, top);
+    /* Keep offsets saved in coalescing window valid */
+    for (i = 0; eq->window != NULL && i <= eq->win_mask; i++) {
+        eq->window[i].offset =
+            event_queue_move_offset (eq, eq->window[i].offset, top);
+    }
+
+    free (eq->buf);
+    eq->buf = buf;
+    eq->size = to_allocate;
+    eq->head = 0;
+    eq->tail = used;
+    eq->wrap = 0;
+
     return 0;
 }
 
 /**
- * Extend inotify event queue space by one item.
+ * Calculate the smallest ring buffer size to hold queued events and a new one.
  *
- * @param[in] eq A pointer to #event_queue.
+ * @param[in] eq    A pointer to #event_queue.
+ * @param[in] len   A number of bytes required to be free in the ring buffer.
+ * @param[in] start A size to start doubling from.
+ * @return A size of the ring buffer in bytes.
+ **/
+static size_t
+event_queue_fit_size (struct event_queue *eq, size_t len, size_t start)
+{
+    size_t used, size;
+
+    used = (eq->wrap != 0 ? eq->wrap + eq->tail : eq->tail) - eq->head;
+    size = start;
+    while (size < used + len) {
+        size *= 2;
+    }
+
+    return size;
+}
+
+/**
+ * Move queued events to the bigger ring buffer.
+ *
+ * @param[in] eq  A pointer to #event_queue.
+ * @param[in] len A number of bytes required to be free in the ring buffer.
+ * @return 0 on success, -1 otherwise.
+ **/
+static int
+event_queue_grow (struct event_queue *eq, size_t len)
+{
+    return event_queue_realloc (eq, event_queue_fit_size (eq, len,
+        eq->size > 0 ? eq->size : EQ_INIT_SIZE));
+}
+
+/**
+ * Reserve space for a new event at the end of the ring buffer.
+ *
+ * @param[in] eq  A pointer to #event_queue.
+ * @param[in] len A size of the event in bytes.
+ * @return A pointer to reserved space on success, NULL otherwise.
+ **/
+static char *
+event_queue_reserve (struct event_queue *eq, size_t len)
+{
+    size_t offset;
+
+    if (eq->wrap == 0 && eq->size - eq->tail < len && eq->head >= len) {
+        /* No space left at the top of the buffer. Wrap to the bottom */
+        eq->wrap = eq->tail;
+        eq->tail = 0;
+    }
+
+    if ((eq->wrap == 0 && eq->size - eq->tail < len) ||
+        (eq->wrap != 0 && eq->head - eq->tail < len)) {
+        if (event_queue_grow (eq, len) == -1) {
+            return NULL;
+        }
+    }
+
+    offset = eq->tail;
+    eq->tail += len;
+    return (eq->buf + offset);
+}
+
+/**
+ * Append inotify event to the end of event queue unconditionally.
+ *
+ * @param[in] eq     A pointer to #event_queue.
+ * @param[in] wd     An associated watch's id.
+ * @param[in] mask   An inotify watch mask.
+ * @param[in] cookie Event cookie.
+ * @param[in] name   File name (may be NULL).
+ * @return 0 on success, -1 otherwise.
  **/
 static int
-event_queue_extend (struct event_queue *eq)
+event_queue_put (struct event_queue *eq,
+                 int                 wd,
+                 uint32_t            mask,
+                 uint32_t            cookie,
+                 const char         *name)
+{
+    struct inotify_event ie;
+    size_t name_len, len;
+    char *ev;
+
+    name_len = name != NULL ? strlen (name) + 1 : 0;
+    len = offsetof (struct inotify_event, name) + name_len;
+    ev = event_queue_reserve (eq, len);
+    if (ev == NULL) {
+        perror_msg (("Failed to create a inotify event %x", mask));
+        return -1;
+    }
+
+    memset (&ie, 0, sizeof (ie));
+    ie.wd = wd;
+    ie.mask = mask;
+    ie.cookie = cookie;
+    ie.len = name_len;
+    memcpy (ev, &ie, offsetof (struct inotify_event, name));
+    if (name != NULL) {
+        memcpy (ev + offsetof (struct inotify_event, name), name, name_len);
+    }
+
+    eq->prev = ev - eq->buf;
+    ++eq->mem_events;
+    eq->mem_bytes += len;
+    ++eq->seq;
+
+    ++eq->stats.enqueued;
+    if (mask == IN_Q_OVERFLOW) {
+        ++eq->stats.overflows;
+    }
+    if (eq->mem_events > eq->stats.peak_events) {
+        eq->stats.peak_events = eq->mem_events;
+    }
+    if (eq->lat != NULL) {
+        latency_hist_enqueued (eq->lat);
+    }
+
+    return 0;
+}
+
+/**
+ * Check if inotify event can be coalesced with the same event enqueued
+ * before the tail of event queue.
+ *
+ * Only events reporting changes of file contents or metadata are coalesced
+ * such way. Reordering of other events can break file name tracking.
+ * Opening and closing of files are merged along with changes too.
+ *
+ * @param[in] eq   A pointer to #event_queue.
+ * @param[in] mask An inotify watch mask.
+ * @return true if event can be coalesced, false otherwise.
+ **/
+static inline bool
+event_queue_is_windowed (struct event_queue *eq, uint32_t mask)
 {
-    if (eq->mem_events >= eq->allocated) {
-        int to_allocate = eq->mem_events * 3 / 2;
-        void *ptr;
+    uint32_t windowed = IN_ACCESS | IN_MODIFY | IN_ATTRIB;
 
-        if (to_allocate < 10) {
-            to_allocate = 10;
+    if (eq->merge) {
+        windowed |= IN_OPEN | IN_CLOSE;
+    }
+    return ((mask & ~IN_ISDIR) != 0 &&
+            (mask & ~(windowed | IN_ISDIR)) == 0);
+}
+
+/**
+ * Calculate coalescing window hash of inotify event.
+ *
+ * Kind of the event is not hashed so events of the same file which can be
+ * merged share the slots.
+ *
+ * @param[in] wd   An associated watch's id.
+ * @param[in] mask An inotify watch mask.
+ * @param[in] name File name (may be NULL).
+ * @return A hash value.
+ **/
+static uint32_t
+event_queue_hash (int wd, uint32_t mask, const char *name)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261U;
+
+    hash = (hash ^ (uint32_t)wd) * 16777619U;
+    hash = (hash ^ (mask & IN_ISDIR)) * 16777619U;
+    while (name != NULL && *name != '\0') {
+        hash = (hash ^ (unsigned char)*name++) * 16777619U;
+    }
+
+    /* Mix high bits into low ones used for slot selection */
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6BU;
+    hash ^= hash >> 13;
+    return hash;
+}
+
+/**
+ * Check if coalescing window slot references an event which is pending in
+ * the memory and which can be coalesced with.
+ *
+ * @param[in] eq   A pointer to #event_queue.
+ * @param[in] slot A pointer to #eq_window_slot.
+ * @return true if slot is live, false otherwise.
+ **/
+static inline bool
+event_queue_slot_is_live (struct event_queue *eq, struct eq_window_slot *slot)
+{
+    /* Event is sent already, is out of window or is followed by others */
+    return (slot->seq + eq->mem_events > eq->seq &&
+            (eq->merge || slot->seq + eq->win_events > eq->seq) &&
+            slot->seq >= eq->win_start);
+}
+
+/**
+ * Look for the same inotify event pending within coalescing window.
+ *
+ * If merging is on, any pending event of the same file is looked for and
+ * the mask of found event is extended with the new one.
+ *
+ * Each hash value maps to a small group of adjacent slots, so collisions
+ * of hash values make the older events drop out of the window earlier.
+ *
+ * @param[in]  eq     A pointer to #event_queue.
+ * @param[in]  wd     An associated watch's id.
+ * @param[in]  mask   An inotify watch mask.
+ * @param[in]  name   File name (may be NULL).
+ * @param[out] victim A slot to save the event into if it is not found.
+ * @return true if identical event is pending, false otherwise.
+ **/
+static bool
+event_queue_find_pending (struct event_queue *eq,
+                          int wd,
+                          uint32_t mask,
+                          const char *name,
+                          struct eq_window_slot **victim)
+{
+    struct eq_window_slot *slot;
+    struct inotify_event ie;
+    size_t name_len, i, base;
+
+    name_len = name != NULL ? strlen (name) + 1 : 0;
+    base = event_queue_hash (wd, mask, name);
+    *victim = NULL;
+
+    for (i = 0; i < EQ_WINDOW_WAYS; i++) {
+        slot = &eq->window[(base + i) & eq->win_mask];
+        if (!event_queue_slot_is_live (eq, slot)) {
+            if (*victim == NULL || event_queue_slot_is_live (eq, *victim)) {
+                *victim = slot;
+            }
+            continue;
         }
-        if (to_allocate > eq->max_events) {
-            to_allocate = eq->max_events + 1;
+        if (*victim == NULL ||
+            (event_queue_slot_is_live (eq, *victim) &&
+             slot->seq < (*victim)->seq)) {
+            *victim = slot;
         }
 
-        ptr = realloc (eq->iov, sizeof (struct iovec) * to_allocate);
-        if (ptr == NULL) {
-            perror_msg (("Failed to extend events to %d items", to_allocate));
-            return -1;
+        event_queue_peek (eq, slot->offset, &ie);
+        if (ie.wd == wd &&
+            (eq->merge ? (ie.mask & IN_ISDIR) == (mask & IN_ISDIR)
+                       : ie.mask == mask) &&
+            ie.cookie == 0 &&
+            ie.len == name_len &&
+            (name_len == 0 ||
+             memcmp (eq->buf + slot->offset +
+                     offsetof (struct inotify_event, name),
+                     name, name_len) == 0)) {
+            if ((ie.mask & mask) != mask) {
+                /* Merge the event into pending one */
+                ie.mask |= mask;
+                memcpy (eq->buf + slot->offset, &ie,
+                        offsetof (struct inotify_event, name));
+            }
+            return true;
         }
-        eq->iov = ptr;
-        eq->allocated = to_allocate;
     }
 
-    return 0;
+    return false;
 }
 
 /**
  * Place inotify event in to event queue.
  *
+ * If the event does not fit into the queue limits, IN_Q_OVERFLOW is placed
+ * instead and following events are dropped until the queue is flushed.
+ *
  * @param[in] eq     A pointer to #event_queue.
  * @param[in] wd     An associated watch's id.
  * @param[in] mask   An inotify watch mask.
@@ -140,119 +479,501 @@ event_queue_enqueue (struct event_queue *eq,
                      uint32_t            cookie,
                      const char         *name)
 {
-    struct inotify_event *prev_ie;
+    struct inotify_event ie, *prev_ie;
+    struct eq_window_slot *slot = NULL;
+    const char *prev_name;
+    size_t len;
     int retval = 0;
 
-    if (eq->mem_events > eq->max_events) {
+    if (eq->overflow) {
+        ++eq->stats.dropped;
         return -1;
     }
 
-    if (event_queue_extend (eq) == -1) {
-        return -1;
-    }
-
-    if (eq->mem_events == eq->max_events) {
+    len = offsetof (struct inotify_event, name) +
+          (name != NULL ? strlen (name) + 1 : 0);
+    if (eq->mem_events >= eq->max_events ||
+        (eq->max_bytes != 0 && eq->mem_bytes + len > eq->max_bytes)) {
+        ++eq->stats.dropped;
         wd = -1;
         mask = IN_Q_OVERFLOW;
         cookie = 0;
         name = NULL;
         retval = -1;
+        eq->overflow = true;
     }
 
     /*
      * Find previous reported event. If event queue is not empty, get last
      * event from tail. Otherwise get last event sent to communication pipe.
      */
-    prev_ie = eq->mem_events > 0 ?
-        (struct inotify_event*)eq->iov[eq->mem_events - 1].iov_base : eq->last;
+    if (eq->mem_events > 0) {
+        event_queue_peek (eq, eq->prev, &ie);
+        prev_ie = &ie;
+        prev_name = eq->buf + eq->prev + offsetof (struct inotify_event, name);
+    } else {
+        prev_ie = eq->last;
+        prev_name = eq->last != NULL ? eq->last->name : NULL;
+    }
 
     /* Compare current event with previous to decide if it can be coalesced */
     if (prev_ie != NULL &&
+        !(mask & IN_ADD_COMPLETE) &&
         prev_ie->wd == wd &&
         prev_ie->mask == mask &&
         prev_ie->cookie == cookie &&
       ((prev_ie->len == 0 && name == NULL) ||
-       (prev_ie->len > 0 && name != NULL && !strcmp (prev_ie->name, name)))) {
-
-            int fd = EQ_TO_WRK(eq)->io[INOTIFY_FD];
-            int buffered = 0;
-
-            /* Events are identical and queue is not empty. Skip current. */
-            if (eq->mem_events > 0) {
+       (prev_ie->len > 0 && name != NULL && !strcmp (prev_name, name)))) {
+
+            /*
+             * Events are identical and queue is not empty or the worker
+             * knows that previous one is not read yet. Skip current.
+             * Otherwise user might have read it already, so it is not
+             * worth a syscall to find out. Report current one again.
+             */
+            if (eq->mem_events > 0 || eq->sb_unread) {
+                ++eq->stats.coalesced;
                 return retval;
             }
-            /* Event queue is empty. Check if any events remain in the pipe */
-            if (ioctl (fd, FIONREAD, &buffered) == 0 && buffered > 0) {
+            if (eq->ring != NULL &&
+                event_ring_is_unread (eq->ring, eq->ring_last)) {
+                /* Event queue is empty but user has not reached the ring */
+                ++eq->stats.coalesced;
                 return retval;
             }
     }
 
-    eq->iov[eq->mem_events].iov_base = (void *)create_inotify_event (
-        wd, mask, cookie, name, &eq->iov[eq->mem_events].iov_len);
-    if (eq->iov[eq->mem_events].iov_base == NULL) {
-        perror_msg (("Failed to create a inotify event %x", mask));
+    /* Look for the same event enqueued earlier within coalescing window */
+    if (eq->window != NULL && event_queue_is_windowed (eq, mask) &&
+        event_queue_find_pending (eq, wd, mask, name, &slot)) {
+        ++eq->stats.coalesced;
+        return retval;
+    }
+
+    if (event_queue_put (eq, wd, mask, cookie, name) == -1) {
         return -1;
     }
 
-    ++eq->mem_events;
+    if (slot != NULL) {
+        slot->seq = eq->seq;
+        slot->offset = eq->prev;
+    } else {
+        /* Events are not coalesced across the other events */
+        eq->win_start = eq->seq + 1;
+    }
 
     return retval;
 }
 
 /**
- * Flush inotify events queue to socket
+ * Drop events exceeding the queue limits from the end of event queue.
+ *
+ * Dropped events are replaced with single IN_Q_OVERFLOW as if they have
+ * been enqueued with the current limits. Memory of the ring buffer which
+ * is not needed anymore is released.
+ *
+ * @param[in] eq A pointer to #event_queue.
+ **/
+static void
+event_queue_truncate (struct event_queue *eq)
+{
+    struct inotify_event ie;
+    size_t offset, end, evlen, last = 0, bytes = 0, to_allocate;
+    bool wrapped = false, last_overflow = false;
+    int nevents = 0;
+
+    if (eq->mem_events == 0) {
+        return;
+    }
+
+    offset = eq->head;
+    end = eq->wrap != 0 ? eq->wrap : eq->tail;
+    while (nevents < eq->mem_events) {
+        if (offset == end) {
+            assert (!wrapped && eq->wrap != 0);
+            wrapped = true;
+            offset = 0;
+            end = eq->tail;
+        }
+        evlen = event_queue_peek (eq, offset, &ie);
+        /* Already enqueued IN_Q_OVERFLOW is out of limits */
+        if (ie.mask != IN_Q_OVERFLOW &&
+            (nevents >= eq->max_events ||
+             (eq->max_bytes != 0 && bytes + evlen > eq->max_bytes))) {
+            break;
+        }
+        last_overflow = ie.mask == IN_Q_OVERFLOW;
+        last = offset;
+        offset += evlen;
+        bytes += evlen;
+        ++nevents;
+    }
+
+    if (nevents == eq->mem_events) {
+        return;
+    }
+
+    if (nevents == 0) {
+        eq->head = eq->tail = eq->wrap = 0;
+    } else if (!wrapped) {
+        /* Bottom part of wrapped ring is dropped completely */
+        eq->tail = offset;
+        eq->wrap = 0;
+    } else if (offset == 0) {
+        eq->tail = eq->wrap;
+        eq->wrap = 0;
+    } else {
+        eq->tail = offset;
+    }
+    eq->stats.dropped += eq->mem_events - nevents;
+    if (eq->lat != NULL) {
+        latency_hist_dropped (eq->lat, eq->mem_events - nevents);
+    }
+    eq->prev = last;
+    eq->mem_events = nevents;
+    eq->mem_bytes = bytes;
+
+    if (!last_overflow) {
+        event_queue_put (eq, -1, IN_Q_OVERFLOW, 0, NULL);
+    }
+    eq->overflow = true;
+    eq->win_start = eq->seq + 1;
+
+    to_allocate = event_queue_fit_size (eq, EQ_LAST_SIZE, EQ_INIT_SIZE);
+    if (to_allocate < eq->size) {
+        event_queue_realloc (eq, to_allocate);
+    }
+}
+
+/**
+ * Set maximum length for inotify event queue
+ *
+ * Events enqueued over the new limit are dropped.
+ *
+ * @param[in] eq         A pointer to #event_queue.
+ * @param[in] max_events A maximal length of queue (in events)
+ * @return 0 on success, -1 otherwise.
+ **/
+int
+event_queue_set_max_events (struct event_queue *eq, int max_events)
+{
+    if (max_events <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    eq->max_events = max_events;
+    event_queue_truncate (eq);
+    return 0;
+}
+
+/**
+ * Set maximum size of memory taken by inotify events in the queue
+ *
+ * Events enqueued over the new limit are dropped.
+ *
+ * @param[in] eq        A pointer to #event_queue.
+ * @param[in] max_bytes A maximal size of queued events (in bytes), 0 for
+ *                      unlimited. Should fit the biggest inotify event.
+ * @return 0 on success, -1 otherwise.
+ **/
+int
+event_queue_set_max_bytes (struct event_queue *eq, size_t max_bytes)
+{
+    if (max_bytes != 0 && max_bytes < EQ_LAST_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    eq->max_bytes = max_bytes;
+    event_queue_truncate (eq);
+    return 0;
+}
+
+/**
+ * Reallocate coalescing window hash of inotify event queue.
+ *
+ * @param[in] eq         A pointer to #event_queue.
+ * @param[in] win_events A length of window (in events), 0 to disable.
+ * @param[in] merge      true if pending events are merged.
+ * @return 0 on success, -1 otherwise.
+ **/
+static int
+event_queue_resize_window (struct event_queue *eq, int win_events, bool merge)
+{
+    struct eq_window_slot *window = NULL;
+    size_t size = 0, slots;
+
+    slots = merge && win_events < EQ_MERGE_WINDOW ? EQ_MERGE_WINDOW
+                                                  : (size_t)win_events;
+    if (slots > 0) {
+        /* Keep hash sparse to make collisions rare */
+        size = 1;
+        while (size < slots * 2) {
+            size *= 2;
+        }
+        window = calloc (size, sizeof (struct eq_window_slot));
+        if (window == NULL) {
+            perror_msg (("Failed to allocate coalescing window"));
+            return -1;
+        }
+    }
+
+    free (eq->window);
+    eq->window = window;
+    eq->win_mask = size - 1;
+    eq->win_events = win_events;
+    eq->merge = merge;
+    eq->win_start = eq->seq + 1;
+    return 0;
+}
+
+/**
+ * Set length of coalescing window of inotify event queue
+ *
+ * Events reporting changes of file contents and metadata are dropped if
+ * the same event is pending among win_events last enqueued events and
+ * no other events have been enqueued after it.
+ *
+ * @param[in] eq         A pointer to #event_queue.
+ * @param[in] win_events A length of window (in events), 0 to disable.
+ * @return 0 on success, -1 otherwise.
+ **/
+int
+event_queue_set_window (struct event_queue *eq, int win_events)
+{
+    if (win_events < 0 || win_events > EQ_MAX_WINDOW) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return (event_queue_resize_window (eq, win_events, eq->merge));
+}
+
+/**
+ * Turn merging of pending events of inotify event queue on or off.
+ *
+ * While merging is on, changes and opening or closing of a file are merged
+ * into the event of the same file pending in memory unless other events
+ * have been enqueued after it. Mask of such event is a union of masks of
+ * merged ones.
+ *
+ * @param[in] eq    A pointer to #event_queue.
+ * @param[in] merge true to merge pending events, false to stop it.
+ * @return 0 on success, -1 otherwise.
+ **/
+int
+event_queue_set_merge (struct event_queue *eq, bool merge)
+{
+    if (merge == eq->merge) {
+        return 0;
+    }
+
+    return (event_queue_resize_window (eq, eq->win_events, merge));
+}
+
+/**
+ * Start or stop collection of latency histograms of inotify event queue.
+ *
+ * Starting of collection which is already running clears histograms.
+ *
+ * @param[in] eq     A pointer to #event_queue.
+ * @param[in] enable true to start collection, false to stop it.
+ * @return 0 on success, -1 otherwise.
+ **/
+int
+event_queue_set_latency_hist (struct event_queue *eq, bool enable)
+{
+    if (!enable) {
+        latency_hist_free (eq->lat);
+        eq->lat = NULL;
+    } else if (eq->lat != NULL) {
+        /* Keep marks of events already queued */
+        memset (&eq->lat->lat, 0, sizeof (eq->lat->lat));
+    } else {
+        eq->lat = latency_hist_create ();
+        if (eq->lat == NULL) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Keep a copy of the event sent to user for coalescing checks.
+ *
+ * @param[in] eq     A pointer to #event_queue.
+ * @param[in] offset An offset of the event in the ring buffer.
+ **/
+static void
+event_queue_save_last (struct event_queue *eq, size_t offset)
+{
+    struct inotify_event ie;
+    size_t evlen;
+
+    evlen = event_queue_peek (eq, offset, &ie);
+    if (evlen <= sizeof (eq->last_buf)) {
+        memcpy (eq->last_buf.buf, eq->buf + offset, evlen);
+        eq->last = &eq->last_buf.ie;
+    } else {
+        eq->last = NULL;
+    }
+}
+
+/**
+ * Move inotify events queued in memory to shared memory ring.
+ *
+ * @param[in] eq A pointer to #event_queue.
+ * @return Number of bytes moved to the ring.
+ **/
+static ssize_t
+event_queue_flush_ring (struct event_queue *eq)
+{
+    struct inotify_event ie;
+    size_t evlen, last = 0;
+    ssize_t size = 0;
+    uint64_t start = 0;
+    uint32_t pos;
+    int nevents = 0;
+
+    if (eq->lat != NULL && eq->mem_events > 0) {
+        start = latency_now ();
+    }
+
+    while (eq->mem_events > 0) {
+        if (eq->wrap != 0 && eq->head == eq->wrap) {
+            /* Top part of wrapped ring is over. Continue from the bottom */
+            eq->head = 0;
+            eq->wrap = 0;
+        }
+        evlen = event_queue_peek (eq, eq->head, &ie);
+        if (event_ring_put (eq->ring,
+                            &ie,
+                            eq->buf + eq->head +
+                            offsetof (struct inotify_event, name),
+                            &pos) == -1) {
+            break;
+        }
+        eq->ring_last = pos;
+        last = eq->head;
+        eq->head += evlen;
+        eq->mem_bytes -= evlen;
+        --eq->mem_events;
+        ++nevents;
+        size += evlen;
+    }
+
+    if (size == 0) {
+        return 0;
+    }
+
+    event_ring_commit (eq->ring);
+    event_queue_save_last (eq, last);
+    eq->stats.flushed += size;
+    if (eq->lat != NULL) {
+        latency_hist_flushed (eq->lat, nevents, start);
+    }
+    /* Queue has room for new events again */
+    eq->overflow = false;
+    if (eq->mem_events == 0) {
+        eq->head = eq->tail = eq->wrap = 0;
+    } else if (eq->head == eq->wrap) {
+        eq->head = 0;
+        eq->wrap = 0;
+    }
+
+    return size;
+}
+
+/**
+ * Flush inotify events queue to socket or to shared memory ring
  *
  * @param[in] eq      A pointer to #event_queue.
  * @param[in] sbspace Amount of space in socket buffer available to write
- *                    w/o blocking
+ *                    w/o blocking. Ignored for shared memory ring.
  * @return Number of bytes written to socket on success, -1 otherwise.
  **/
 ssize_t
 event_queue_flush (struct event_queue *eq, size_t sbspace)
 {
-    int iovcnt, iovmax;
+    struct inotify_event ie;
+    struct iovec iov[2];
     int send_flags = 0;
     int fd = EQ_TO_WRK(eq)->io[KQUEUE_FD];
-    size_t iovlen = 0;
+    size_t iovlen[2] = { 0, 0 };
+    size_t offset, end, evlen, last = 0;
+    int iovcnt = 0, nevents = 0;
+    uint64_t start = 0;
     ssize_t size;
-    int i;
 
-    iovmax = eq->mem_events;
-    if (iovmax > IOV_MAX) {
-        iovmax = IOV_MAX;
+    if (eq->ring != NULL) {
+        return (event_queue_flush_ring (eq));
     }
 
-    for (iovcnt = 0; iovcnt < iovmax; iovcnt++) {
-        if (iovlen + eq->iov[iovcnt].iov_len > sbspace) {
+    /* Count events fitting into socket buffer space available */
+    offset = eq->head;
+    end = eq->wrap != 0 ? eq->wrap : eq->tail;
+    while (nevents < eq->mem_events) {
+        if (offset == end) {
+            /* Top part of wrapped ring is over. Continue from the bottom */
+            assert (iovcnt == 0 && eq->wrap != 0);
+            iovcnt = 1;
+            offset = 0;
+            end = eq->tail;
+        }
+        evlen = event_queue_peek (eq, offset, &ie);
+        if (iovlen[0] + iovlen[1] + evlen > sbspace) {
             break;
         }
-        iovlen += eq->iov[iovcnt].iov_len;
+        iovlen[iovcnt] += evlen;
+        last = offset;
+        offset += evlen;
+        ++nevents;
     }
 
-    if (iovcnt == 0) {
+    if (nevents == 0) {
         return 0;
     }
 
+    iov[0].iov_base = eq->buf + eq->head;
+    iov[0].iov_len = iovlen[0];
+    iov[1].iov_base = eq->buf;
+    iov[1].iov_len = iovlen[1];
+
 #if defined (MSG_NOSIGNAL)
     send_flags |= MSG_NOSIGNAL;
 #endif
 
-    size = sendv (fd, eq->iov, iovcnt, send_flags);
-    assert (size == iovlen || size == -1);
+    if (eq->lat != NULL) {
+        start = latency_now ();
+    }
+
+    size = sendv (fd, iov, iovcnt + 1, send_flags);
+    assert (size == iovlen[0] + iovlen[1] || size == -1);
     if (size > 0) {
         /* Save last event sent to communication pipe for coalecsing checks */
-        free (eq->last);
-        eq->last = (void *)eq->iov[iovcnt - 1].iov_base;
-
-        for (i = 0; i < iovcnt - 1; i++) {
-            free (eq->iov[i].iov_base);
+        event_queue_save_last (eq, last);
+
+        eq->mem_events -= nevents;
+        eq->mem_bytes -= size;
+        eq->stats.flushed += size;
+        eq->sb_events += nevents;
+        if (eq->lat != NULL) {
+            latency_hist_flushed (eq->lat, nevents, start);
+        }
+        /* Queue has room for new events again */
+        eq->overflow = false;
+        if (eq->mem_events == 0) {
+            eq->head = eq->tail = eq->wrap = 0;
+        } else if (iovcnt > 0) {
+            /* Top part of wrapped ring has been sent completely. Unwrap */
+            eq->head = offset;
+            eq->wrap = 0;
+        } else if (offset == eq->wrap) {
+            eq->head = 0;
+            eq->wrap = 0;
+        } else {
+            eq->head = offset;
         }
-
-        memmove (&eq->iov[0],
-                 &eq->iov[iovcnt],
-                 sizeof(struct iovec) * (eq->mem_events - iovcnt));
-        eq->mem_events -= iovcnt;
-        eq->sb_events += iovcnt;
     } else {
         perror_msg (("Sending of inotify events to socket failed"));
     }
@@ -270,7 +991,7 @@ event_queue_reset_last (struct event_queue *eq)
 {
     assert (eq != NULL);
 
-    free (eq->last);
     eq->last = NULL;
     eq->sb_events = 0;
+    eq->sb_unread = false;
 }
@@ -25,23 +25,94 @@
 #define __EVENT_QUEUE_H__
 
 #include <sys/types.h> /* uint32_t */
-#include <sys/uio.h>   /* iovec */
+
+#include <stddef.h>    /* offsetof */
+#include <stdint.h>    /* uint64_t */
 
 #include "sys/inotify.h"
 
+#include "compat.h"
+#include "event-ring.h"
+#include "latency-hist.h"
+
+/* Initial size of event queue ring buffer in bytes */
+#define EQ_INIT_SIZE IN_DEF_SOCKBUFSIZE
+
+/* Size of the biggest inotify event with the name which can be coalesced */
+#define EQ_LAST_SIZE (offsetof (struct inotify_event, name) + NAME_MAX + 1)
+
+/* Maximal length of coalescing window in events */
+#define EQ_MAX_WINDOW 65536
+
+/* Length of coalescing window while events pending are merged */
+#define EQ_MERGE_WINDOW 1024
+
+/* Number of adjacent coalescing window slots searched for an event */
+#define EQ_WINDOW_WAYS 4
+
+/* Slot of coalescing window hash: the latest pending event with given hash */
+struct eq_window_slot {
+    uint64_t seq;      /* sequence number of the event, 0 if slot is empty */
+    size_t offset;     /* offset of the event in the ring buffer */
+};
+
+/* Event queue activity counters */
+struct eq_stats {
+    uint64_t enqueued;   /* events placed in the queue */
+    uint64_t coalesced;  /* events coalesced with or merged into others */
+    uint64_t dropped;    /* events lost on queue overflow */
+    uint64_t overflows;  /* IN_Q_OVERFLOW events placed in the queue */
+    uint64_t flushed;    /* bytes of events sent to user */
+    int peak_events;     /* highest number of events enqueued in memory */
+};
+
+/*
+ * Inotify events are stored serialized back to back in the ring buffer.
+ * An event is never split by the ring buffer boundary. If there is not enough
+ * space left at the top of the buffer, event is placed at the bottom and the
+ * top of the data is marked with wrap offset. So the whole queue can always
+ * be sent to the socket with at most 2 iovecs.
+ */
 struct event_queue {
-    struct iovec *iov; /* inotify events to send */
+    char *buf;         /* ring buffer of serialized inotify events */
+    size_t size;       /* size of ring buffer in bytes */
+    size_t head;       /* offset of the first event to send */
+    size_t tail;       /* offset of the first free byte */
+    size_t wrap;       /* end of data at the top of wrapped ring, 0 otherwise */
+    size_t prev;       /* offset of the last event enqueued */
     int sb_events;     /* number of events enqueued in send buffer */
+    bool sb_unread;    /* last event sent is known to be still unread */
     int mem_events;    /* number of events enqueued in memory */
-    int allocated;     /* number of iovs allocated */
     int max_events;    /* max_queued_events */
+    size_t mem_bytes;  /* size of events enqueued in memory */
+    size_t max_bytes;  /* limit of mem_bytes, 0 for unlimited */
+    bool overflow;     /* IN_Q_OVERFLOW is enqueued, new events are dropped */
+    uint64_t seq;      /* sequence number of the last event enqueued */
+    uint64_t win_start;  /* first sequence number coalescing is allowed with */
+    int win_events;    /* length of coalescing window in events, 0 for off */
+    bool merge;        /* pending changes of the same file are merged */
+    size_t win_mask;   /* coalescing window hash size - 1 */
+    struct eq_window_slot *window; /* coalescing window hash or NULL */
+    struct eq_stats stats; /* activity counters */
+    struct inotify_ring *ring; /* ring events are sent to instead of socket */
+    uint32_t ring_last; /* position of the last event sent to ring */
+    struct latency_hist *lat; /* latency histograms or NULL if not collected */
     struct inotify_event *last; /* Last event sent to socket */
+    union {
+        struct inotify_event ie;
+        char buf[EQ_LAST_SIZE];
+    } last_buf;        /* storage for the copy of the last event sent */
 };
 
-void event_queue_init (struct event_queue *eq);
+int  event_queue_init (struct event_queue *eq);
 void event_queue_free (struct event_queue *eq);
+int  event_queue_map_ring (struct event_queue *eq);
 
 int event_queue_set_max_events (struct event_queue *eq, int max_events);
+int event_queue_set_max_bytes  (struct event_queue *eq, size_t max_bytes);
+int event_queue_set_window     (struct event_queue *eq, int win_events);
+int event_queue_set_merge      (struct event_queue *eq, bool merge);
+int event_queue_set_latency_hist (struct event_queue *eq, bool enable);
 
 int  event_queue_enqueue       (struct event_queue *eq,
                                 int                 wd,
@@ -0,0 +1,211 @@
+/*******************************************************************************
+  Copyright (c) 2014-2018 Vladimir Kondratyev <vladimir@kondratyev.su>
+  SPDX-License-Identifier: MIT
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include "compat.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>  /* mmap */
+
+#include <assert.h>    /* assert */
+#include <string.h>    /* memcpy */
+
+#include "sys/inotify.h"
+
+#include "event-ring.h"
+#include "utils.h"
+
+#if !defined (MAP_ANON) && defined (MAP_ANONYMOUS)
+#define MAP_ANON MAP_ANONYMOUS
+#endif
+
+/* Alignment of inotify events in the ring */
+#define ER_ALIGN sizeof (uint32_t)
+
+/**
+ * Allocate and initialize inotify event ring.
+ *
+ * @return A pointer to #inotify_ring on success, NULL otherwise.
+ **/
+struct inotify_ring *
+event_ring_create (void)
+{
+    struct inotify_ring *ring;
+
+    ring = mmap (NULL,
+                 sizeof (struct inotify_ring) + ER_DATA_SIZE,
+                 PROT_READ | PROT_WRITE,
+                 MAP_ANON | MAP_PRIVATE,
+                 -1,
+                 0);
+    if (ring == MAP_FAILED) {
+        perror_msg (("Failed to map event ring of %d bytes", ER_DATA_SIZE));
+        return NULL;
+    }
+
+    atomic_init (&ring->head, 0);
+    atomic_init (&ring->tail, 0);
+    ring->next = 0;
+    ring->size = ER_DATA_SIZE;
+
+    return ring;
+}
+
+/**
+ * Free inotify event ring.
+ *
+ * @param[in] ring A pointer to #inotify_ring.
+ **/
+void
+event_ring_free (struct inotify_ring *ring)
+{
+    if (ring != NULL) {
+        munmap (ring, sizeof (struct inotify_ring) + ring->size);
+    }
+}
+
+/**
+ * Write inotify event to the ring without publishing it to the user.
+ *
+ * Length of the event name is padded with NULs to keep following event
+ * aligned.
+ *
+ * @param[in]  ring A pointer to #inotify_ring.
+ * @param[in]  ie   A pointer to the header of inotify event.
+ * @param[in]  name File name of the event, ie->len bytes long.
+ * @param[out] pos  A position of the event written in the ring.
+ * @return 0 on success, -1 if there is not enough space in the ring.
+ **/
+int
+event_ring_put (struct inotify_ring        *ring,
+                const struct inotify_event *ie,
+                const char                 *name,
+                uint32_t                   *pos)
+{
+    struct inotify_event hdr;
+    uint32_t offset, gap, len, name_len;
+    char *ev;
+
+    name_len = (ie->len + ER_ALIGN - 1) & ~(ER_ALIGN - 1);
+    len = ER_HDR_SIZE + name_len;
+    offset = ring->next & (ring->size - 1);
+    gap = offset + len > ring->size ? ring->size - offset : 0;
+
+    if (gap + len > ring->size - (ring->next - atomic_load (&ring->tail))) {
+        return -1;
+    }
+
+    memset (&hdr, 0, sizeof (hdr));
+    if (gap != 0) {
+        /* Event does not fit at the top of the ring. Skip to the bottom */
+        if (gap >= ER_HDR_SIZE) {
+            hdr.wd = -1;
+            hdr.len = gap - ER_HDR_SIZE;
+            memcpy (ring->data + offset, &hdr, ER_HDR_SIZE);
+        }
+        ring->next += gap;
+        offset = 0;
+    }
+
+    ev = ring->data + offset;
+    hdr = *ie;
+    hdr.len = name_len;
+    memcpy (ev, &hdr, ER_HDR_SIZE);
+    if (name_len > 0) {
+        memcpy (ev + ER_HDR_SIZE, name, ie->len);
+        memset (ev + ER_HDR_SIZE + ie->len, 0, name_len - ie->len);
+    }
+
+    *pos = ring->next;
+    ring->next += len;
+
+    return 0;
+}
+
+/**
+ * Publish events written to the ring to the user.
+ *
+ * @param[in] ring A pointer to #inotify_ring.
+ **/
+void
+event_ring_commit (struct inotify_ring *ring)
+{
+    atomic_store (&ring->head, ring->next);
+}
+
+/**
+ * Get the next inotify event from the ring.
+ *
+ * The event is parsed in place and stays valid until inotify_ring_advance()
+ * call. Padding records are consumed on the way.
+ *
+ * @param[in] ring A pointer to #inotify_ring.
+ * @return A pointer to the event or NULL if the ring is empty.
+ **/
+struct inotify_event *
+inotify_ring_peek (struct inotify_ring *ring)
+{
+    struct inotify_event *ie = NULL;
+    uint32_t head, tail, start, offset;
+
+    assert (ring != NULL);
+
+    tail = start = atomic_load (&ring->tail);
+    head = atomic_load (&ring->head);
+    while (ie == NULL && tail != head) {
+        offset = tail & (ring->size - 1);
+        if (ring->size - offset < ER_HDR_SIZE) {
+            tail += ring->size - offset;
+            continue;
+        }
+        ie = (struct inotify_event *)(ring->data + offset);
+        if (ie->mask == 0) {
+            tail += ER_HDR_SIZE + ie->len;
+            ie = NULL;
+        }
+    }
+
+    if (tail != start) {
+        atomic_store (&ring->tail, tail);
+    }
+
+    return ie;
+}
+
+/**
+ * Consume inotify event returned by the last inotify_ring_peek() call.
+ *
+ * If the ring has not been peeked, the next event is consumed.
+ *
+ * @param[in] ring A pointer to #inotify_ring.
+ **/
+void
+inotify_ring_advance (struct inotify_ring *ring)
+{
+    struct inotify_event *ie;
+
+    ie = inotify_ring_peek (ring);
+    if (ie != NULL) {
+        atomic_store (&ring->tail,
+                      atomic_load (&ring->tail) + ER_HDR_SIZE + ie->len);
+    }
+}
@@ -0,0 +1,98 @@
+/*******************************************************************************
+  Copyright (c) 2014-2018 Vladimir Kondratyev <vladimir@kondratyev.su>
+  SPDX-License-Identifier: MIT
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#ifndef __EVENT_RING_H__
+#define __EVENT_RING_H__
+
+#include <stddef.h>    /* offsetof */
+#include <stdint.h>    /* uint32_t */
+
+#include "sys/inotify.h"
+
+#include "compat.h"
+
+/* Size of event ring data area in bytes. Must be a power of 2 */
+#define ER_DATA_SIZE 65536
+
+/* Size of cache line the ring positions are placed apart by */
+#define ER_CACHELINE 64
+
+/* Size of the header of inotify event in the ring */
+#define ER_HDR_SIZE offsetof (struct inotify_event, name)
+
+/*
+ * Single-producer/single-consumer ring of inotify events shared by worker
+ * thread and user. Positions are free running byte counters taken modulo of
+ * data area size. Events are aligned to 4 bytes and are never split by the
+ * ring boundary, so the user can parse them in place. If an event does not
+ * fit into the space left at the top of data area, the space is skipped. It
+ * is filled with a padding record with zero mask if the header fits there.
+ */
+struct inotify_ring {
+    atomic_uint head;  /* position of the end of published events */
+    uint32_t next;     /* position of the end of events written by worker */
+    char pad0[ER_CACHELINE - sizeof (atomic_uint) - sizeof (uint32_t)];
+    atomic_uint tail;  /* position of the first event not consumed by user */
+    char pad1[ER_CACHELINE - sizeof (atomic_uint)];
+    uint32_t size;     /* size of data area in bytes */
+    char data[];       /* data area */
+};
+
+struct inotify_ring *event_ring_create (void);
+void                 event_ring_free   (struct inotify_ring *ring);
+
+int  event_ring_put    (struct inotify_ring        *ring,
+                        const struct inotify_event *ie,
+                        const char                 *name,
+                        uint32_t                   *pos);
+void event_ring_commit (struct inotify_ring *ring);
+
+/**
+ * Check if all events published to the ring have been consumed by user.
+ *
+ * @param[in] ring A pointer to #inotify_ring.
+ * @return true if ring is empty, false otherwise.
+ **/
+static inline bool
+event_ring_is_empty (struct inotify_ring *ring)
+{
+    return (atomic_load (&ring->head) == atomic_load (&ring->tail));
+}
+
+/**
+ * Check if the event published to the ring has not been reached by user.
+ *
+ * The event at the tail of the ring can be parsed by user at the moment,
+ * so it is treated as read already.
+ *
+ * @param[in] ring A pointer to #inotify_ring.
+ * @param[in] pos  A position of the event in the ring.
+ * @return true if the event is known to be unread, false otherwise.
+ **/
+static inline bool
+event_ring_is_unread (struct inotify_ring *ring, uint32_t pos)
+{
+    return ((int32_t)(pos - atomic_load (&ring->tail)) > 0);
+}
+
+#endif /* __EVENT_RING_H__ */
@@ -29,8 +29,10 @@
 #include <assert.h>    /* assert */
 #include <errno.h>     /* errno */
 #include <fcntl.h>     /* AT_FDCWD */
-#include <stdlib.h>    /* calloc, free */
-#include <string.h>    /* strcmp */
+#include <stdio.h>     /* snprintf */
+#include <stdlib.h>    /* malloc, free */
+#include <string.h>    /* strcmp, strdup, strrchr */
+#include <time.h>      /* clock_gettime */
 #include <unistd.h>    /* close */
 
 #include "sys/inotify.h"
@@ -41,6 +43,15 @@
 #include "watch.h"
 #include "worker.h"
 
+static int iwatch_subdir_cmp (struct i_watch *iw1, struct i_watch *iw2);
+
+RB_GENERATE_INSERT_COLOR(i_watch_tree, i_watch, subdir_link, static)
+RB_GENERATE_REMOVE_COLOR(i_watch_tree, i_watch, subdir_link, static)
+RB_GENERATE_INSERT(i_watch_tree, i_watch, subdir_link, iwatch_subdir_cmp, static)
+RB_GENERATE_REMOVE(i_watch_tree, i_watch, subdir_link, static)
+RB_GENERATE_NEXT(i_watch_tree, i_watch, subdir_link, static)
+RB_GENERATE_MINMAX(i_watch_tree, i_watch, subdir_link, static)
+
 #ifdef SKIP_SUBFILES
 static const char *skip_fs_types[] = { SKIP_SUBFILES };
 
@@ -73,6 +84,46 @@ iwatch_want_skip_subfiles (int fd)
 }
 #endif
 
+/*
+ * Directory timestamps younger than one filesystem timestamp tick can be
+ * left unchanged by a following modification, so they are not trusted.
+ */
+#define IWATCH_FINE_TICK_NS   20000000LL   /* 20 ms, covers 1/HZ timestamps */
+#define IWATCH_COARSE_TICK_NS 2000000000LL /* 2 s, FAT-like filesystems */
+
+/**
+ * Save file status of a watched directory to skip rescans of unchanged one.
+ *
+ * @param[in] iw  A pointer to #i_watch.
+ * @param[in] st  A file status of the directory.
+ * @param[in] now A time taken just before file status has been read.
+ **/
+static void
+iwatch_save_stat (struct i_watch *iw,
+                  const struct stat *st,
+                  const struct timespec *now)
+{
+    const struct timespec *newest;
+    long long age, tick;
+
+    assert (iw != NULL);
+    assert (st != NULL);
+
+    stat_get_times (st, &iw->mtime, &iw->ctime);
+    iw->size = st->st_size;
+    iw->nlink = st->st_nlink;
+
+    /* Whole-second timestamps suggest filesystem with coarse granularity */
+    tick = iw->mtime.tv_nsec == 0 && iw->ctime.tv_nsec == 0
+         ? IWATCH_COARSE_TICK_NS : IWATCH_FINE_TICK_NS;
+    newest = iw->mtime.tv_sec > iw->ctime.tv_sec ||
+             (iw->mtime.tv_sec == iw->ctime.tv_sec &&
+              iw->mtime.tv_nsec > iw->ctime.tv_nsec) ? &iw->mtime : &iw->ctime;
+    age = (now->tv_sec - newest->tv_sec) * 1000000000LL +
+          (now->tv_nsec - newest->tv_nsec);
+    iw->is_settled = age > tick;
+}
+
 /**
  * Preform minimal initialization required for opening watch descriptor
  *
@@ -99,49 +150,61 @@ iwatch_open (const char *path, uint32_t flags)
  * @param[in] wrk    A pointer to #worker.
  * @param[in] fd     A file descriptor of a watched entry.
  * @param[in] flags  A combination of inotify event flags.
- * @return A pointer to a created #i_watch on success NULL otherwise
+ * @param[in] root   A recursive watch for subdirectory or NULL for user watch.
+ * @return A pointer to a created #i_watch on success NULL otherwise. File
+ *     descriptor is left open on failure.
  **/
 struct i_watch *
-iwatch_init (struct worker *wrk, int fd, uint32_t flags)
+iwatch_init (struct worker *wrk, int fd, uint32_t flags, struct i_watch *root)
 {
     struct stat st;
+    struct timespec now;
     struct i_watch *iw;
     struct watch *parent;
-    bool is_new = false;
 
     assert (wrk != NULL);
     assert (fd != -1);
 
+    clock_gettime (CLOCK_REALTIME, &now);
     if (fstat (fd, &st) == -1) {
         perror_msg (("fstat failed on %d", fd));
         return NULL;
     }
 
-    iw = calloc (1, sizeof (struct i_watch));
+    iw = slab_alloc (&wrk->iwcache);
     if (iw == NULL) {
         perror_msg (("Failed to allocate inotify watch"));
         return NULL;
     }
 
-    iw->wd = worker_allocate_wd (wrk);
+    /* Subdirectories report events on behalf of recursive watch */
+    iw->wd = root != NULL ? root->wd : worker_allocate_wd (wrk);
     iw->wrk = wrk;
+    iw->root = root;
+    iw->parent = NULL;
+    iw->path = NULL;
+    iw->name = NULL;
     iw->fd = fd;
     iw->flags = flags;
     iw->mode = st.st_mode & S_IFMT;
     iw->inode = st.st_ino;
     iw->dev = st.st_dev;
     iw->is_closed = false;
+    iw->is_settled = false;
+    iw->diff_fflags = 0;
 
     dl_init (&iw->deps);
+    RB_INIT (&iw->subdirs);
 
     if (S_ISDIR (st.st_mode)) {
-        struct chg_list *deps = dl_listing (fd, NULL);
+        struct chg_list *deps = dl_listing (fd, NULL, &wrk->dipool, &wrk->dirbuf);
         if (deps == NULL) {
             perror_msg (("Directory listing of %d failed", fd));
             iwatch_free (iw);
             return NULL;
         }
         dl_join (&iw->deps, deps);
+        iwatch_save_stat (iw, &st, &now);
 #ifdef SKIP_SUBFILES
         iw->skip_subfiles = iwatch_want_skip_subfiles (fd);
 #endif
@@ -149,28 +212,34 @@ iwatch_init (struct worker *wrk, int fd, uint32_t flags)
 
     parent = watch_set_find (&wrk->watches, iw->dev, iw->inode);
     if (parent == NULL) {
-        parent = watch_init (fd);
+        parent = watch_init (&wrk->wcache, fd, iw->dev, iw->inode);
         if (parent == NULL) {
             iwatch_free (iw);
             return NULL;
         }
-        is_new = true;
+        if (watch_set_insert (&wrk->watches, parent) == -1) {
+            /* Descriptor is closed by caller */
+            parent->fd = -1;
+            watch_free (&wrk->wcache, parent);
+            iwatch_free (iw);
+            return NULL;
+        }
     }
 
     if (watch_add_dep (parent, iw, DI_PARENT) == NULL) {
+        if (watch_deps_empty (parent)) {
+            parent->fd = -1;
+            watch_set_delete (&wrk->watches, parent);
+        }
         iwatch_free (iw);
         return NULL;
     }
 
-    if (is_new) {
-        watch_set_insert (&wrk->watches, parent);
-    }
-
     if (S_ISDIR (st.st_mode)) {
 
         struct dep_item *iter;
         DL_FOREACH (iter, &iw->deps) {
-            iwatch_add_subwatch (iw, iter);
+            iwatch_add_subwatch (iw, iter, true);
         }
     }
     return iw;
@@ -189,6 +258,18 @@ iwatch_free (struct i_watch *iw)
 
     assert (iw != NULL);
 
+    if (iw->diff_fflags != 0) {
+        TAILQ_REMOVE (&iw->wrk->diffs, iw, diff_link);
+    }
+
+    /* unwatch subdirectories */
+    while (!RB_EMPTY (&iw->subdirs)) {
+        iwatch_free (RB_ROOT (&iw->subdirs));
+    }
+    if (iw->parent != NULL) {
+        RB_REMOVE (i_watch_tree, &iw->parent->subdirs, iw);
+    }
+
     /* unwatch subfiles */
     DL_FOREACH (iter, &iw->deps) {
         iwatch_del_subwatch (iw, iter);
@@ -201,19 +282,25 @@ iwatch_free (struct i_watch *iw)
         watch_del_dep (w, iw, DI_PARENT);
     }
 
-    dl_free (&iw->deps);
-    free (iw);
+    dl_free (&iw->deps, &iw->wrk->dipool);
+    free (iw->path);
+    slab_free (&iw->wrk->iwcache, iw);
 }
 
 /**
  * Start watching a file or a directory.
  *
- * @param[in] iw A pointer to #i_watch.
- * @param[in] di A dependency item with relative path to watch.
+ * If worker is out of descriptor budget, watch is created dormant, i.e.
+ * without descriptor opened. Unless lazy is set, least recently active
+ * subwatch is closed to get descriptor for the new one first.
+ *
+ * @param[in] iw   A pointer to #i_watch.
+ * @param[in] di   A dependency item with relative path to watch.
+ * @param[in] lazy Do not close other subwatches to fit the budget.
  * @return A pointer to a created watch.
  **/
 struct watch*
-iwatch_add_subwatch (struct i_watch *iw, struct dep_item *di)
+iwatch_add_subwatch (struct i_watch *iw, struct dep_item *di, bool lazy)
 {
     struct stat st;
     struct watch *w;
@@ -222,7 +309,7 @@ iwatch_add_subwatch (struct i_watch *iw, struct dep_item *di)
     assert (iw != NULL);
     assert (di != NULL);
 
-    if (iw->is_closed) {
+    if (iwatch_get_root (iw)->is_closed) {
         return NULL;
     }
 
@@ -258,23 +345,33 @@ iwatch_add_subwatch (struct i_watch *iw, struct dep_item *di)
         return NULL;
     }
 
-    fd = watch_open (iw->fd, di->path, IN_DONT_FOLLOW);
-    if (fd == -1) {
-        perror_msg (("Failed to open file %s", di->path));
-        goto lstat;
-    }
+    if (worker_reserve_fd (iw->wrk, !lazy)) {
+        fd = watch_open (iw->fd, di->path, IN_DONT_FOLLOW);
+        if (fd == -1) {
+            perror_msg (("Failed to open file %s", di->path));
+            goto lstat;
+        }
 
-    if (fstat (fd, &st) == -1) {
-        perror_msg (("Failed to stat subwatch %s", di->path));
-        close (fd);
-        goto lstat;
+        if (fstat (fd, &st) == -1) {
+            perror_msg (("Failed to stat subwatch %s", di->path));
+            close (fd);
+            goto lstat;
+        }
+    } else {
+        fd = -1;
+        if (fstatat (iw->fd, di->path, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            perror_msg (("Failed to lstat subwatch %s", di->path));
+            return NULL;
+        }
     }
 
     di_settype (di, st.st_mode);
 
     /* Don`t open a watches with empty kqueue filter flags */
     if (inotify_to_kqueue (iw->flags, di->type, false) == 0) {
-        close (fd);
+        if (fd != -1) {
+            close (fd);
+        }
         return NULL;
     }
 
@@ -286,22 +383,37 @@ iwatch_add_subwatch (struct i_watch *iw, struct dep_item *di)
         di->inode = st.st_ino;
         w = watch_set_find (&iw->wrk->watches, iw->dev, di->inode);
         if (w != NULL) {
-            close (fd);
+            if (fd != -1) {
+                close (fd);
+            }
             goto hold;
         }
     }
 
-    w = watch_init (fd);
+    w = watch_init (&iw->wrk->wcache, fd, iw->dev, di->inode);
     if (w == NULL) {
-        close (fd);
+        if (fd != -1) {
+            close (fd);
+        }
+        return NULL;
+    }
+
+    if (watch_set_insert (&iw->wrk->watches, w) == -1) {
+        watch_free (&iw->wrk->wcache, w);
         return NULL;
     }
 
     if (watch_add_dep (w, iw, di) == NULL) {
-        watch_free (w);
+        watch_set_delete (&iw->wrk->watches, w);
         return NULL;
     }
-    watch_set_insert (&iw->wrk->watches, w);
+
+    if (watch_is_dormant (w)) {
+        watch_save_stat (w, &st);
+        ++iw->wrk->ndormant;
+    } else {
+        worker_touch_watch (iw->wrk, w);
+    }
     return w;
 
 hold:
@@ -367,6 +479,43 @@ iwatch_move_subwatch (struct i_watch *iw,
     }
 }
 
+/**
+ * Compare file status of a watched directory with one saved at last listing.
+ *
+ * The status is saved for the next check if it has been changed.
+ *
+ * @param[in] iw A pointer to #i_watch.
+ * @return true if directory is known to be unchanged and need not to be
+ *     rescanned, false otherwise.
+ **/
+bool
+iwatch_refresh_stat (struct i_watch *iw)
+{
+    struct stat st;
+    struct timespec now, mtime, ctime;
+
+    assert (iw != NULL);
+
+    clock_gettime (CLOCK_REALTIME, &now);
+    if (fstat (iw->fd, &st) == -1) {
+        perror_msg (("fstat failed on %d", iw->fd));
+        iw->is_settled = false;
+        return false;
+    }
+
+    stat_get_times (&st, &mtime, &ctime);
+    if (iw->is_settled &&
+        timespec_eq (&mtime, &iw->mtime) &&
+        timespec_eq (&ctime, &iw->ctime) &&
+        st.st_size == iw->size &&
+        st.st_nlink == iw->nlink) {
+        return true;
+    }
+
+    iwatch_save_stat (iw, &st, &now);
+    return false;
+}
+
 /**
  * Update inotify watch flags.
  *
@@ -381,6 +530,7 @@ iwatch_update_flags (struct i_watch *iw, uint32_t flags)
 {
     struct watch *parent;
     struct dep_item *iter;
+    struct i_watch *child;
 
     assert (iw != NULL);
 
@@ -402,11 +552,206 @@ iwatch_update_flags (struct i_watch *iw, uint32_t flags)
         struct watch *w = watch_set_find (&iw->wrk->watches, iw->dev, iter->inode);
         if (w == NULL || watch_find_dep (w, iw, iter) == NULL) {
             /* try to watch  unwatched subfiles */
-            iwatch_add_subwatch (iw, iter);
+            iwatch_add_subwatch (iw, iter, true);
         } else if (inotify_to_kqueue (flags, iter->type, false) == 0) {
             watch_del_dep (w, iw, iter);
         } else {
             watch_update_event (w);
         }
     }
+
+    /* update subdirectories or stop watching them if recursion is disabled */
+    if (flags & IN_RECURSIVE) {
+        RB_FOREACH (child, i_watch_tree, &iw->subdirs) {
+            iwatch_update_flags (child, flags);
+        }
+        iwatch_add_subdirs (iw);
+    } else {
+        while (!RB_EMPTY (&iw->subdirs)) {
+            iwatch_free (RB_ROOT (&iw->subdirs));
+        }
+    }
+}
+
+/**
+ * Compare two subdirectory watches by their names.
+ *
+ * @param[in] iw1 A pointer to the first #i_watch.
+ * @param[in] iw2 A pointer to the second #i_watch.
+ * @return An integer less than, equal to, or greater than zero if name of
+ *     iw1 is found, respectively, to be less than, to match, or be greater
+ *     than name of iw2.
+ **/
+static int
+iwatch_subdir_cmp (struct i_watch *iw1, struct i_watch *iw2)
+{
+    return (strcmp (iw1->name, iw2->name));
+}
+
+/**
+ * Find inotify watch of a subdirectory of recursive watch.
+ *
+ * @param[in] iw A pointer to #i_watch of parent directory.
+ * @param[in] di A dependency item of the subdirectory.
+ * @return A pointer to #i_watch of the subdirectory or NULL if not found.
+ **/
+static struct i_watch *
+iwatch_find_subdir (struct i_watch *iw, const struct dep_item *di)
+{
+    struct i_watch *child = RB_ROOT (&iw->subdirs);
+    int cmp;
+
+    while (child != NULL) {
+        cmp = strcmp (di->path, child->name);
+        if (cmp == 0) {
+            return child;
+        }
+        child = cmp < 0 ? RB_LEFT (child, subdir_link)
+                        : RB_RIGHT (child, subdir_link);
+    }
+    return NULL;
+}
+
+/**
+ * Start watching all the subdirectories of a recursive watch.
+ *
+ * Already watched subdirectories are skipped.
+ *
+ * @param[in] iw A pointer to #i_watch.
+ **/
+void
+iwatch_add_subdirs (struct i_watch *iw)
+{
+    struct dep_item *iter;
+    struct stat st;
+
+    assert (iw != NULL);
+
+    if (!S_ISDIR (iw->mode) || !(iw->flags & IN_RECURSIVE)) {
+        return;
+    }
+
+    DL_FOREACH (iter, &iw->deps) {
+        if (S_ISUNK (iter->type) &&
+            fstatat (iw->fd, iter->path, &st, AT_SYMLINK_NOFOLLOW) != -1) {
+            di_settype (iter, st.st_mode);
+        }
+        if (S_ISDIR (iter->type) && iwatch_find_subdir (iw, iter) == NULL) {
+            iwatch_add_subdir (iw, iter);
+        }
+    }
+}
+
+/**
+ * Start watching a subdirectory of a recursive watch.
+ *
+ * Subdirectory gets its own #i_watch sharing kqueue watches with its parent
+ * through the worker watch set. It is not visible to user. Its events are
+ * reported with descriptor of the recursive watch and path relative to it.
+ *
+ * @param[in] iw A pointer to #i_watch of parent directory.
+ * @param[in] di A dependency item of the subdirectory.
+ * @return A pointer to a created #i_watch on success, NULL otherwise.
+ **/
+struct i_watch *
+iwatch_add_subdir (struct i_watch *iw, struct dep_item *di)
+{
+    struct i_watch *child, *old;
+    struct watch *w;
+    struct stat st;
+    size_t len;
+    char *path;
+    int fd;
+
+    assert (iw != NULL);
+    assert (di != NULL);
+    assert (S_ISDIR (di->type));
+
+    if (iwatch_get_root (iw)->is_closed) {
+        return NULL;
+    }
+
+    if (iw->path != NULL) {
+        len = strlen (iw->path) + strlen (di->path) + 2;
+        path = malloc (len);
+        if (path != NULL) {
+            snprintf (path, len, "%s/%s", iw->path, di->path);
+        }
+    } else {
+        path = strdup (di->path);
+    }
+    if (path == NULL) {
+        perror_msg (("Failed to allocate path of subdirectory %s", di->path));
+        return NULL;
+    }
+
+    /* Directories of recursive watch are never evicted, make room for them */
+    worker_reserve_fd (iw->wrk, true);
+
+    fd = watch_open (iw->fd, di->path, IN_DONT_FOLLOW | IN_ONLYDIR);
+    if (fd == -1) {
+        perror_msg (("Failed to open subdirectory %s", path));
+        free (path);
+        return NULL;
+    }
+
+    if (fstat (fd, &st) == -1) {
+        perror_msg (("Failed to stat subdirectory %s", path));
+        close (fd);
+        free (path);
+        return NULL;
+    }
+
+    w = watch_set_find (&iw->wrk->watches, st.st_dev, st.st_ino);
+    if (w != NULL) {
+        if (watch_is_dormant (w)) {
+            worker_revive_watch (iw->wrk, w, fd);
+        } else {
+            close (fd);
+        }
+        fd = w->fd;
+    }
+
+    child = iwatch_init (iw->wrk, fd, iw->flags, iwatch_get_root (iw));
+    if (child == NULL) {
+        /* Descriptor is not owned by any watch yet */
+        if (w == NULL) {
+            close (fd);
+        }
+        free (path);
+        return NULL;
+    }
+
+    child->path = path;
+    child->name = path + strlen (path) - strlen (di->path);
+    child->parent = iw;
+    /* Watch of directory replaced under the same name is stale */
+    old = RB_INSERT (i_watch_tree, &iw->subdirs, child);
+    if (old != NULL) {
+        iwatch_free (old);
+        RB_INSERT (i_watch_tree, &iw->subdirs, child);
+    }
+    iwatch_add_subdirs (child);
+
+    return child;
+}
+
+/**
+ * Stop watching a subdirectory of a recursive watch and all its descendants.
+ *
+ * @param[in] iw A pointer to #i_watch of parent directory.
+ * @param[in] di A dependency item of the subdirectory.
+ **/
+void
+iwatch_del_subdir (struct i_watch *iw, const struct dep_item *di)
+{
+    struct i_watch *child;
+
+    assert (iw != NULL);
+    assert (di != NULL);
+
+    child = iwatch_find_subdir (iw, di);
+    if (child != NULL) {
+        iwatch_free (child);
+    }
 }
@@ -30,11 +30,19 @@
 
 struct worker;
 
-SLIST_HEAD(i_watch_list, i_watch);
+LIST_HEAD(i_watch_list, i_watch);
+TAILQ_HEAD(i_watch_queue, i_watch);
+RB_HEAD(i_watch_tree, i_watch);
 struct i_watch {
     int wd;                    /* watch descriptor */
     int fd;                    /* file descriptor of parent kqueue watch */
     struct worker *wrk;        /* pointer to a parent worker structure */
+    struct i_watch *root;      /* recursive watch of subdirectory or NULL */
+    struct i_watch *parent;    /* parent directory watch of subdir or NULL */
+    char *path;                /* subdirectory path relative to root watch */
+    const char *name;          /* last component of subdirectory path */
+    struct i_watch_tree subdirs; /* subdirectory watches indexed by name */
+    RB_ENTRY(i_watch) subdir_link; /* link in subdirectories of parent */
     bool is_closed;            /* inotify watch is stopped but not freed yet */
 #ifdef SKIP_SUBFILES
     bool skip_subfiles;        /* Fs is not safe to start subwatches */
@@ -44,20 +52,50 @@ struct i_watch {
     ino_t inode;               /* inode number of watched inode */
     dev_t dev;                 /* device number of watched inode */
     struct dep_list deps;      /* dependence list of inotify watch */
-    SLIST_ENTRY(i_watch) next; /* pointer to the next inotify watch in list */
+    struct timespec mtime;     /* directory modification time at last listing */
+    struct timespec ctime;     /* directory status change time at last listing */
+    off_t size;                /* directory size at last listing */
+    nlink_t nlink;             /* directory link count at last listing */
+    bool is_settled;           /* saved status is older than timestamp tick */
+    uint32_t diff_fflags;      /* kqueue flags of postponed directory diff */
+    TAILQ_ENTRY(i_watch) diff_link; /* link in list of postponed diffs */
+    LIST_ENTRY(i_watch) next;  /* pointer to the next inotify watch in list */
 };
 
 int             iwatch_open (const char *path, uint32_t flags);
-struct i_watch *iwatch_init (struct worker *wrk, int fd, uint32_t flags);
+struct i_watch *iwatch_init (struct worker *wrk,
+                             int fd,
+                             uint32_t flags,
+                             struct i_watch *root);
 void            iwatch_free (struct i_watch *iw);
 
 void     iwatch_update_flags    (struct i_watch *iw, uint32_t flags);
+bool     iwatch_refresh_stat    (struct i_watch *iw);
 
-struct watch* iwatch_add_subwatch  (struct i_watch *iw, struct dep_item *di);
+struct watch* iwatch_add_subwatch  (struct i_watch *iw,
+                                    struct dep_item *di,
+                                    bool lazy);
 void          iwatch_del_subwatch  (struct i_watch *iw,
                                     const struct dep_item *di);
 void          iwatch_move_subwatch (struct i_watch *iw,
                                     const struct dep_item *di_from,
                                     const struct dep_item *di_to);
 
+void            iwatch_add_subdirs (struct i_watch *iw);
+struct i_watch *iwatch_add_subdir  (struct i_watch *iw, struct dep_item *di);
+void            iwatch_del_subdir  (struct i_watch *iw,
+                                    const struct dep_item *di);
+
+/**
+ * Returns recursive watch the #i_watch belongs to.
+ *
+ * @param[in] iw A pointer to #i_watch.
+ * @return A pointer to root #i_watch or iw itself if it is not a subdirectory.
+ **/
+static inline struct i_watch *
+iwatch_get_root (struct i_watch *iw)
+{
+    return (iw->root != NULL ? iw->root : iw);
+}
+
 #endif /* __INOTIFY_WATCH_H__ */
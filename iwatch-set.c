@@ -0,0 +1,231 @@
+/*******************************************************************************
+  Copyright (c) 2014-2018 Vladimir Kondratyev <vladimir@kondratyev.su>
+  SPDX-License-Identifier: MIT
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>  /* errno */
+#include <stddef.h> /* NULL */
+#include <stdint.h> /* uint32_t */
+#include <stdlib.h> /* calloc, free */
+
+#include "compat.h"
+#include "inotify-watch.h"
+#include "iwatch-set.h"
+#include "utils.h"
+
+/* Initial number of hash table slots */
+#define IS_INIT_SIZE 16
+
+/**
+ * Calculate home slot of a watch descriptor in the hash table.
+ *
+ * @param[in] is A pointer to the inotify watch set.
+ * @param[in] wd A watch descriptor.
+ * @return A hash table slot number.
+ **/
+static inline size_t
+iwatch_set_slot (struct iwatch_set *is, int wd)
+{
+    /*
+     * Multiplicative hashing. Low bits of the product are a permutation of
+     * low bits of watch descriptor so sequentially allocated descriptors
+     * do not collide but are scattered over the table.
+     */
+    return (size_t)((uint32_t)wd * 0x9E3779B9U) & (is->size - 1);
+}
+
+/**
+ * Initialize the inotify watch set.
+ *
+ * @param[in] is A pointer to the inotify watch set.
+ **/
+void
+iwatch_set_init (struct iwatch_set *is)
+{
+    assert (is != NULL);
+
+    is->table = NULL;
+    is->size = 0;
+    is->count = 0;
+}
+
+/**
+ * Free the memory allocated for the inotify watch set.
+ *
+ * Inotify watches themselves are not freed.
+ *
+ * @param[in] is A pointer the the inotify watch set.
+ **/
+void
+iwatch_set_free (struct iwatch_set *is)
+{
+    assert (is != NULL);
+
+    free (is->table);
+    iwatch_set_init (is);
+}
+
+/**
+ * Remove an inotify watch from the set.
+ *
+ * @param[in] is A pointer to the inotify watch set.
+ * @param[in] iw A pointer to inotify watch to remove.
+ **/
+void
+iwatch_set_delete (struct iwatch_set *is, struct i_watch *iw)
+{
+    size_t mask, i, j, k;
+
+    assert (is != NULL);
+    assert (iw != NULL);
+    assert (is->count > 0);
+
+    mask = is->size - 1;
+    for (i = iwatch_set_slot (is, iw->wd);
+         is->table[i] != iw;
+         i = (i + 1) & mask) {
+        assert (is->table[i] != NULL);
+    }
+
+    /* Shift following entries of the probe sequence back to avoid tombstones */
+    is->table[i] = NULL;
+    for (j = (i + 1) & mask; is->table[j] != NULL; j = (j + 1) & mask) {
+        k = iwatch_set_slot (is, is->table[j]->wd);
+        /* Keep entry if its home slot lies cyclically in (i, j] */
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+        }
+        is->table[i] = is->table[j];
+        is->table[j] = NULL;
+        i = j;
+    }
+
+    --is->count;
+}
+
+/**
+ * Resize hash table of the inotify watch set.
+ *
+ * @param[in] is   A pointer to #iwatch_set.
+ * @param[in] size A new number of slots, a power of 2.
+ * @return 0 on success, -1 otherwise.
+ **/
+static int
+iwatch_set_resize (struct iwatch_set *is, size_t size)
+{
+    struct iwatch_set new_is;
+    size_t i, slot;
+
+    assert (size > is->count);
+
+    new_is.table = calloc (size, sizeof (struct i_watch *));
+    if (new_is.table == NULL) {
+        perror_msg (("Failed to resize inotify watch set to %zu slots", size));
+        return -1;
+    }
+    new_is.size = size;
+    new_is.count = is->count;
+
+    for (i = 0; i < is->size; i++) {
+        if (is->table[i] != NULL) {
+            slot = iwatch_set_slot (&new_is, is->table[i]->wd);
+            while (new_is.table[slot] != NULL) {
+                slot = (slot + 1) & (size - 1);
+            }
+            new_is.table[slot] = is->table[i];
+        }
+    }
+
+    free (is->table);
+    *is = new_is;
+    return 0;
+}
+
+/**
+ * Insert inotify watch into the set.
+ *
+ * Watch descriptor of the inotify watch must not be present in the set.
+ *
+ * @param[in] is A pointer to #iwatch_set.
+ * @param[in] iw A pointer to inserted inotify watch.
+ * @return 0 on success, -1 otherwise.
+ **/
+int
+iwatch_set_insert (struct iwatch_set *is, struct i_watch *iw)
+{
+    size_t slot, size;
+
+    assert (is != NULL);
+    assert (iw != NULL);
+    assert (iwatch_set_find (is, iw->wd) == NULL);
+
+    /* Keep load factor below 3/4. Table with free slots is still usable */
+    if ((is->count + 1) * 4 > is->size * 3) {
+        size = is->size == 0 ? IS_INIT_SIZE : is->size * 2;
+        if (iwatch_set_resize (is, size) == -1 && is->count + 1 >= is->size) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    slot = iwatch_set_slot (is, iw->wd);
+    while (is->table[slot] != NULL) {
+        slot = (slot + 1) & (is->size - 1);
+    }
+    is->table[slot] = iw;
+    ++is->count;
+
+    return 0;
+}
+
+/**
+ * Find inotify watch by its watch descriptor.
+ *
+ * @param[in] is A pointer to #iwatch_set.
+ * @param[in] wd A watch descriptor.
+ * @return A pointer to inotify watch if found NULL otherwise
+ **/
+struct i_watch *
+iwatch_set_find (struct iwatch_set *is, int wd)
+{
+    struct i_watch *iw;
+    size_t slot, mask;
+
+    assert (is != NULL);
+
+    if (is->count == 0) {
+        return NULL;
+    }
+
+    mask = is->size - 1;
+    for (slot = iwatch_set_slot (is, wd);
+         (iw = is->table[slot]) != NULL;
+         slot = (slot + 1) & mask) {
+        if (iw->wd == wd) {
+            return iw;
+        }
+    }
+
+    return NULL;
+}
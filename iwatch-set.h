@@ -0,0 +1,46 @@
+/*******************************************************************************
+  Copyright (c) 2014-2018 Vladimir Kondratyev <vladimir@kondratyev.su>
+  SPDX-License-Identifier: MIT
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#ifndef __IWATCH_SET_H__
+#define __IWATCH_SET_H__
+
+#include <sys/types.h> /* size_t */
+
+#include "compat.h"
+
+struct i_watch;
+
+/* Open addressing hash table of inotify watches keyed on watch descriptor */
+struct iwatch_set {
+    struct i_watch **table; /* hash table slots */
+    size_t size;            /* number of slots, a power of 2 or 0 */
+    size_t count;           /* number of inotify watches in the set */
+};
+
+void            iwatch_set_init   (struct iwatch_set *is);
+void            iwatch_set_free   (struct iwatch_set *is);
+void            iwatch_set_delete (struct iwatch_set *is, struct i_watch *iw);
+int             iwatch_set_insert (struct iwatch_set *is, struct i_watch *iw);
+struct i_watch *iwatch_set_find   (struct iwatch_set *is, int wd);
+
+#endif /* __IWATCH_SET_H__ */
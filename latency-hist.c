@@ -0,0 +1,196 @@
+/*******************************************************************************
+  Copyright (c) 2014-2018 Vladimir Kondratyev <vladimir@kondratyev.su>
+  SPDX-License-Identifier: MIT
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include "compat.h"
+
+#include <assert.h>    /* assert */
+#include <stdlib.h>    /* calloc, realloc, free */
+#include <string.h>    /* memcpy */
+
+#include "sys/inotify.h"
+
+#include "latency-hist.h"
+#include "utils.h"
+
+/**
+ * Allocate and initialize latency histograms.
+ *
+ * @return A pointer to #latency_hist on success, NULL otherwise.
+ **/
+struct latency_hist *
+latency_hist_create (void)
+{
+    struct latency_hist *lh;
+
+    lh = calloc (1, sizeof (struct latency_hist));
+    if (lh == NULL) {
+        perror_msg (("Failed to allocate latency histograms"));
+    }
+    return lh;
+}
+
+/**
+ * Free latency histograms.
+ *
+ * @param[in] lh A pointer to #latency_hist.
+ **/
+void
+latency_hist_free (struct latency_hist *lh)
+{
+    if (lh != NULL) {
+        free (lh->marks);
+        free (lh);
+    }
+}
+
+/**
+ * Double the ring of batch marks.
+ *
+ * @param[in] lh A pointer to #latency_hist.
+ * @return 0 on success, -1 otherwise.
+ **/
+static int
+latency_hist_grow (struct latency_hist *lh)
+{
+    struct latency_mark *marks;
+    size_t size;
+
+    size = lh->size != 0 ? lh->size * 2 : LH_INIT_MARKS;
+    marks = realloc (lh->marks, size * sizeof (struct latency_mark));
+    if (marks == NULL) {
+        perror_msg (("Failed to grow latency marks to %zu", size));
+        return -1;
+    }
+
+    /* Move wrapped part of the ring above the old top */
+    if (lh->first + lh->count > lh->size) {
+        memcpy (marks + lh->size,
+                marks,
+                (lh->first + lh->count - lh->size) *
+                sizeof (struct latency_mark));
+    }
+    lh->marks = marks;
+    lh->size = size;
+    return 0;
+}
+
+/**
+ * Account an event placed in the event queue.
+ *
+ * Events enqueued outside of kevent batch are timestamped on their own.
+ *
+ * @param[in] lh A pointer to #latency_hist.
+ **/
+void
+latency_hist_enqueued (struct latency_hist *lh)
+{
+    struct latency_mark *mark = NULL;
+    uint64_t now;
+
+    assert (lh != NULL);
+
+    now = latency_now ();
+    if (lh->wakeup != 0) {
+        latency_hist_add (lh, IN_LAT_ENQUEUE, now - lh->wakeup, 1);
+    }
+
+    if (lh->count > 0) {
+        mark = &lh->marks[(lh->first + lh->count - 1) % lh->size];
+        if (lh->wakeup != 0 && mark->wakeup == lh->wakeup) {
+            ++mark->nevents;
+            return;
+        }
+    }
+
+    if (lh->count == lh->size && latency_hist_grow (lh) == -1) {
+        /* Keep event accounted even if its timestamp is lost */
+        if (mark != NULL) {
+            ++mark->nevents;
+        }
+        return;
+    }
+
+    mark = &lh->marks[(lh->first + lh->count) % lh->size];
+    mark->wakeup = lh->wakeup != 0 ? lh->wakeup : now;
+    mark->enqueued = now;
+    mark->nevents = 1;
+    ++lh->count;
+}
+
+/**
+ * Account events sent to user from the head of the event queue.
+ *
+ * @param[in] lh      A pointer to #latency_hist.
+ * @param[in] nevents Number of events flushed.
+ * @param[in] start   Time the flush has been started at.
+ **/
+void
+latency_hist_flushed (struct latency_hist *lh, int nevents, uint64_t start)
+{
+    struct latency_mark *mark;
+    uint64_t now;
+    int n;
+
+    assert (lh != NULL);
+
+    now = latency_now ();
+    latency_hist_add (lh, IN_LAT_FLUSH, now - start, 1);
+
+    while (nevents > 0 && lh->count > 0) {
+        mark = &lh->marks[lh->first];
+        n = nevents < mark->nevents ? nevents : mark->nevents;
+        latency_hist_add (lh, IN_LAT_QUEUED, now - mark->enqueued, n);
+        latency_hist_add (lh, IN_LAT_TOTAL, now - mark->wakeup, n);
+        nevents -= n;
+        mark->nevents -= n;
+        if (mark->nevents == 0) {
+            lh->first = (lh->first + 1) % lh->size;
+            --lh->count;
+        }
+    }
+}
+
+/**
+ * Forget events dropped from the end of the event queue.
+ *
+ * @param[in] lh      A pointer to #latency_hist.
+ * @param[in] nevents Number of events dropped.
+ **/
+void
+latency_hist_dropped (struct latency_hist *lh, int nevents)
+{
+    struct latency_mark *mark;
+    int n;
+
+    assert (lh != NULL);
+
+    while (nevents > 0 && lh->count > 0) {
+        mark = &lh->marks[(lh->first + lh->count - 1) % lh->size];
+        n = nevents < mark->nevents ? nevents : mark->nevents;
+        nevents -= n;
+        mark->nevents -= n;
+        if (mark->nevents == 0) {
+            --lh->count;
+        }
+    }
+}
@@ -0,0 +1,102 @@
+/*******************************************************************************
+  Copyright (c) 2014-2018 Vladimir Kondratyev <vladimir@kondratyev.su>
+  SPDX-License-Identifier: MIT
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#ifndef __LATENCY_HIST_H__
+#define __LATENCY_HIST_H__
+
+#include <stddef.h>    /* size_t */
+#include <stdint.h>    /* uint64_t */
+#include <time.h>      /* clock_gettime */
+
+#include "sys/inotify.h"
+
+#include "compat.h"
+
+/* Initial number of batch marks allocated */
+#define LH_INIT_MARKS 16
+
+/* Events enqueued by the same kevent batch and still queued in memory */
+struct latency_mark {
+    uint64_t wakeup;   /* kevent() return time of the batch, ns */
+    uint64_t enqueued; /* time the first event of the batch was enqueued, ns */
+    int nevents;       /* number of events of the batch queued in memory */
+};
+
+/*
+ * Latency histograms of inotify instance. Events in memory are timestamped
+ * per batch rather than one by one, so marks are kept in FIFO order of the
+ * event queue and are consumed as events are flushed or dropped.
+ */
+struct latency_hist {
+    struct inotify_latency lat; /* histograms reported to user */
+    uint64_t wakeup;           /* kevent() return time of current batch or 0 */
+    struct latency_mark *marks; /* ring of marks of events queued in memory */
+    size_t first;              /* index of the oldest mark */
+    size_t count;              /* number of marks in use */
+    size_t size;               /* number of marks allocated */
+};
+
+struct latency_hist *latency_hist_create (void);
+void                 latency_hist_free   (struct latency_hist *lh);
+
+void latency_hist_enqueued (struct latency_hist *lh);
+void latency_hist_flushed  (struct latency_hist *lh,
+                            int                  nevents,
+                            uint64_t             start);
+void latency_hist_dropped  (struct latency_hist *lh, int nevents);
+
+/**
+ * Read monotonic clock.
+ *
+ * @return Current time in nanoseconds.
+ **/
+static inline uint64_t
+latency_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/**
+ * Add samples of the same value to latency histogram of the stage.
+ *
+ * @param[in] lh    A pointer to #latency_hist.
+ * @param[in] stage Stage of event delivery, one of IN_LAT_* values.
+ * @param[in] ns    Sample value in nanoseconds.
+ * @param[in] count Number of samples.
+ **/
+static inline void
+latency_hist_add (struct latency_hist *lh, int stage, uint64_t ns, int count)
+{
+    int bucket = 0;
+
+    while (ns > 1 && bucket < IN_LAT_BUCKETS - 1) {
+        ns >>= 1;
+        ++bucket;
+    }
+    lh->lat.hist[stage][bucket] += count;
+}
+
+#endif /* __LATENCY_HIST_H__ */
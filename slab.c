@@ -0,0 +1,362 @@
+/*******************************************************************************
+  Copyright (c) 2014-2018 Vladimir Kondratyev <vladimir@kondratyev.su>
+  SPDX-License-Identifier: MIT
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <sys/types.h>
+
+#include <assert.h>
+#include <stddef.h> /* NULL, offsetof */
+#include <stdlib.h> /* calloc, malloc, free */
+#include <string.h> /* memset */
+
+#include "compat.h"
+#include "slab.h"
+#include "utils.h"
+
+/*
+ * Size of the first slab allocation. Each next slab is twice as large up to
+ * SLAB_MAX_BYTES so caches of small instances stay small while large trees
+ * get their objects packed tightly.
+ */
+#define SLAB_BYTES     4096
+#define SLAB_MAX_BYTES (256 * 1024)
+
+/* Strictest alignment required by objects kept in slabs */
+union slab_align {
+    void *p;
+    long long ll;
+    double d;
+};
+
+struct slab {
+    RB_ENTRY(slab) tree_link;       /* link in slabs of cache */
+    LIST_ENTRY(slab) partial_link;  /* link in slabs having free objects */
+    void *free;                     /* list of free objects */
+    size_t count;                   /* number of objects */
+    size_t used;                    /* number of allocated objects */
+    union slab_align objects[FLEXIBLE_ARRAY_MEMBER];
+};
+
+#define SLAB_HDR_SIZE offsetof (struct slab, objects)
+
+static int
+slab_cmp (struct slab *s1, struct slab *s2)
+{
+    uintptr_t a1 = (uintptr_t)s1, a2 = (uintptr_t)s2;
+
+    return (a1 > a2) - (a1 < a2);
+}
+
+RB_GENERATE_INSERT_COLOR(slab_tree, slab, tree_link, static)
+RB_GENERATE_REMOVE_COLOR(slab_tree, slab, tree_link, static)
+RB_GENERATE_INSERT(slab_tree, slab, tree_link, slab_cmp, static)
+RB_GENERATE_REMOVE(slab_tree, slab, tree_link, static)
+
+/**
+ * Initialize a slab cache.
+ *
+ * Objects too large to fit a slab are allocated with calloc().
+ *
+ * @param[in] sc   A pointer to #slab_cache.
+ * @param[in] size A size of cached objects.
+ **/
+void
+slab_cache_init (struct slab_cache *sc, size_t size)
+{
+    const size_t align = sizeof (union slab_align);
+
+    assert (sc != NULL);
+    assert (size > 0);
+
+    sc->size = (size + align - 1) / align * align;
+    sc->count = (SLAB_BYTES - SLAB_HDR_SIZE) / sc->size;
+    RB_INIT (&sc->slabs);
+    LIST_INIT (&sc->partial);
+    sc->empty = NULL;
+}
+
+/**
+ * Free all the slabs of a slab cache.
+ *
+ * All the objects allocated from cache are freed as well.
+ *
+ * @param[in] sc A pointer to #slab_cache.
+ **/
+void
+slab_cache_destroy (struct slab_cache *sc)
+{
+    struct slab *slab;
+
+    assert (sc != NULL);
+
+    while (!RB_EMPTY (&sc->slabs)) {
+        slab = RB_ROOT (&sc->slabs);
+        RB_REMOVE (slab_tree, &sc->slabs, slab);
+        free (slab);
+    }
+    LIST_INIT (&sc->partial);
+    sc->empty = NULL;
+}
+
+/**
+ * Allocate a new slab and add it to a slab cache.
+ *
+ * @param[in] sc A pointer to #slab_cache.
+ * @return A pointer to a new slab on success, NULL otherwise.
+ **/
+static struct slab *
+slab_create (struct slab_cache *sc)
+{
+    struct slab *slab;
+    char *obj;
+    size_t i;
+
+    slab = malloc (SLAB_HDR_SIZE + sc->count * sc->size);
+    if (slab == NULL) {
+        perror_msg (("Failed to allocate slab"));
+        return NULL;
+    }
+    slab->count = sc->count;
+    slab->used = 0;
+
+    /* Thread new objects to free list keeping their order */
+    obj = (char *)slab->objects;
+    for (i = 0; i < slab->count; i++, obj += sc->size) {
+        *(void **)obj = i + 1 < slab->count ? obj + sc->size : NULL;
+    }
+    slab->free = slab->objects;
+
+    RB_INSERT (slab_tree, &sc->slabs, slab);
+    LIST_INSERT_HEAD (&sc->partial, slab, partial_link);
+
+    if (SLAB_HDR_SIZE + sc->count * sc->size * 2 <= SLAB_MAX_BYTES) {
+        sc->count *= 2;
+    }
+    return slab;
+}
+
+/**
+ * Find a slab of a slab cache holding an object.
+ *
+ * @param[in] sc  A pointer to #slab_cache.
+ * @param[in] ptr A pointer to an object allocated from the cache.
+ * @return A pointer to the slab or NULL if not found.
+ **/
+static struct slab *
+slab_find (struct slab_cache *sc, void *ptr)
+{
+    struct slab *slab = RB_ROOT (&sc->slabs);
+    uintptr_t addr = (uintptr_t)ptr;
+
+    while (slab != NULL) {
+        if (addr < (uintptr_t)slab->objects) {
+            slab = RB_LEFT (slab, tree_link);
+        } else if (addr >= (uintptr_t)slab->objects +
+                           slab->count * sc->size) {
+            slab = RB_RIGHT (slab, tree_link);
+        } else {
+            return slab;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Allocate a zeroed object from a slab cache.
+ *
+ * @param[in] sc A pointer to #slab_cache.
+ * @return A pointer to an object on success, NULL otherwise.
+ **/
+void *
+slab_alloc (struct slab_cache *sc)
+{
+    struct slab *slab;
+    void *obj;
+
+    assert (sc != NULL);
+
+    if (sc->count == 0) {
+        return calloc (1, sc->size);
+    }
+
+    slab = LIST_FIRST (&sc->partial);
+    if (slab == NULL) {
+        slab = slab_create (sc);
+        if (slab == NULL) {
+            return NULL;
+        }
+    }
+
+    obj = slab->free;
+    slab->free = *(void **)obj;
+    if (slab->free == NULL) {
+        LIST_REMOVE (slab, partial_link);
+    }
+    if (slab == sc->empty) {
+        sc->empty = NULL;
+    }
+    ++slab->used;
+
+    memset (obj, 0, sc->size);
+    return obj;
+}
+
+/**
+ * Return an object to a slab cache.
+ *
+ * Slabs left with no objects allocated are freed except one kept as spare,
+ * so cache footprint follows its usage without malloc() calls on every
+ * allocation at slab boundary.
+ *
+ * @param[in] sc  A pointer to #slab_cache the object is allocated from.
+ * @param[in] ptr A pointer to an object. May be NULL.
+ **/
+void
+slab_free (struct slab_cache *sc, void *ptr)
+{
+    struct slab *slab;
+
+    assert (sc != NULL);
+
+    if (ptr == NULL) {
+        return;
+    }
+    if (sc->count == 0) {
+        free (ptr);
+        return;
+    }
+
+    slab = slab_find (sc, ptr);
+    assert (slab != NULL);
+    assert (slab->used > 0);
+
+    if (slab->free == NULL) {
+        LIST_INSERT_HEAD (&sc->partial, slab, partial_link);
+    }
+    *(void **)ptr = slab->free;
+    slab->free = ptr;
+
+    if (--slab->used > 0) {
+        return;
+    }
+    if (sc->empty == NULL) {
+        sc->empty = slab;
+        return;
+    }
+    RB_REMOVE (slab_tree, &sc->slabs, slab);
+    LIST_REMOVE (slab, partial_link);
+    free (slab);
+}
+
+/**
+ * Initialize a slab pool.
+ *
+ * @param[in] sp       A pointer to #slab_pool.
+ * @param[in] min_size A size of objects in the smallest class.
+ **/
+void
+slab_pool_init (struct slab_pool *sp, size_t min_size)
+{
+    size_t i;
+
+    assert (sp != NULL);
+
+    for (i = 0; i < SLAB_POOL_CLASSES; i++) {
+        slab_cache_init (&sp->classes[i], min_size << i);
+    }
+}
+
+/**
+ * Free all the slabs of a slab pool.
+ *
+ * @param[in] sp A pointer to #slab_pool.
+ **/
+void
+slab_pool_destroy (struct slab_pool *sp)
+{
+    size_t i;
+
+    assert (sp != NULL);
+
+    for (i = 0; i < SLAB_POOL_CLASSES; i++) {
+        slab_cache_destroy (&sp->classes[i]);
+    }
+}
+
+/**
+ * Find the smallest class of a slab pool fitting an object.
+ *
+ * @param[in] sp   A pointer to #slab_pool.
+ * @param[in] size A size of object.
+ * @return A pointer to #slab_cache or NULL if object is too large.
+ **/
+static struct slab_cache *
+slab_pool_class (struct slab_pool *sp, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < SLAB_POOL_CLASSES; i++) {
+        if (size <= sp->classes[i].size) {
+            return &sp->classes[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Allocate a zeroed object from a slab pool.
+ *
+ * @param[in] sp   A pointer to #slab_pool. If NULL, calloc() is used.
+ * @param[in] size A size of object.
+ * @return A pointer to an object on success, NULL otherwise.
+ **/
+void *
+slab_pool_alloc (struct slab_pool *sp, size_t size)
+{
+    struct slab_cache *sc;
+
+    sc = sp != NULL ? slab_pool_class (sp, size) : NULL;
+    if (sc == NULL) {
+        return calloc (1, size);
+    }
+    return slab_alloc (sc);
+}
+
+/**
+ * Return an object to a slab pool.
+ *
+ * @param[in] sp   A pointer to #slab_pool. If NULL, free() is used.
+ * @param[in] ptr  A pointer to an object. May be NULL.
+ * @param[in] size A size of object passed to slab_pool_alloc().
+ **/
+void
+slab_pool_free (struct slab_pool *sp, void *ptr, size_t size)
+{
+    struct slab_cache *sc;
+
+    sc = sp != NULL ? slab_pool_class (sp, size) : NULL;
+    if (sc == NULL) {
+        free (ptr);
+        return;
+    }
+    slab_free (sc, ptr);
+}
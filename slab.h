@@ -0,0 +1,63 @@
+/*******************************************************************************
+  Copyright (c) 2014-2018 Vladimir Kondratyev <vladimir@kondratyev.su>
+  SPDX-License-Identifier: MIT
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <sys/types.h> /* size_t */
+#include <sys/queue.h>
+
+#include "compat.h"
+
+/* Number of size classes in a slab pool */
+#define SLAB_POOL_CLASSES 4
+
+struct slab;
+RB_HEAD(slab_tree, slab);
+LIST_HEAD(slab_list, slab);
+
+/* Cache of fixed-size objects carved out of larger slabs */
+struct slab_cache {
+    size_t size;              /* object size rounded up to alignment */
+    size_t count;             /* number of objects in the next slab */
+    struct slab_tree slabs;   /* allocated slabs ordered by address */
+    struct slab_list partial; /* slabs having free objects */
+    struct slab *empty;       /* spare slab with no objects allocated */
+};
+
+/* Caches of variable-size objects with sizes doubled from class to class */
+struct slab_pool {
+    struct slab_cache classes[SLAB_POOL_CLASSES];
+};
+
+void  slab_cache_init    (struct slab_cache *sc, size_t size);
+void  slab_cache_destroy (struct slab_cache *sc);
+void *slab_alloc         (struct slab_cache *sc);
+void  slab_free          (struct slab_cache *sc, void *ptr);
+
+void  slab_pool_init     (struct slab_pool *sp, size_t min_size);
+void  slab_pool_destroy  (struct slab_pool *sp);
+void *slab_pool_alloc    (struct slab_pool *sp, size_t size);
+void  slab_pool_free     (struct slab_pool *sp, void *ptr, size_t size);
+
+#endif /* __SLAB_H__ */
@@ -8,6 +8,7 @@
 #include <inttypes.h>
 #define LIBINOTIFY_FLEXIBLE_ARRAY_MEMBER 0
 #endif
+#include <stddef.h> /* size_t */
 
 #ifndef __THROW
   #ifdef __cplusplus
@@ -33,10 +34,82 @@
 /* linux`s /proc/sys/fs/inotify/max_user_instances counterpart */
 #define IN_MAX_USER_INSTANCES		2
 #define IN_DEF_MAX_USER_INSTANCES	2147483646
+/*
+ * Libinotify-specific: Maximal number of kqueue events harvested by worker
+ * thread with single kevent(2) call. Events are processed in batches and
+ * communication socket is flushed once per batch. Worker thread pool uses
+ * a global value set with fd -1 before the pool is started.
+ */
+#define IN_KEVENT_BATCH			3
+#define IN_DEF_KEVENT_BATCH		64
+/*
+ * Libinotify-specific: Number of worker threads shared by all inotify
+ * instances created afterwards. 0 starts a dedicated worker thread for
+ * each instance. -1 sizes the pool to the number of online CPUs.
+ */
+#define IN_WORKER_THREADS		4
+#define IN_DEF_WORKER_THREADS		0
+/*
+ * Libinotify-specific: Maximal number of file descriptors opened by inotify
+ * instance for watching. When exceeded, least recently active files in
+ * watched directories are closed and checked with fstatat(2) on directory
+ * rescans and once a second instead. 0 means no limit.
+ */
+#define IN_MAX_WATCH_FDS		5
+#define IN_DEF_MAX_WATCH_FDS		0
+/*
+ * Libinotify-specific: Size of buffer used by inotify instance to read
+ * directory entries with getdents(2) on directory rescans. 0 makes
+ * directories read with readdir(3). Ignored if getdents(2) is unavailable.
+ */
+#define IN_READDIR_BUFSIZE		6
+#define IN_DEF_READDIR_BUFSIZE		65536
+/*
+ * Libinotify-specific: Maximal amount of memory in bytes taken by events
+ * queued by inotify instance and not sent to the communication socket yet.
+ * Complements IN_MAX_QUEUED_EVENTS as events with long names take more
+ * memory than ones without names. 0 means no limit.
+ */
+#define IN_MAX_QUEUED_BYTES		7
+#define IN_DEF_MAX_QUEUED_BYTES		0
+/*
+ * Libinotify-specific: Number of last queued events searched for the
+ * duplicate of IN_ACCESS, IN_MODIFY or IN_ATTRIB event being queued. The
+ * duplicate is dropped if no other kinds of events have been queued after
+ * the original. 0 coalesces only identical consecutive events.
+ */
+#define IN_COALESCE_WINDOW		8
+#define IN_DEF_COALESCE_WINDOW		0
+/*
+ * Libinotify-specific: Latency of event delivery in milliseconds. Events are
+ * held back by inotify instance for that long after the first of them has
+ * been queued. Changes, opening and closing of the same file reported in the
+ * meantime are merged into one event. 0 delivers events at once.
+ */
+#define IN_LATENCY			9
+#define IN_DEF_LATENCY			0
+/*
+ * Libinotify-specific: Upper limit of communication socket buffer size in
+ * bytes. If set above IN_SOCKBUFSIZE, the buffer grows up to the limit while
+ * events keep backing up in the memory of inotify instance and shrinks back
+ * to IN_SOCKBUFSIZE when traffic is light. Consumers should read events with
+ * buffers of that size. 0 disables autotuning.
+ */
+#define IN_SOCKBUFSIZE_MAX		10
+#define IN_DEF_SOCKBUFSIZE_MAX		0
+/*
+ * Libinotify-specific: Collect histograms of event delivery latency by stages
+ * for inotify_get_latency(). 1 starts collection from scratch, 0 stops it.
+ * Instances not collecting histograms do not read clocks at all.
+ */
+#define IN_LATENCY_HIST			11
+#define IN_DEF_LATENCY_HIST		0
 
 /* Flags for the parameter of inotify_init1. */
 #define IN_CLOEXEC	02000000	/* Linux x86 O_CLOEXEC */
 #define IN_NONBLOCK	00004000	/* Linux x86 O_NONBLOCK */
+#define IN_SHMRING	010000000000	/* Libinotify specific. Deliver events
+					   through shared memory ring.  */
 
 
 /* Structure describing an inotify event. */
@@ -72,12 +145,17 @@ __extension__ struct inotify_event
 #define IN_UNMOUNT	 0x00002000	/* Backing fs was unmounted.  */
 #define IN_Q_OVERFLOW	 0x00004000	/* Event queued overflowed.  */
 #define IN_IGNORED	 0x00008000	/* File was ignored.  */
+#define IN_ADD_COMPLETE	 0x00010000	/* Libinotify specific.
+					   inotify_add_watch_async() call
+					   completed.  */
 
 #define IN_ONLYDIR	 0x01000000	/* Only watch the path if it is a
 					   directory.  */
 #define IN_DONT_FOLLOW	 0x02000000	/* Do not follow a sym link.  */
 #define IN_EXCL_UNLINK	 0x04000000	/* Exclude events on unlinked
 					   objects.  */
+#define IN_RECURSIVE	 0x08000000	/* Libinotify specific. Watch the
+					   whole directory tree.  */
 #define IN_MASK_ADD	 0x20000000	/* Add to the mask of an already
 					   existing watch.  */
 #define IN_ISDIR	 0x40000000	/* Event occurred against dir.  */
@@ -105,12 +183,89 @@ int inotify_init1 (int flags) __THROW;
    events specified by MASK. */
 int inotify_add_watch (int fd, const char *name, uint32_t mask) __THROW;
 
+/* Libinotify specific. Add watch of object NAME to inotify-kqueue instance
+   FD asynchronously. Result is reported with IN_ADD_COMPLETE event carrying
+   TAG in its cookie field and watch descriptor or negated errno value in its
+   wd field. */
+int inotify_add_watch_async (int fd, const char *name, uint32_t mask,
+                             uint32_t tag) __THROW;
+
+/* Libinotify specific. Add watches of N objects NAMES to inotify-kqueue
+   instance FD with a single worker round-trip. Notify about events specified
+   by MASKS. Store watch descriptors or negated errno values to WDS. */
+int inotify_add_watches (int fd, const char *const names[],
+                         const uint32_t masks[], int wds[], size_t n) __THROW;
+
 /* Remove the watch specified by WD from the inotify instance FD. */
 int inotify_rm_watch (int fd, int wd) __THROW;
 
 /* Libinotify specific. Set inotify instance parameter. */
 int inotify_set_param (int fd, int param, intptr_t value) __THROW;
 
+/* Libinotify specific. Shared memory ring of inotify-kqueue instance. */
+struct inotify_ring;
+
+/* Libinotify specific. Return shared memory event ring of inotify-kqueue
+   instance FD created with IN_SHMRING flag. The ring is valid until FD is
+   closed. */
+struct inotify_ring *inotify_map_ring (int fd) __THROW;
+
+/* Libinotify specific. Return the next event stored in RING without copying
+   or NULL if RING is empty. */
+struct inotify_event *inotify_ring_peek (struct inotify_ring *ring) __THROW;
+
+/* Libinotify specific. Release the event returned by inotify_ring_peek. */
+void inotify_ring_advance (struct inotify_ring *ring) __THROW;
+
+/* Libinotify specific. Activity counters of inotify-kqueue instance. */
+struct inotify_stats
+{
+  uint64_t kevents;		/* kqueue events received.  */
+  uint64_t events_enqueued;	/* Events placed in the queue.  */
+  uint64_t events_coalesced;	/* Events coalesced with queued ones.  */
+  uint64_t events_dropped;	/* Events lost on queue overflow.  */
+  uint64_t overflows;		/* IN_Q_OVERFLOW events generated.  */
+  uint64_t rescans;		/* Directory listings read.  */
+  uint64_t rescans_skipped;	/* Listings skipped as dir is unchanged.  */
+  uint64_t entries_scanned;	/* Directory entries read by rescans.  */
+  uint64_t bytes_flushed;	/* Bytes of events sent to user.  */
+  uint32_t open_fds;		/* File descriptors held by watches.  */
+  uint32_t watches;		/* Files watched with kqueue.  */
+  uint32_t queued_events;	/* Events waiting for flush.  */
+  uint32_t peak_queued_events;	/* Highest number of queued events.  */
+  uint32_t sockbufsize;		/* Current socket buffer size.  */
+};
+
+/* Libinotify specific. Store activity counters of inotify-kqueue instance
+   FD to STATS. */
+int inotify_get_stats (int fd, struct inotify_stats *stats) __THROW;
+
+/* Libinotify specific. Stages of event delivery latency histograms.  */
+#define IN_LAT_WAKEUP	0	/* kevent() return to kevent processing.  */
+#define IN_LAT_NOTIFY	1	/* Processing of file change kevent.  */
+#define IN_LAT_DIFF	2	/* Rescans of directories changed in batch.  */
+#define IN_LAT_ENQUEUE	3	/* kevent() return to event queued.  */
+#define IN_LAT_QUEUED	4	/* Event queued to event flushed.  */
+#define IN_LAT_FLUSH	5	/* Flush of queued events.  */
+#define IN_LAT_TOTAL	6	/* kevent() return to event visible to user.  */
+#define IN_LAT_STAGES	7
+
+/* Libinotify specific. Bucket N counts samples from 2^N to 2^(N+1)-1 ns,
+   bucket 0 also counts 0 ns and the last one counts all longer samples.  */
+#define IN_LAT_BUCKETS	40
+
+/* Libinotify specific. Log-bucketed latency histograms of inotify-kqueue
+   instance.  */
+struct inotify_latency
+{
+  uint64_t hist[IN_LAT_STAGES][IN_LAT_BUCKETS];
+};
+
+/* Libinotify specific. Store latency histograms of inotify-kqueue instance
+   FD to LAT. Histograms are collected since IN_LATENCY_HIST parameter has
+   been set to 1. Fails with EINVAL if histograms are not collected. */
+int inotify_get_latency (int fd, struct inotify_latency *lat) __THROW;
+
 __END_DECLS
 
 #endif /* __BSD_INOTIFY_H__ */
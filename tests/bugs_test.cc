@@ -137,6 +137,27 @@ void bugs_test::run ()
     should ("receive IN_MODIFY for bugst-workdir/2 on echo",
             contains (received, event ("2", wid, IN_MODIFY)));
 
+
+    /* Test modification and unlink of a file in just changed directory */
+    cons.input.setup ("bugst-workdir",
+                      IN_ATTRIB | IN_MODIFY | IN_CREATE | IN_DELETE);
+    cons.output.wait ();
+    wid = cons.output.added_watch_id ();
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    /* Kevents of directory and its file are harvested in the same batch */
+    system ("touch bugst-workdir/3 && echo test >> bugst-workdir/2 && "
+            "rm bugst-workdir/2");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("receive IN_CREATE for bugst-workdir/3 in the same batch",
+            contains (received, event ("3", wid, IN_CREATE)));
+    should ("receive IN_DELETE for modified bugst-workdir/2 in the same batch",
+            contains (received, event ("2", wid, IN_DELETE)));
+
     cons.input.interrupt ();
 }
 
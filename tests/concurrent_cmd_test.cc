@@ -0,0 +1,112 @@
+/*******************************************************************************
+  Copyright (c) 2016 Vladimir Kondratyev <vladimir@kondratyev.su>
+  SPDX-License-Identifier: MIT
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+
+#include <pthread.h>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "concurrent_cmd_test.hh"
+
+#define THREADS 4
+#define FILES   8
+#define ROUNDS  25
+
+struct cct_thread {
+    pthread_t thread;
+    int fd;
+    int index;
+    bool passed;
+};
+
+/* Repeatedly add and remove watches of its own set of files */
+static void *
+cct_run (void *arg)
+{
+    struct cct_thread *ct = (struct cct_thread *) arg;
+    int wid[FILES];
+
+    ct->passed = true;
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < FILES; i++) {
+            char path[64];
+            snprintf (path, sizeof (path), "cct-working/%d-%d", ct->index, i);
+            wid[i] = inotify_add_watch (ct->fd, path, IN_ATTRIB);
+            ct->passed = ct->passed && wid[i] > 0;
+        }
+        for (int i = 0; i < FILES; i++) {
+            ct->passed = ct->passed && inotify_rm_watch (ct->fd, wid[i]) == 0;
+        }
+    }
+    return NULL;
+}
+
+concurrent_cmd_test::concurrent_cmd_test (journal &j)
+: test ("Concurrent commands", j)
+{
+}
+
+void concurrent_cmd_test::setup ()
+{
+    cleanup ();
+    system ("mkdir cct-working");
+    for (int i = 0; i < THREADS; i++) {
+        for (int k = 0; k < FILES; k++) {
+            char cmd[64];
+            snprintf (cmd, sizeof (cmd), "touch cct-working/%d-%d", i, k);
+            system (cmd);
+        }
+    }
+}
+
+void concurrent_cmd_test::run ()
+{
+    struct cct_thread ct[THREADS];
+    bool passed = true;
+    int fd;
+
+    fd = inotify_init ();
+    if (!should ("inotify instance is created", fd != -1)) {
+        return;
+    }
+
+    for (int i = 0; i < THREADS; i++) {
+        ct[i].fd = fd;
+        ct[i].index = i;
+        pthread_create (&ct[i].thread, NULL, cct_run, &ct[i]);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join (ct[i].thread, NULL);
+        passed = passed && ct[i].passed;
+    }
+    should ("watches are added and removed from several threads at once",
+            passed);
+
+    close (fd);
+}
+
+void concurrent_cmd_test::cleanup ()
+{
+    system ("rm -rf cct-working");
+}
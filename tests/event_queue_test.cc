@@ -21,6 +21,7 @@
   THE SOFTWARE.
 *******************************************************************************/
 
+#include <cerrno>
 #include <cstdlib>
 #include <unistd.h>
 #include <iostream>
@@ -37,6 +38,11 @@
 #define QUEUED_EVENTS  64
 #define PIPED_EVENTS   64
 #define EVENT_INTERVAL 2000   /* max time to process kqueue event by worker, us */
+#define QUEUED_BYTES   512    /* fits about 30 events of the test */
+#define LATENCY        1000   /* longer than 8 touches take, ms */
+#define SHRINK_DRAINS  16     /* light drains to shrink socket buffer after */
+#define DRAIN_INTERVAL 20000  /* time for consumer to drain socket, us */
+#define SHRINK_WAIT    1000   /* longer than SHRINK_DRAINS touches take, ms */
 #endif
 
 event_queue_test::event_queue_test (journal &j)
@@ -49,6 +55,8 @@ void event_queue_test::setup ()
     cleanup ();
     system ("mkdir eqt-working");
     system ("touch eqt-working/1");
+    system ("touch eqt-working/2");
+    system ("touch eqt-working/3");
 }
 
 void event_queue_test::run ()
@@ -126,6 +134,189 @@ void event_queue_test::run ()
     should ("receive IN_Q_OVERFLOW on many consecutive touches",
             contains (received, event ("", -1, IN_Q_OVERFLOW)));
 
+#ifndef __linux__
+    /* Fill the socket and half of the queue, then cut the queue length */
+    cons.output.reset ();
+
+    for (int i = 0; i < (QUEUED_EVENTS / 2 + PIPED_EVENTS) / 2; i++) {
+        system ("touch eqt-working");
+        usleep (EVENT_INTERVAL);
+        system ("touch eqt-working/1");
+        usleep (EVENT_INTERVAL);
+    }
+    inotify_set_param (cons.get_fd (), IN_MAX_QUEUED_EVENTS, QUEUED_EVENTS / 8);
+
+    cons.input.receive ();
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("receive IN_Q_OVERFLOW on lowering of queue length limit",
+            contains (received, event ("", -1, IN_Q_OVERFLOW)));
+
+
+    should ("queued bytes limit less than an event size is rejected",
+            inotify_set_param (cons.get_fd (), IN_MAX_QUEUED_BYTES,
+                               sizeof (struct inotify_event)) == -1
+            && errno == EINVAL);
+    inotify_set_param (cons.get_fd (), IN_MAX_QUEUED_EVENTS, QUEUED_EVENTS);
+    should ("queued bytes limit is set",
+            inotify_set_param (cons.get_fd (), IN_MAX_QUEUED_BYTES,
+                               QUEUED_BYTES) == 0);
+    cons.output.reset ();
+
+    for (int i = 0; i < (QUEUED_EVENTS + PIPED_EVENTS) / 2 + 1; i++) {
+        system ("touch eqt-working");
+        usleep (EVENT_INTERVAL);
+        system ("touch eqt-working/1");
+        usleep (EVENT_INTERVAL);
+    }
+
+    cons.input.receive ();
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("receive IN_Q_OVERFLOW on exceeding of queued bytes limit",
+            contains (received, event ("", -1, IN_Q_OVERFLOW)));
+
+
+    /* Fill the socket to keep interleaved events queued in memory */
+    inotify_set_param (cons.get_fd (), IN_MAX_QUEUED_BYTES, 0);
+    should ("coalescing window is set",
+            inotify_set_param (cons.get_fd (), IN_COALESCE_WINDOW, 8) == 0);
+    cons.output.reset ();
+
+    for (int i = 0; i < PIPED_EVENTS / 2 + 1; i++) {
+        system ("touch eqt-working");
+        usleep (EVENT_INTERVAL);
+        system ("touch eqt-working/1");
+        usleep (EVENT_INTERVAL);
+    }
+    for (int i = 0; i < 4; i++) {
+        system ("touch eqt-working/2");
+        usleep (EVENT_INTERVAL);
+        system ("touch eqt-working/3");
+        usleep (EVENT_INTERVAL);
+    }
+
+    cons.input.receive ();
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("receive single IN_ATTRIB per file on interleaved touches",
+            received.count (event ("2", wid, IN_ATTRIB)) == 1 &&
+            received.count (event ("3", wid, IN_ATTRIB)) == 1);
+
+
+    /* Interleaved touches are sent at once without latency window */
+    inotify_set_param (cons.get_fd (), IN_COALESCE_WINDOW, 0);
+    should ("negative latency window is rejected",
+            inotify_set_param (cons.get_fd (), IN_LATENCY, -1) == -1
+            && errno == EINVAL);
+    should ("latency window is set",
+            inotify_set_param (cons.get_fd (), IN_LATENCY, LATENCY) == 0);
+    cons.output.reset ();
+
+    for (int i = 0; i < 4; i++) {
+        system ("touch eqt-working/2");
+        usleep (EVENT_INTERVAL);
+        system ("touch eqt-working/3");
+        usleep (EVENT_INTERVAL);
+    }
+
+    cons.input.receive (LATENCY * 2);
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("receive single IN_ATTRIB per file within latency window",
+            received.count (event ("2", wid, IN_ATTRIB)) == 1 &&
+            received.count (event ("3", wid, IN_ATTRIB)) == 1);
+    inotify_set_param (cons.get_fd (), IN_LATENCY, 0);
+
+
+    /* Autotuned buffer must not outgrow read buffer of the test consumer */
+    struct inotify_stats stats;
+    should ("negative socket buffer limit is rejected",
+            inotify_set_param (cons.get_fd (), IN_SOCKBUFSIZE_MAX, -1) == -1
+            && errno == EINVAL);
+    should ("socket buffer limit is set",
+            inotify_set_param (cons.get_fd (), IN_SOCKBUFSIZE_MAX,
+                               IN_DEF_SOCKBUFSIZE) == 0);
+    cons.output.reset ();
+
+    /* Socket is drained with events left in memory */
+    for (int i = 0; i < (QUEUED_EVENTS / 2 + PIPED_EVENTS) / 2; i++) {
+        system ("touch eqt-working");
+        usleep (EVENT_INTERVAL);
+        system ("touch eqt-working/1");
+        usleep (EVENT_INTERVAL);
+    }
+
+    cons.input.receive ();
+    cons.output.wait ();
+    should ("socket buffer grows on backlog",
+            inotify_get_stats (cons.get_fd (), &stats) == 0 &&
+            stats.sockbufsize >
+                PIPED_EVENTS * (sizeof (struct inotify_event) + 1) &&
+            stats.sockbufsize <= IN_DEF_SOCKBUFSIZE);
+    uint32_t grown = stats.sockbufsize;
+    cons.output.reset ();
+
+    /* Socket is drained with its buffer mostly unused */
+    cons.input.receive (SHRINK_WAIT);
+    for (int i = 0; i < SHRINK_DRAINS; i++) {
+        system ("touch eqt-working/2");
+        usleep (DRAIN_INTERVAL);
+    }
+
+    cons.output.wait ();
+    should ("socket buffer shrinks after light drains",
+            inotify_get_stats (cons.get_fd (), &stats) == 0 &&
+            stats.sockbufsize < grown);
+    inotify_set_param (cons.get_fd (), IN_SOCKBUFSIZE_MAX, 0);
+
+
+    should ("statistics are rejected without a buffer",
+            inotify_get_stats (cons.get_fd (), NULL) == -1 && errno == EINVAL);
+    should ("statistics are collected",
+            inotify_get_stats (cons.get_fd (), &stats) == 0);
+    should ("statistics account received and flushed events",
+            stats.kevents > 0 && stats.events_enqueued > 0 &&
+            stats.bytes_flushed > 0 && stats.watches > 0);
+    should ("statistics account coalesced and dropped events",
+            stats.events_coalesced > 0 && stats.events_dropped > 0 &&
+            stats.overflows >= 3);
+    should ("statistics account peak queue length",
+            stats.peak_queued_events > 0 &&
+            stats.peak_queued_events <= QUEUED_EVENTS + 1);
+
+
+    struct inotify_latency lat;
+    should ("latency histograms are not reported unless collected",
+            inotify_get_latency (cons.get_fd (), &lat) == -1
+            && errno == EINVAL);
+    should ("invalid latency histograms switch is rejected",
+            inotify_set_param (cons.get_fd (), IN_LATENCY_HIST, 2) == -1
+            && errno == EINVAL);
+    should ("latency histograms are collected",
+            inotify_set_param (cons.get_fd (), IN_LATENCY_HIST, 1) == 0);
+    cons.output.reset ();
+
+    system ("touch eqt-working/2");
+    usleep (EVENT_INTERVAL);
+    system ("touch eqt-working/3");
+
+    cons.input.receive ();
+    cons.output.wait ();
+    received = cons.output.registered ();
+    uint64_t enqueued = 0, total = 0;
+    should ("latency histograms are reported",
+            inotify_get_latency (cons.get_fd (), &lat) == 0);
+    for (int i = 0; i < IN_LAT_BUCKETS; i++) {
+        enqueued += lat.hist[IN_LAT_ENQUEUE][i];
+        total += lat.hist[IN_LAT_TOTAL][i];
+    }
+    should ("latency histograms account delivered events",
+            enqueued >= received.size () && total >= received.size ()
+            && received.size () > 0);
+    inotify_set_param (cons.get_fd (), IN_LATENCY_HIST, 0);
+#endif
+
 
     cons.input.interrupt ();
 }
@@ -0,0 +1,101 @@
+/*******************************************************************************
+  Copyright (c) 2016 Vladimir Kondratyev <vladimir@kondratyev.su>
+  SPDX-License-Identifier: MIT
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+
+#include <cerrno>
+#include <cstdlib>
+
+#include "fd_budget_test.hh"
+
+/* Directory itself and 2 of 4 files */
+#define WATCH_FDS 3
+/* Time in ms enough for a periodic check of closed files */
+#define DORMANT_CHECK_WAIT 2500
+
+fd_budget_test::fd_budget_test (journal &j)
+: test ("Watch descriptor budget", j)
+{
+}
+
+void fd_budget_test::setup ()
+{
+    cleanup ();
+    system ("mkdir fbt-working");
+    system ("touch fbt-working/1");
+    system ("touch fbt-working/2");
+    system ("touch fbt-working/3");
+    system ("touch fbt-working/4");
+}
+
+void fd_budget_test::run ()
+{
+    consumer cons;
+    events received;
+    int wid = 0;
+
+#ifndef __linux__
+    should ("negative watch descriptor budget is rejected",
+            inotify_set_param (cons.get_fd (), IN_MAX_WATCH_FDS, -1) == -1
+            && errno == EINVAL);
+    should ("watch descriptor budget is set",
+            inotify_set_param (cons.get_fd (), IN_MAX_WATCH_FDS, WATCH_FDS)
+            == 0);
+#endif
+
+    cons.input.setup ("fbt-working", IN_ATTRIB | IN_CREATE);
+    cons.output.wait ();
+
+    wid = cons.output.added_watch_id ();
+    should ("watch is added successfully", wid != -1);
+
+    /* Closed files are checked periodically, so wait for a check */
+    cons.output.reset ();
+    cons.input.receive (DORMANT_CHECK_WAIT);
+
+    system ("touch fbt-working/1 fbt-working/2 fbt-working/3 fbt-working/4");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("events are registered on all the directory contents",
+            contains (received, event ("1", wid, IN_ATTRIB))
+            && contains (received, event ("2", wid, IN_ATTRIB))
+            && contains (received, event ("3", wid, IN_ATTRIB))
+            && contains (received, event ("4", wid, IN_ATTRIB)));
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    system ("touch fbt-working/5");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("receive IN_CREATE for a new file over the budget",
+            contains (received, event ("5", wid, IN_CREATE)));
+
+    cons.input.interrupt ();
+}
+
+void fd_budget_test::cleanup ()
+{
+    system ("rm -rf fbt-working");
+}
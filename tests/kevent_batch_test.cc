@@ -0,0 +1,112 @@
+/*******************************************************************************
+  Copyright (c) 2016 Vladimir Kondratyev <vladimir@kondratyev.su>
+  SPDX-License-Identifier: MIT
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+
+#include "kevent_batch_test.hh"
+
+#define FILES       32
+#define LARGE_BATCH 1024
+
+kevent_batch_test::kevent_batch_test (journal &j)
+: test ("Kevent batch", j)
+{
+}
+
+void kevent_batch_test::setup ()
+{
+    cleanup ();
+    system ("mkdir kbt-working");
+}
+
+/* Files are removed at once, so watches are freed with kevents in batch */
+void kevent_batch_test::remove_files (consumer &cons, int wid, int batch)
+{
+    events received;
+    bool passed;
+    char name[16];
+
+#ifndef __linux__
+    should ("kevent batch is set",
+            inotify_set_param (cons.get_fd (), IN_KEVENT_BATCH, batch) == 0);
+#endif
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    for (int i = 0; i < FILES; i++) {
+        char cmd[64];
+        snprintf (cmd, sizeof (cmd), "touch kbt-working/%d", i);
+        system (cmd);
+    }
+
+    cons.output.wait ();
+    cons.output.reset ();
+    cons.input.receive ();
+
+    system ("rm -f kbt-working/*");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    passed = true;
+    for (int i = 0; i < FILES; i++) {
+        snprintf (name, sizeof (name), "%d", i);
+        passed = passed && contains (received, event (name, wid, IN_DELETE));
+    }
+    should (batch == 1 ?
+            "receive IN_DELETE for all files with single kevent batch" :
+            "receive IN_DELETE for all files with large kevent batch",
+            passed);
+}
+
+void kevent_batch_test::run ()
+{
+    consumer cons;
+    int wid = 0;
+
+#ifndef __linux__
+    should ("zero kevent batch is rejected",
+            inotify_set_param (cons.get_fd (), IN_KEVENT_BATCH, 0) == -1
+            && errno == EINVAL);
+#endif
+
+    /* Subfiles are opened to report IN_ATTRIB */
+    cons.input.setup ("kbt-working", IN_ATTRIB | IN_DELETE);
+    cons.output.wait ();
+
+    wid = cons.output.added_watch_id ();
+    should ("watch is added successfully", wid != -1);
+
+    remove_files (cons, wid, 1);
+    remove_files (cons, wid, LARGE_BATCH);
+
+    cons.input.interrupt ();
+}
+
+void kevent_batch_test::cleanup ()
+{
+    system ("rm -rf kbt-working");
+}
@@ -0,0 +1,96 @@
+/*******************************************************************************
+  Copyright (c) 2016 Vladimir Kondratyev <vladimir@kondratyev.su>
+  SPDX-License-Identifier: MIT
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <cerrno>
+#include <cstdlib>
+
+#include "readdir_buffer_test.hh"
+
+/* Holds a few directory entries only, so directory is read in many calls */
+#define READDIR_BUFSIZE 2048
+
+readdir_buffer_test::readdir_buffer_test (journal &j)
+: test ("Directory read buffer", j)
+{
+}
+
+void readdir_buffer_test::setup ()
+{
+    cleanup ();
+    system ("mkdir rbt-working");
+    system ("cd rbt-working && for i in `seq 1 100`; do "
+            "touch file-with-a-rather-long-name-$i; done");
+}
+
+void readdir_buffer_test::run ()
+{
+    consumer cons;
+    events received;
+    int wid = 0;
+
+#ifndef __linux__
+    should ("too small directory read buffer is rejected",
+            inotify_set_param (cons.get_fd (), IN_READDIR_BUFSIZE, 1) == -1
+            && errno == EINVAL);
+    should ("directory read buffer size is set",
+            inotify_set_param (cons.get_fd (), IN_READDIR_BUFSIZE,
+                               READDIR_BUFSIZE) == 0);
+#endif
+
+    cons.input.setup ("rbt-working", IN_CREATE | IN_DELETE | IN_MOVE);
+    cons.output.wait ();
+
+    wid = cons.output.added_watch_id ();
+    should ("watch is added successfully", wid != -1);
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    system ("mv rbt-working/file-with-a-rather-long-name-1 "
+            "rbt-working/file-with-a-rather-long-name-0");
+    system ("rm rbt-working/file-with-a-rather-long-name-50");
+    system ("touch rbt-working/file-with-a-rather-long-name-101");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("receive IN_MOVED_FROM for a renamed file",
+            contains (received, event ("file-with-a-rather-long-name-1",
+                                       wid, IN_MOVED_FROM)));
+    should ("receive IN_MOVED_TO for a renamed file",
+            contains (received, event ("file-with-a-rather-long-name-0",
+                                       wid, IN_MOVED_TO)));
+    should ("receive IN_DELETE for a removed file",
+            contains (received, event ("file-with-a-rather-long-name-50",
+                                       wid, IN_DELETE)));
+    should ("receive IN_CREATE for a new file",
+            contains (received, event ("file-with-a-rather-long-name-101",
+                                       wid, IN_CREATE)));
+    should ("unchanged files are not reported", received.size () == 4);
+
+    cons.input.interrupt ();
+}
+
+void readdir_buffer_test::cleanup ()
+{
+    system ("rm -rf rbt-working");
+}
@@ -0,0 +1,120 @@
+/*******************************************************************************
+  Copyright (c) 2016 Vladimir Kondratyev <vladimir@kondratyev.su>
+  SPDX-License-Identifier: MIT
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+
+#include "recursive_test.hh"
+
+recursive_test::recursive_test (journal &j)
+: test ("Recursive watch", j)
+{
+}
+
+void recursive_test::setup ()
+{
+    cleanup ();
+    system ("mkdir rct-working");
+    system ("mkdir rct-working/1");
+    system ("mkdir rct-working/1/2");
+}
+
+void recursive_test::run ()
+{
+#ifdef __linux__
+    skip ("recursive watch (libinotify specific)");
+#else
+    consumer cons;
+    events received;
+    int wid = 0;
+
+    cons.input.setup ("rct-working", IN_CREATE | IN_MODIFY | IN_MOVE | IN_RECURSIVE);
+    cons.output.wait ();
+
+    wid = cons.output.added_watch_id ();
+    should ("watch is added successfully", wid != -1);
+
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    system ("touch rct-working/1/2/foo");
+    system ("echo bar >> rct-working/1/2/foo");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("receive IN_CREATE for a file in existing subdirectory",
+            contains (received, event ("1/2/foo", wid, IN_CREATE)));
+    should ("receive IN_MODIFY for a file in existing subdirectory",
+            contains (received, event ("1/2/foo", wid, IN_MODIFY)));
+
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    system ("mkdir rct-working/1/3");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("receive IN_CREATE for a new subdirectory",
+            contains (received, event ("1/3", wid, IN_CREATE)));
+
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    system ("touch rct-working/1/3/baz");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("receive IN_CREATE for a file in new subdirectory",
+            contains (received, event ("1/3/baz", wid, IN_CREATE)));
+
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    system ("mv rct-working/1 rct-working/4");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("receive IN_MOVED_TO for a moved subdirectory",
+            contains (received, event ("4", wid, IN_MOVED_TO)));
+
+
+    cons.output.reset ();
+    cons.input.receive ();
+
+    system ("touch rct-working/4/2/qux");
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("receive IN_CREATE for a file in moved subdirectory",
+            contains (received, event ("4/2/qux", wid, IN_CREATE)));
+
+    cons.input.interrupt ();
+#endif
+}
+
+void recursive_test::cleanup ()
+{
+    system ("rm -rf rct-working");
+}
@@ -0,0 +1,110 @@
+/*******************************************************************************
+  Copyright (c) 2016 Vladimir Kondratyev <vladimir@kondratyev.su>
+  SPDX-License-Identifier: MIT
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <set>
+#include <string>
+#include <poll.h>
+#include <unistd.h>
+
+#include "shmring_test.hh"
+
+/* Names of this many created files do not fit into the ring at once */
+#define FILES 2000
+
+shmring_test::shmring_test (journal &j)
+: test ("Shared memory event ring", j)
+{
+}
+
+void shmring_test::setup ()
+{
+    cleanup ();
+    system ("mkdir srt-working");
+}
+
+void shmring_test::run ()
+{
+#ifdef __linux__
+    skip ("receive events through shared memory ring (libinotify specific)");
+#else
+    std::set<std::string> names;
+    struct inotify_ring *ring;
+    struct inotify_event *ie;
+    bool aligned = true, foreign = false;
+    char buf[16];
+    int fd, plain, wid;
+
+    plain = inotify_init1 (0);
+    should ("ring is not mapped for instance without IN_SHMRING",
+            inotify_map_ring (plain) == NULL && errno == EINVAL);
+    close (plain);
+
+    fd = inotify_init1 (IN_SHMRING | IN_NONBLOCK);
+    should ("instance with event ring is created", fd != -1);
+    ring = inotify_map_ring (fd);
+    should ("event ring is mapped", ring != NULL);
+    if (ring == NULL) {
+        close (fd);
+        return;
+    }
+
+    wid = inotify_add_watch (fd, "srt-working", IN_CREATE);
+    should ("watch is added successfully", wid != -1);
+
+    system ("cd srt-working && for i in `seq 1 2000`; do "
+            "touch file-with-a-rather-long-name-$i; done");
+
+    while (names.size () < FILES) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll (&pfd, 1, 5000) <= 0) {
+            break;
+        }
+        /* Drain the doorbell before parsing the ring */
+        while (read (fd, buf, sizeof (buf)) > 0);
+        while ((ie = inotify_ring_peek (ring)) != NULL) {
+            aligned = aligned && (uintptr_t)ie % sizeof (uint32_t) == 0;
+            if (ie->wd == wid && ie->mask == IN_CREATE && ie->len > 0) {
+                names.insert (ie->name);
+            } else {
+                foreign = true;
+            }
+            inotify_ring_advance (ring);
+        }
+    }
+
+    should ("all events are received through the ring",
+            names.size () == FILES);
+    should ("events in the ring are aligned", aligned);
+    should ("no unexpected events are received", !foreign);
+
+    close (fd);
+#endif
+}
+
+void shmring_test::cleanup ()
+{
+    system ("rm -rf srt-working");
+}
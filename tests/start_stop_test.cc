@@ -22,6 +22,8 @@
   THE SOFTWARE.
 *******************************************************************************/
 
+#include <algorithm>
+#include <cerrno>
 #include <cstdlib>
 #include "start_stop_test.hh"
 
@@ -169,6 +171,46 @@ void start_stop_test::run ()
             "have been received if watch was opened with IN_ONESHOT flag set",
             error == -1 && errno == EINVAL);
 
+#ifndef __linux__
+    /* Libinotify specific vectored version of inotify_add_watch */
+    const char *names[] = { "sst-working", "sst-nonexistent", "sst-working2" };
+    const uint32_t masks[] = { IN_ATTRIB, IN_ATTRIB, IN_ATTRIB };
+    int wids[3];
+
+    error = inotify_add_watches (cons.get_fd (), names, masks, wids, 3);
+    should ("inotify_add_watches returns number of successfully added watches",
+            error == 2);
+    should ("inotify_add_watches returns watch IDs for existing files",
+            wids[0] > 0 && wids[0] == wids[2]);
+    should ("inotify_add_watches returns -ENOENT for a missing file",
+            wids[1] == -ENOENT);
+
+    /* Libinotify specific asynchronous version of inotify_add_watch */
+    cons.output.reset ();
+    cons.input.receive ();
+
+    error = inotify_add_watch_async (cons.get_fd (), "sst-working", IN_ATTRIB,
+                                     42);
+    should ("inotify_add_watch_async accepts request", error == 0);
+
+    cons.output.wait ();
+    received = cons.output.registered ();
+    should ("receive IN_ADD_COMPLETE with watch ID on asynchronous add",
+            contains (received, event ("", wids[0], IN_ADD_COMPLETE)));
+    events::iterator iter;
+    iter = std::find_if (received.begin(),
+                         received.end(),
+                         event_matcher (event ("", wids[0], IN_ADD_COMPLETE)));
+    should ("IN_ADD_COMPLETE carries tag of asynchronous add in cookie",
+            iter != received.end() && iter->flags & IN_ADD_COMPLETE
+            && iter->cookie == 42);
+
+    error = inotify_add_watch_async (cons.get_fd (), "sst-nonexistent",
+                                     IN_ATTRIB, 42);
+    should ("inotify_add_watch_async returns -1, errno set to ENOENT "
+            "for a missing file", error == -1 && errno == ENOENT);
+#endif
+
     cons.input.interrupt ();
 }
 
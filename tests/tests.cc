@@ -33,6 +33,13 @@
 #include "symlink_test.hh"
 #include "bugs_test.hh"
 #include "event_queue_test.hh"
+#include "worker_pool_test.hh"
+#include "concurrent_cmd_test.hh"
+#include "fd_budget_test.hh"
+#include "kevent_batch_test.hh"
+#include "recursive_test.hh"
+#include "readdir_buffer_test.hh"
+#include "shmring_test.hh"
 
 #define CONCURRENT
 
@@ -51,6 +58,13 @@ int main (int argc, char *argv[]) {
         new fail_test (j),
         new bugs_test (j),
         new event_queue_test (j),
+        new worker_pool_test (j),
+        new concurrent_cmd_test (j),
+        new fd_budget_test (j),
+        new kevent_batch_test (j),
+        new recursive_test (j),
+        new readdir_buffer_test (j),
+        new shmring_test (j),
     };
     const int num_tests = sizeof(tests)/sizeof(tests[0]);
 
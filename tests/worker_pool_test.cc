@@ -0,0 +1,152 @@
+/*******************************************************************************
+  Copyright (c) 2016 Vladimir Kondratyev <vladimir@kondratyev.su>
+  SPDX-License-Identifier: MIT
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+*******************************************************************************/
+
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "worker_pool_test.hh"
+
+#define POOL_THREADS 2
+#define INSTANCES    5
+#define POOL_BATCH   4
+
+worker_pool_test::worker_pool_test (journal &j)
+: test ("Worker thread pool", j)
+{
+}
+
+void worker_pool_test::setup ()
+{
+    cleanup ();
+    system ("mkdir wpt-working");
+    for (int i = 0; i < INSTANCES; i++) {
+        char cmd[64];
+        snprintf (cmd, sizeof (cmd), "mkdir wpt-working/%d", i);
+        system (cmd);
+    }
+}
+
+void worker_pool_test::run ()
+{
+    consumer *cons[INSTANCES];
+    events received;
+    int wid[INSTANCES];
+    bool passed;
+
+#ifndef __linux__
+    should ("start worker thread pool",
+            inotify_set_param (-1, IN_WORKER_THREADS, POOL_THREADS) == 0);
+    should ("set kevent batch of worker thread pool",
+            inotify_set_param (-1, IN_KEVENT_BATCH, POOL_BATCH) == 0);
+#endif
+    /* Create more instances than pool threads to share kqueues */
+    for (int i = 0; i < INSTANCES; i++) {
+        cons[i] = new consumer;
+    }
+#ifndef __linux__
+    /* Do not affect instances created by other tests */
+    inotify_set_param (-1, IN_WORKER_THREADS, 0);
+    should ("pool size can not be changed after start",
+            inotify_set_param (-1, IN_WORKER_THREADS, POOL_THREADS + 1) == -1
+            && errno == EBUSY);
+    should ("pool kevent batch can not be changed after start",
+            inotify_set_param (-1, IN_KEVENT_BATCH, POOL_BATCH + 1) == -1
+            && errno == EBUSY);
+    should ("pooled instance can not set its own kevent batch",
+            inotify_set_param (cons[0]->get_fd (), IN_KEVENT_BATCH, 1) == -1
+            && errno == EINVAL);
+#endif
+
+    passed = true;
+    for (int i = 0; i < INSTANCES; i++) {
+        char path[64];
+        snprintf (path, sizeof (path), "wpt-working/%d", i);
+        cons[i]->input.setup (path, IN_CREATE);
+        cons[i]->output.wait ();
+        wid[i] = cons[i]->output.added_watch_id ();
+        passed = passed && wid[i] != -1;
+    }
+    should ("watches are added successfully to all instances", passed);
+
+
+    for (int i = 0; i < INSTANCES; i++) {
+        cons[i]->output.reset ();
+    }
+    for (int i = 0; i < INSTANCES; i++) {
+        char cmd[64];
+        snprintf (cmd, sizeof (cmd), "touch wpt-working/%d/file", i);
+        system (cmd);
+    }
+
+    passed = true;
+    for (int i = 0; i < INSTANCES; i++) {
+        cons[i]->input.receive ();
+        cons[i]->output.wait ();
+        received = cons[i]->output.registered ();
+        passed = passed && received.size () == 1 &&
+                 contains (received, event ("file", wid[i], IN_CREATE));
+    }
+    should ("each instance receives only events of its own watches", passed);
+
+
+    /* Close every second instance */
+    for (int i = 0; i < INSTANCES; i += 2) {
+        cons[i]->input.interrupt ();
+        delete cons[i];
+        cons[i] = NULL;
+    }
+
+    for (int i = 1; i < INSTANCES; i += 2) {
+        cons[i]->output.reset ();
+    }
+    for (int i = 0; i < INSTANCES; i++) {
+        char cmd[64];
+        snprintf (cmd, sizeof (cmd), "touch wpt-working/%d/file2", i);
+        system (cmd);
+    }
+
+    passed = true;
+    for (int i = 1; i < INSTANCES; i += 2) {
+        cons[i]->input.receive ();
+        cons[i]->output.wait ();
+        received = cons[i]->output.registered ();
+        passed = passed && received.size () == 1 &&
+                 contains (received, event ("file2", wid[i], IN_CREATE));
+    }
+    should ("instances keep working after closing of instances sharing "
+            "the same thread", passed);
+
+
+    for (int i = 1; i < INSTANCES; i += 2) {
+        cons[i]->input.interrupt ();
+        delete cons[i];
+    }
+}
+
+void worker_pool_test::cleanup ()
+{
+    system ("rm -rf wpt-working");
+}
@@ -30,10 +30,8 @@
 #include <assert.h>
 #include <errno.h>  /* EINTR */
 #include <fcntl.h>  /* fcntl */
-#include <stddef.h> /* offsetof */
 #include <stdio.h>
-#include <stdlib.h> /* malloc */
-#include <string.h> /* strlen */
+#include <string.h> /* memset */
 #include <unistd.h> /* read, write */
 
 #include "sys/inotify.h"
@@ -62,48 +60,6 @@ perror_msg_printf (const char *fmt, ...)
 }
 #endif
 
-/**
- * Create a new inotify event.
- *
- * @param[in] wd     An associated watch's id.
- * @param[in] mask   An inotify watch mask.
- * @param[in] cookie Event cookie.
- * @param[in] name   File name (may be NULL).
- * @param[out] event_len The length of the created event, in bytes.
- * @return A pointer to a created event on NULL on a failure.
- **/
-struct inotify_event*
-create_inotify_event (int         wd,
-                      uint32_t    mask,
-                      uint32_t    cookie,
-                      const char *name,
-                      size_t     *event_len)
-{
-    struct inotify_event *event = NULL;
-    size_t name_len = name ? strlen (name) + 1 : 0;
-    *event_len = offsetof (struct inotify_event, name) + name_len;
-    event = calloc (1, *event_len);
-
-    if (event == NULL) {
-        perror_msg (("Failed to allocate a new inotify event [%s, %X]",
-                    name,
-                    mask));
-        return NULL;
-    }
-
-    event->wd = wd;
-    event->mask = mask;
-    event->cookie = cookie;
-    event->len = name_len;
-
-    if (name) {
-        strlcpy (event->name, name, name_len);
-    }
-
-    return event;
-}
-
-
 /**
  * scatter-gather version of send with writev()-style parameters.
  *
@@ -159,6 +115,39 @@ is_deleted (int fd)
     return (st.st_nlink == 0);
 }
 
+#if defined (HAVE_STRUCT_STAT_ST_MTIM)
+#define ST_MTIM(st) ((st)->st_mtim)
+#define ST_CTIM(st) ((st)->st_ctim)
+#elif defined (HAVE_STRUCT_STAT_ST_MTIMESPEC)
+#define ST_MTIM(st) ((st)->st_mtimespec)
+#define ST_CTIM(st) ((st)->st_ctimespec)
+#endif
+
+/**
+ * Extract modification and status change times from file status.
+ *
+ * Sub-second parts are zeroed if struct stat has no nanosecond timestamps.
+ *
+ * @param[in]  st    A file status.
+ * @param[out] mtime A modification time.
+ * @param[out] ctime A status change time.
+ **/
+void
+stat_get_times (const struct stat *st,
+                struct timespec *mtime,
+                struct timespec *ctime)
+{
+#ifdef ST_MTIM
+    *mtime = ST_MTIM (st);
+    *ctime = ST_CTIM (st);
+#else
+    mtime->tv_sec = st->st_mtime;
+    mtime->tv_nsec = 0;
+    ctime->tv_sec = st->st_ctime;
+    ctime->tv_nsec = 0;
+#endif
+}
+
 /**
  * Set the FD_CLOEXEC flag of file descriptor fd if value is nonzero
  * clear the flag if value is 0.
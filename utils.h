@@ -26,12 +26,15 @@
 #define __UTILS_H__
 
 #include <sys/types.h>
+#include <sys/stat.h> /* stat */
 #include <sys/uio.h>  /* iovec */
 
 #include <dirent.h> /* DIR */
 #include <errno.h>  /* errno */
 #include <stdio.h>  /* fprintf */
 #include <string.h> /* strerror */
+#include <stdbool.h>
+#include <time.h>   /* timespec */
 #include <pthread.h>
 
 #include "config.h"
@@ -65,20 +68,23 @@ do {                                                                    \
 #define perror_msg(msg)
 #endif
 
-struct inotify_event* create_inotify_event (int         wd,
-                                            uint32_t    mask,
-                                            uint32_t    cookie,
-                                            const char *name,
-                                            size_t     *event_len);
-
 ssize_t sendv (int fd, struct iovec iov[], int iovcnt, int flags);
 
 int is_opened (int fd);
 int is_deleted (int fd);
+void stat_get_times (const struct stat *st,
+                     struct timespec *mtime,
+                     struct timespec *ctime);
 int set_cloexec_flag (int fd, int value);
 int set_nonblock_flag (int fd, int value);
 int set_sndbuf_size (int fd, int len);
 int dup_cloexec (int oldd);
 DIR *fdreopendir (int oldd);
 
+static inline bool
+timespec_eq (const struct timespec *a, const struct timespec *b)
+{
+    return (a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec);
+}
+
 #endif /* __UTILS_H__ */
@@ -26,34 +26,65 @@
 #include <sys/stat.h>  /* ino_t */
 
 #include <assert.h>
+#include <errno.h>  /* errno */
 #include <stddef.h> /* NULL */
+#include <stdint.h> /* uint64_t */
+#include <stdlib.h> /* calloc, free */
 
 #include "compat.h"
-#include "inotify-watch.h"
+#include "utils.h"
 #include "watch-set.h"
 #include "watch.h"
 
-static int watch_set_cmp (struct watch *w1, struct watch *w2);
+/* Initial number of hash table slots */
+#define WS_INIT_SIZE 16
 
-RB_GENERATE_NEXT(watch_set, watch, link, static inline)
-RB_GENERATE_MINMAX(watch_set, watch, link, static inline)
-RB_GENERATE_INSERT_COLOR(watch_set, watch, link, static inline)
-RB_GENERATE_REMOVE_COLOR(watch_set, watch, link, static inline)
-RB_GENERATE_INSERT(watch_set, watch, link, watch_set_cmp, static inline)
-RB_GENERATE_REMOVE(watch_set, watch, link, static inline)
-RB_GENERATE_FIND(watch_set, watch, link, watch_set_cmp, static inline)
+/**
+ * Calculate hash of device & inode number pair.
+ *
+ * @param[in] dev   A device number of watched file.
+ * @param[in] inode A inode number of watched file.
+ * @return A hash value.
+ **/
+static inline size_t
+watch_set_hash (dev_t dev, ino_t inode)
+{
+    uint64_t h = (uint64_t)inode ^ ((uint64_t)dev * 0x9E3779B97F4A7C15ULL);
+
+    /* splitmix64 finalizer. Inode numbers are often sequential */
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    return (size_t)(h ^ (h >> 31));
+}
+
+/**
+ * Calculate home slot of a watch in the hash table.
+ *
+ * @param[in] ws A pointer to the watch set.
+ * @param[in] w  A pointer to the watch.
+ * @return A hash table slot number.
+ **/
+static inline size_t
+watch_set_slot (struct watch_set *ws, struct watch *w)
+{
+    return watch_set_hash (w->dev, w->inode) & (ws->size - 1);
+}
 
 /**
  * Initialize the watch set.
  *
  * @param[in] ws A pointer to the watch set.
+ * @param[in] wc A pointer to #watch_cache the watches are allocated from.
  **/
 void
-watch_set_init (struct watch_set *ws)
+watch_set_init (struct watch_set *ws, struct watch_cache *wc)
 {
     assert (ws != NULL);
 
-    RB_INIT (ws);
+    ws->table = NULL;
+    ws->size = 0;
+    ws->count = 0;
+    ws->cache = wc;
 }
 
 /**
@@ -64,13 +95,17 @@ watch_set_init (struct watch_set *ws)
 void
 watch_set_free (struct watch_set *ws)
 {
-    struct watch *w, *tmp;
+    size_t i;
 
     assert (ws != NULL);
 
-    RB_FOREACH_SAFE (w, watch_set, ws, tmp) {
-        watch_set_delete (ws, w);
+    for (i = 0; i < ws->size; i++) {
+        if (ws->table[i] != NULL) {
+            watch_free (ws->cache, ws->table[i]);
+        }
     }
+    free (ws->table);
+    watch_set_init (ws, ws->cache);
 }
 
 /**
@@ -82,73 +117,138 @@ watch_set_free (struct watch_set *ws)
 void
 watch_set_delete (struct watch_set *ws, struct watch *w)
 {
+    size_t mask, i, j, k;
+
     assert (ws != NULL);
     assert (w != NULL);
+    assert (ws->count > 0);
+
+    mask = ws->size - 1;
+    for (i = watch_set_slot (ws, w); ws->table[i] != w; i = (i + 1) & mask) {
+        assert (ws->table[i] != NULL);
+    }
+
+    /* Shift following entries of the probe sequence back to avoid tombstones */
+    ws->table[i] = NULL;
+    for (j = (i + 1) & mask; ws->table[j] != NULL; j = (j + 1) & mask) {
+        k = watch_set_slot (ws, ws->table[j]);
+        /* Keep entry if its home slot lies cyclically in (i, j] */
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+        }
+        ws->table[i] = ws->table[j];
+        ws->table[j] = NULL;
+        i = j;
+    }
 
-    RB_REMOVE (watch_set, ws, w);
-    watch_free (w);
+    --ws->count;
+    watch_free (ws->cache, w);
+}
+
+/**
+ * Resize hash table of the watch set.
+ *
+ * @param[in] ws   A pointer to #watch_set.
+ * @param[in] size A new number of slots, a power of 2.
+ * @return 0 on success, -1 otherwise.
+ **/
+static int
+watch_set_resize (struct watch_set *ws, size_t size)
+{
+    struct watch_set new_ws;
+    size_t i, slot;
+
+    assert (size > ws->count);
+
+    new_ws.table = calloc (size, sizeof (struct watch *));
+    if (new_ws.table == NULL) {
+        perror_msg (("Failed to resize watch set to %zu slots", size));
+        return -1;
+    }
+    new_ws.size = size;
+    new_ws.count = ws->count;
+    new_ws.cache = ws->cache;
+
+    for (i = 0; i < ws->size; i++) {
+        if (ws->table[i] != NULL) {
+            slot = watch_set_slot (&new_ws, ws->table[i]);
+            while (new_ws.table[slot] != NULL) {
+                slot = (slot + 1) & (size - 1);
+            }
+            new_ws.table[slot] = ws->table[i];
+        }
+    }
+
+    free (ws->table);
+    *ws = new_ws;
+    return 0;
 }
 
 /**
  * Insert watch into watch set.
  *
+ * Device and inode numbers of the watch must not be present in the set.
+ *
  * @param[in] ws A pointer to #watch_set.
  * @param[in] w  A pointer to inserted watch.
+ * @return 0 on success, -1 otherwise.
  **/
-void
+int
 watch_set_insert (struct watch_set *ws, struct watch *w)
 {
+    size_t slot, size;
+
     assert (ws != NULL);
     assert (w != NULL);
-    assert (!watch_deps_empty (w));
+    assert (watch_set_find (ws, w->dev, w->inode) == NULL);
+
+    /* Keep load factor below 3/4. Table with free slots is still usable */
+    if ((ws->count + 1) * 4 > ws->size * 3) {
+        size = ws->size == 0 ? WS_INIT_SIZE : ws->size * 2;
+        if (watch_set_resize (ws, size) == -1 && ws->count + 1 >= ws->size) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
 
-    RB_INSERT (watch_set, ws, w);
+    slot = watch_set_slot (ws, w);
+    while (ws->table[slot] != NULL) {
+        slot = (slot + 1) & (ws->size - 1);
+    }
+    ws->table[slot] = w;
+    ++ws->count;
+
+    return 0;
 }
 
 /**
  * Find kqueue watch corresponding for dependency item
  *
  * @param[in] ws    A pointer to #watch_set.
+ * @param[in] dev   A device number of watch
  * @param[in] inode A inode number of watch
  * @return A pointer to kqueue watch if found NULL otherwise
  **/
 struct watch *
 watch_set_find (struct watch_set *ws, dev_t dev, ino_t inode)
 {
-    struct i_watch iw;
-    struct watch_dep wd;
-    struct watch find;
+    struct watch *w;
+    size_t slot, mask;
 
     assert (ws != NULL);
 
-    iw.dev = dev;
-    iw.inode = inode;
-    wd.iw = &iw;
-    wd.di = DI_PARENT;
-    SLIST_INIT (&find.deps);
-    SLIST_INSERT_HEAD (&find.deps, &wd, next);
-
-    return RB_FIND (watch_set, ws, &find);
-}
-/**
- * Custom comparison function that can compare kqueue watch inode values
- * through pointers passed by RB tree functions
- *
- * @param[in] w1 A pointer to a first kqueue watch to compare
- * @param[in] w2 A pointer to a second kqueue watch to compare
- * @return An -1, 0, or +1 if the first watch is considered to be respectively
- * less than, equal to, or greater than the second one.
- **/
-static int
-watch_set_cmp (struct watch *w1, struct watch *w2)
-{
-    dev_t dev1 = watch_get_dev (w1);
-    dev_t dev2 = watch_get_dev (w2);
+    if (ws->count == 0) {
+        return NULL;
+    }
 
-    if (dev1 == dev2) {
-        ino_t inode1 = watch_get_inode (w1);
-        ino_t inode2 = watch_get_inode (w2);
-        return ((inode1 > inode2) - (inode1 < inode2));
+    mask = ws->size - 1;
+    for (slot = watch_set_hash (dev, inode) & mask;
+         (w = ws->table[slot]) != NULL;
+         slot = (slot + 1) & mask) {
+        if (w->inode == inode && w->dev == dev) {
+            return w;
+        }
     }
-    return ((dev1 > dev2) - (dev1 < dev2));
+
+    return NULL;
 }
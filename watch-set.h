@@ -30,14 +30,21 @@
 
 #include "compat.h"
 
-RB_HEAD(watch_set, watch);
-
 struct watch;
+struct watch_cache;
+
+/* Open addressing hash table of watches keyed on device & inode numbers */
+struct watch_set {
+    struct watch **table; /* hash table slots */
+    size_t size;          /* number of slots, a power of 2 or 0 */
+    size_t count;         /* number of watches in the set */
+    struct watch_cache *cache; /* slab caches watches are allocated from */
+};
 
-void          watch_set_init   (struct watch_set *ws);
+void          watch_set_init   (struct watch_set *ws, struct watch_cache *wc);
 void          watch_set_free   (struct watch_set *ws);
 void          watch_set_delete (struct watch_set *ws, struct watch *w);
-void          watch_set_insert (struct watch_set *ws, struct watch *w);
+int           watch_set_insert (struct watch_set *ws, struct watch *w);
 struct watch *watch_set_find   (struct watch_set *ws, dev_t dev, ino_t inode);
 
 #endif /* __WATCH_SET_H__ */
@@ -153,14 +153,6 @@ kqueue_to_inotify (uint32_t flags,
     return result;
 }
 
-/* struct kevent is declared slightly differently on the different BSDs.
- * This macros will help to avoid cast warnings on the supported platforms. */
-#if defined (__NetBSD__)
-#define PTR_TO_UDATA(X) ((intptr_t)X)
-#else
-#define PTR_TO_UDATA(X) (X)
-#endif
-
 /**
  * Register vnode kqueue watch in kernel kqueue(2) subsystem
  *
@@ -182,6 +174,12 @@ watch_register_event (struct watch *w, int kq, uint32_t fflags)
         return 0;
     }
 
+    /* Dormant watch is registered in kqueue when it is revived */
+    if (watch_is_dormant (w)) {
+        w->fflags = fflags;
+        return 1;
+    }
+
     EV_SET (&ev,
             w->fd,
             EVFILT_VNODE,
@@ -231,6 +229,56 @@ watch_update_event (struct watch *w)
     return (watch_register_event (w, kq, fflags));
 }
 
+/**
+ * Save file status of a watch to detect changes while it is dormant.
+ *
+ * @param[in] w  A pointer to the #watch.
+ * @param[in] st A file status of the watched entry.
+ **/
+void
+watch_save_stat (struct watch *w, const struct stat *st)
+{
+    assert (w != NULL);
+    assert (st != NULL);
+
+    stat_get_times (st, &w->mtime, &w->ctime);
+    w->size = st->st_size;
+}
+
+/**
+ * Compare file status of a dormant watch with the saved one and save it.
+ *
+ * @param[in] w  A pointer to the #watch.
+ * @param[in] st A current file status of the watched entry.
+ * @return IN_MODIFY or IN_ATTRIB if file has been changed, 0 otherwise.
+ **/
+uint32_t
+watch_check_stat (struct watch *w, const struct stat *st)
+{
+    struct timespec mtime, ctime;
+    off_t size;
+    uint32_t mask = 0;
+
+    assert (w != NULL);
+    assert (st != NULL);
+
+    mtime = w->mtime;
+    ctime = w->ctime;
+    size = w->size;
+    watch_save_stat (w, st);
+
+    if (!timespec_eq (&mtime, &w->mtime) || size != w->size) {
+        /* Directory content changes are reported by directory watch */
+        if (S_ISREG (st->st_mode)) {
+            mask = IN_MODIFY;
+        }
+    } else if (!timespec_eq (&ctime, &w->ctime)) {
+        mask = IN_ATTRIB;
+    }
+
+    return mask;
+}
+
 /**
  * Opens a file descriptor of kqueue watch
  *
@@ -304,20 +352,49 @@ watch_open (int dirfd, const char *path, uint32_t flags)
     return fd;
 }
 
+/**
+ * Initialize slab caches of watches.
+ *
+ * @param[in] wc A pointer to #watch_cache.
+ **/
+void
+watch_cache_init (struct watch_cache *wc)
+{
+    assert (wc != NULL);
+
+    slab_cache_init (&wc->watches, sizeof (struct watch));
+    slab_cache_init (&wc->deps, sizeof (struct watch_dep));
+}
+
+/**
+ * Free slab caches of watches. All the watches must be freed before.
+ *
+ * @param[in] wc A pointer to #watch_cache.
+ **/
+void
+watch_cache_destroy (struct watch_cache *wc)
+{
+    assert (wc != NULL);
+
+    slab_cache_destroy (&wc->watches);
+    slab_cache_destroy (&wc->deps);
+}
+
 /**
  * Initialize a watch.
  *
- * @param[in] fd A file descriptor of a watched entry.
+ * @param[in] wc    A pointer to #watch_cache to allocate watch from.
+ * @param[in] fd    A file descriptor of a watched entry or -1 for dormant.
+ * @param[in] dev   A device number of a watched entry.
+ * @param[in] inode A inode number of a watched entry.
  * @return A pointer to a watch on success, NULL on failure.
  **/
 struct watch *
-watch_init (int fd)
+watch_init (struct watch_cache *wc, int fd, dev_t dev, ino_t inode)
 {
     struct watch *w;
 
-    assert (fd != -1);
-
-    w = calloc (1, sizeof (struct watch));
+    w = slab_alloc (&wc->watches);
     if (w == NULL) {
         perror_msg (("Failed to allocate watch"));
         return NULL;
@@ -326,7 +403,10 @@ watch_init (int fd)
     w->fd = fd;
     w->fflags = 0;
     w->skip_next = false;
+    w->batch_gen = 0;
     SLIST_INIT (&w->deps);
+    w->dev = dev;
+    w->inode = inode;
 
     return w;
 }
@@ -334,10 +414,11 @@ watch_init (int fd)
 /**
  * Free a watch and all the associated memory.
  *
- * @param[in] w A pointer to a watch.
+ * @param[in] wc A pointer to #watch_cache the watch is allocated from.
+ * @param[in] w  A pointer to a watch.
  **/
 void
-watch_free (struct watch *w)
+watch_free (struct watch_cache *wc, struct watch *w)
 {
     assert (w != NULL);
     if (w->fd != -1) {
@@ -347,12 +428,12 @@ watch_free (struct watch *w)
     while (!watch_deps_empty (w)) {
         struct watch_dep *wd = SLIST_FIRST (&w->deps);
         SLIST_REMOVE_HEAD (&w->deps, next);
-        free (wd);
+        slab_free (&wc->deps, wd);
     }
 #else
     assert (watch_deps_empty (w));
 #endif
-    free (w);
+    slab_free (&wc->watches, w);
 }
 
 
@@ -397,7 +478,7 @@ watch_add_dep (struct watch *w, struct i_watch *iw, const struct dep_item *di)
     assert (w != NULL);
     assert (iw != NULL);
 
-    wd = calloc (1, sizeof (struct watch_dep));
+    wd = slab_alloc (&iw->wrk->wcache.deps);
     if (wd != NULL) {
         uint32_t fflags;
         wd->iw = iw;
@@ -421,7 +502,7 @@ watch_add_dep (struct watch *w, struct i_watch *iw, const struct dep_item *di)
                 errno = EACCES;
 #endif
 #endif
-            free (wd);
+            slab_free (&iw->wrk->wcache.deps, wd);
             return NULL;
         }
 
@@ -449,11 +530,17 @@ watch_del_dep (struct watch *w, struct i_watch *iw, const struct dep_item *di)
     wd = watch_find_dep (w, iw, di);
     if (wd != NULL) {
         SLIST_REMOVE (&w->deps, wd, watch_dep, next);
-        free (wd);
+        slab_free (&iw->wrk->wcache.deps, wd);
         if (watch_deps_empty (w)) {
+            worker_forget_watch (iw->wrk, w);
+            worker_cancel_kevents (iw->wrk, w);
             watch_set_delete (&iw->wrk->watches, w);
         } else {
             watch_update_event (w);
+            /* Watch without user watch of its own can be closed again */
+            if (di == DI_PARENT && !w->in_lru && !watch_is_dormant (w)) {
+                worker_touch_watch (iw->wrk, w);
+            }
         }
     }
     return (wd);
@@ -35,6 +35,7 @@
 #include "compat.h"
 #include "dep-list.h"
 #include "inotify-watch.h"
+#include "slab.h"
 
 #define WD_FOREACH(wd, w) SLIST_FOREACH ((wd), &(w)->deps, next)
 
@@ -46,11 +47,24 @@ struct watch_dep {
 };
 
 struct watch {
-    int fd;                   /* file descriptor of a watched entry */
+    int fd;                   /* file descriptor of a watched entry or -1 */
     uint32_t fflags;          /* kqueue vnode filter flags currently applied */
     bool skip_next;           /* next kevent can be produced by readdir call */
+    unsigned int batch_gen;   /* generation of the last batch with kevent */
     struct watch_dep_list deps; /* An associated dep_items list */
-    RB_ENTRY(watch) link;     /* RB tree links */
+    dev_t dev;                /* device number of a watched entry */
+    ino_t inode;              /* inode number of a watched entry */
+    bool in_lru;              /* watch is linked to worker LRU list */
+    TAILQ_ENTRY(watch) lru_link; /* link in LRU or dormant subwatch list */
+    struct timespec mtime;    /* modification time of dormant watch */
+    struct timespec ctime;    /* status change time of dormant watch */
+    off_t size;               /* size of dormant watch */
+};
+
+/* Slab caches of watches and their dependency records */
+struct watch_cache {
+    struct slab_cache watches;
+    struct slab_cache deps;
 };
 
 uint32_t inotify_to_kqueue (uint32_t flags, mode_t mode, bool is_subwatch);
@@ -59,9 +73,15 @@ uint32_t kqueue_to_inotify (uint32_t flags,
                             bool is_parent,
                             bool is_deleted);
 
+void watch_cache_init    (struct watch_cache *wc);
+void watch_cache_destroy (struct watch_cache *wc);
+
 int           watch_open     (int dirfd, const char *path, uint32_t flags);
-struct watch* watch_init     (int fd);
-void          watch_free     (struct watch *w);
+struct watch* watch_init     (struct watch_cache *wc,
+                              int fd,
+                              dev_t dev,
+                              ino_t inode);
+void          watch_free     (struct watch_cache *wc, struct watch *w);
 
 struct watch_dep *watch_find_dep (struct watch *w,
                                   struct i_watch *iw,
@@ -79,6 +99,8 @@ struct watch_dep *watch_chg_dep  (struct watch *w,
 
 int    watch_register_event (struct watch *w, int kq, uint32_t fflags);
 int    watch_update_event   (struct watch *w);
+void     watch_save_stat  (struct watch *w, const struct stat *st);
+uint32_t watch_check_stat (struct watch *w, const struct stat *st);
 
 /**
  * Checks if #watch is associated with any file dependency or not.
@@ -93,6 +115,19 @@ watch_deps_empty (struct watch *w)
     return (SLIST_EMPTY (&w->deps));
 }
 
+/**
+ * Checks if #watch has been closed to fit the file descriptor budget.
+ *
+ * @param[in] w A pointer to the #watch.
+ * @return true if #watch has no file descriptor opened. false otherwise.
+ **/
+static inline bool
+watch_is_dormant (struct watch *w)
+{
+    assert (w != NULL);
+    return (w->fd == -1);
+}
+
 /**
  * Checks if #watch_dep is pointing to virtual parent dependency item.
  *
@@ -140,7 +175,7 @@ watch_get_mode (struct watch *w)
 }
 
 /**
- * Calculates #watch inode number with traversing depedencies.
+ * Returns #watch inode number.
  *
  * @param[in] w  A pointer to the #watch.
  * @return inode number in stat() format.
@@ -149,13 +184,14 @@ static inline ino_t
 watch_get_inode (struct watch *w)
 {
     assert (w != NULL);
-    assert (!watch_deps_empty (w));
+    assert (watch_deps_empty (w) ||
+            w->inode == watch_dep_get_inode (SLIST_FIRST (&w->deps)));
 
-    return watch_dep_get_inode (SLIST_FIRST (&w->deps));
+    return w->inode;
 }
 
 /**
- * Calculates #watch device number with traversing depedencies.
+ * Returns #watch device number.
  *
  * @param[in] w  A pointer to the #watch.
  * @return device number in stat() format.
@@ -164,9 +200,9 @@ static inline dev_t
 watch_get_dev (struct watch *w)
 {
     assert (w != NULL);
-    assert (!watch_deps_empty (w));
+    assert (watch_deps_empty (w) || w->dev == SLIST_FIRST(&w->deps)->iw->dev);
 
-    return SLIST_FIRST(&w->deps)->iw->dev;
+    return w->dev;
 }
 
 #endif /* __WATCH_H__ */
@@ -24,10 +24,14 @@
 
 #include <sys/types.h>
 #include <sys/event.h>
+#include <sys/socket.h> /* send */
+#include <sys/stat.h> /* fstatat */
 
 #include <stddef.h> /* NULL */
 #include <assert.h>
 #include <errno.h>  /* errno */
+#include <fcntl.h>  /* AT_SYMLINK_NOFOLLOW */
+#include <limits.h> /* PATH_MAX */
 #include <stdlib.h> /* calloc, realloc */
 #include <string.h> /* memset */
 #include <stdio.h>
@@ -39,9 +43,11 @@
 #include "config.h"
 #include "dep-list.h"
 #include "inotify-watch.h"
+#include "latency-hist.h"
 #include "utils.h"
 #include "watch.h"
 #include "worker.h"
+#include "worker-thread.h"
 
 void worker_erase (struct worker *wrk);
 static void handle_moved (void *udata,
@@ -59,7 +65,9 @@ static void handle_moved (void *udata,
 static int
 enqueue_event (struct i_watch *iw, uint32_t mask, const struct dep_item *di)
 {
+    struct i_watch *root;
     const char *name = NULL;
+    char path[PATH_MAX];
     uint32_t cookie = 0;
 
     assert (iw != NULL);
@@ -71,17 +79,36 @@ enqueue_event (struct i_watch *iw, uint32_t mask, const struct dep_item *di)
      * event queue from other pieces of code
      */
     mask &= (IN_ALL_EVENTS & iw->flags) | IN_UNMOUNT | IN_ISDIR;
-    /* Skip empty IN_ISDIR events and events from closed watches */
-    if (!(mask & (IN_ALL_EVENTS | IN_UNMOUNT)) || iw->is_closed) {
+    /* Skip empty IN_ISDIR events */
+    if (!(mask & (IN_ALL_EVENTS | IN_UNMOUNT))) {
         return 0;
     }
 
-    if (iw->flags & IN_ONESHOT) {
-        iw->is_closed = true;
+    /* Skip events from closed watches */
+    root = iwatch_get_root (iw);
+    if (root->is_closed) {
+        return 0;
+    }
+
+    /* Subdirectory events are reported by the watch of its parent */
+    if (iw != root && di == DI_PARENT) {
+        return 0;
+    }
+
+    if (root->flags & IN_ONESHOT) {
+        root->is_closed = true;
     }
 
     if (di != DI_PARENT) {
         name = di->path;
+        if (iw->path != NULL) {
+            if (snprintf (path, sizeof (path), "%s/%s", iw->path, di->path)
+                >= (int)sizeof (path)) {
+                perror_msg (("Path of %s is too long", di->path));
+                return -1;
+            }
+            name = path;
+        }
         if (mask & IN_MOVE) {
             cookie = di->inode & 0x00000000FFFFFFFF;
         }
@@ -116,6 +143,28 @@ process_command (struct worker *wrk, struct worker_cmd *cmd)
                                             cmd->cmd.add.mask);
         cmd->error = errno;
         break;
+    case WCMD_ADD_MANY:
+        cmd->retval = worker_add_many (wrk,
+                                       cmd->cmd.add_many.filenames,
+                                       cmd->cmd.add_many.masks,
+                                       cmd->cmd.add_many.wds,
+                                       cmd->cmd.add_many.n);
+        cmd->error = 0;
+        break;
+    case WCMD_ADD_ASYNC:
+        cmd->retval = worker_add_or_modify (wrk,
+                                            cmd->cmd.add_async.filename,
+                                            cmd->cmd.add_async.mask);
+        cmd->error = errno;
+        /* Nobody waits for the result so pass it through event stream */
+        if (event_queue_enqueue (&wrk->eq,
+                                 cmd->retval != -1 ? cmd->retval : -cmd->error,
+                                 IN_ADD_COMPLETE,
+                                 cmd->cmd.add_async.tag,
+                                 NULL) == -1) {
+            perror_msg (("Failed to enqueue add completion event"));
+        }
+        break;
     case WCMD_REMOVE:
         cmd->retval = worker_remove (wrk, cmd->cmd.rm_id);
         cmd->error = errno;
@@ -126,14 +175,21 @@ process_command (struct worker *wrk, struct worker_cmd *cmd)
                                         cmd->cmd.param.value);
         cmd->error = errno;
         break;
+    case WCMD_STATS:
+        worker_get_stats (wrk, cmd->cmd.stats);
+        cmd->retval = 0;
+        cmd->error = 0;
+        break;
+    case WCMD_LATENCY:
+        cmd->retval = worker_get_latency (wrk, cmd->cmd.lat);
+        cmd->error = errno;
+        break;
     default:
         perror_msg (("Worker processing a command without a command - "
                     "something went wrong."));
         cmd->retval = -1;
         cmd->error = EINVAL;
     }
-
-    worker_post (wrk);
 }
 
 /** 
@@ -163,7 +219,10 @@ handle_added (void *udata, struct dep_item *di)
     assert (ctx != NULL);
     assert (ctx->iw != NULL);
 
-    iwatch_add_subwatch (ctx->iw, di);
+    iwatch_add_subwatch (ctx->iw, di, false);
+    if (ctx->iw->flags & IN_RECURSIVE && S_ISDIR (di->type)) {
+        iwatch_add_subdir (ctx->iw, di);
+    }
 #ifdef HAVE_NOTE_EXTEND_ON_MOVE_TO
     if (ctx->fflags & NOTE_EXTEND) {
         enqueue_event (ctx->iw, IN_MOVED_TO, di);
@@ -195,6 +254,7 @@ handle_removed (void *udata, struct dep_item *di)
     } else
 #endif
     enqueue_event (ctx->iw, IN_DELETE, di);
+    iwatch_del_subdir (ctx->iw, di);
     iwatch_del_subwatch (ctx->iw, di);
 }
 
@@ -217,6 +277,7 @@ handle_replaced (void *udata, struct dep_item *di)
     assert (ctx != NULL);
     assert (ctx->iw != NULL);
 
+    iwatch_del_subdir (ctx->iw, di);
     iwatch_del_subwatch (ctx->iw, di);
 }
 
@@ -245,6 +306,11 @@ handle_moved (void *udata, struct dep_item *from_di, struct dep_item *to_di)
     enqueue_event (ctx->iw, IN_MOVED_FROM, from_di);
     enqueue_event (ctx->iw, IN_MOVED_TO, to_di);
     iwatch_move_subwatch (ctx->iw, from_di, to_di);
+    /* Subdirectory paths are changed so rebuild subtree */
+    iwatch_del_subdir (ctx->iw, from_di);
+    if (ctx->iw->flags & IN_RECURSIVE && S_ISDIR (to_di->type)) {
+        iwatch_add_subdir (ctx->iw, to_di);
+    }
 }
 
 
@@ -255,35 +321,242 @@ static const struct traverse_cbs cbs = {
     handle_moved,
 };
 
+/**
+ * Check dormant watch for changes.
+ *
+ * Dormant watches have no descriptors to receive kevents from so their
+ * file status is compared to the saved one instead. Changes are reported
+ * to all the parent directories. Changed files are considered active and
+ * are reopened if descriptor budget permits.
+ *
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] w   A pointer to dormant #watch.
+ **/
+static void
+check_dormant_watch (struct worker *wrk, struct watch *w)
+{
+    struct watch_dep *wd;
+    struct stat st;
+    uint32_t mask;
+    int fd;
+
+    assert (wrk != NULL);
+    assert (w != NULL);
+    assert (watch_is_dormant (w));
+    assert (!watch_deps_empty (w));
+
+    /* Removed and replaced files are handled by directory diff */
+    wd = SLIST_FIRST (&w->deps);
+    if (fstatat (wd->iw->fd, wd->di->path, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+        st.st_ino != w->inode) {
+        return;
+    }
+
+    mask = watch_check_stat (w, &st);
+    if (mask == 0) {
+        return;
+    }
+
+    WD_FOREACH (wd, w) {
+        enqueue_event (wd->iw, mask, wd->di);
+    }
+
+    if (worker_reserve_fd (wrk, true)) {
+        wd = SLIST_FIRST (&w->deps);
+        fd = watch_open (wd->iw->fd, wd->di->path, IN_DONT_FOLLOW);
+        if (fd != -1) {
+            worker_revive_watch (wrk, w, fd);
+        }
+    }
+}
+
+/**
+ * Check dormant subwatches of a directory for changes.
+ *
+ * @param[in] iw A pointer to #i_watch.
+ **/
+static void
+check_dormant_subwatches (struct i_watch *iw)
+{
+    struct dep_item *di;
+    struct watch *w;
+
+    assert (iw != NULL);
+
+    DL_FOREACH (di, &iw->deps) {
+        w = watch_set_find (&iw->wrk->watches, iw->dev, di->inode);
+        if (w != NULL && watch_is_dormant (w) &&
+            watch_find_dep (w, iw, di) != NULL) {
+            check_dormant_watch (iw->wrk, w);
+        }
+    }
+}
+
+/**
+ * Check all the dormant watches of a worker for changes.
+ *
+ * Called periodically as parent directories of dormant watches are not
+ * rescanned when only the files are changed.
+ *
+ * @param[in] wrk A pointer to #worker.
+ **/
+static void
+check_dormant_watches (struct worker *wrk)
+{
+    struct watch *w, *next;
+
+    assert (wrk != NULL);
+
+    /* File status can be newer than kevents of the batch */
+    wrk->eq.sb_unread = false;
+
+    /* Revived watches leave the list, evicted ones are appended to it */
+    for (w = TAILQ_FIRST (&wrk->dormant); w != NULL; w = next) {
+        next = TAILQ_NEXT (w, lru_link);
+        check_dormant_watch (wrk, w);
+    }
+}
+
 /**
  * Detect and notify about the changes in the watched directory.
  *
  * This function is top-level and it operates with other specific routines
  * to notify about different sets of events in a different conditions.
  *
- * @param[in] iw    A pointer to #i_watch.
- * @param[in] event A pointer to the received kqueue event.
+ * @param[in] iw     A pointer to #i_watch.
+ * @param[in] fflags A kqueue filter flags of the received kqueue event(s).
+ * @return true if directory has been read, false otherwise.
  **/
-void
-produce_directory_diff (struct i_watch *iw, struct kevent *event)
+static bool
+produce_directory_diff (struct i_watch *iw, uint32_t fflags)
 {
     struct handle_context ctx;
     struct chg_list *changes;
+    struct dep_item *di;
+    bool is_read = false;
 
     assert (iw != NULL);
-    assert (event != NULL);
 
-    changes = dl_listing (iw->fd, &iw->deps);
-    if (changes == NULL) {
-        perror_msg (("Failed to create a listing for watch %d", iw->wd));
+    /*
+     * Directory contents can be newer than kevents of the batch, so event
+     * queue can not rely on the last sent event to be unread anymore.
+     */
+    iw->wrk->eq.sb_unread = false;
+
+    /* Repeated or attribute-only kevents leave the entry set unchanged */
+    if (iwatch_refresh_stat (iw)) {
+        ++iw->wrk->stats.rescans_skipped;
+    } else {
+        changes = dl_listing (iw->fd, &iw->deps, &iw->wrk->dipool,
+                              &iw->wrk->dirbuf);
+        if (changes == NULL) {
+            perror_msg (("Failed to create a listing for watch %d", iw->wd));
+            iw->is_settled = false;
+            return true;
+        }
+        ++iw->wrk->stats.rescans;
+        SLIST_FOREACH (di, changes, u.s.list_link) {
+            ++iw->wrk->stats.entries_scanned;
+        }
+        is_read = true;
+
+        memset (&ctx, 0, sizeof (ctx));
+        ctx.iw = iw;
+        ctx.fflags = fflags;
+
+        dl_calculate (&iw->deps, changes, &cbs, &ctx, &iw->wrk->dipool);
+    }
+
+    if (iw->wrk->ndormant > 0) {
+        check_dormant_subwatches (iw);
+    }
+
+    return is_read;
+}
+
+/**
+ * Postpone directory diff till the end of current kevent batch.
+ *
+ * Directory is rescanned only once per batch no matter how many times
+ * it has been marked as changed.
+ *
+ * @param[in] iw     A pointer to #i_watch.
+ * @param[in] fflags A kqueue filter flags of the received kqueue event.
+ **/
+static void
+postpone_directory_diff (struct i_watch *iw, uint32_t fflags)
+{
+    assert (iw != NULL);
+    assert (fflags != 0);
+
+    if (iw->diff_fflags == 0) {
+        TAILQ_INSERT_TAIL (&iw->wrk->diffs, iw, diff_link);
+    }
+    iw->diff_fflags |= fflags;
+}
+
+/**
+ * Detect and notify about the changes in the watched directory if directory
+ * diff has been postponed.
+ *
+ * @param[in] iw A pointer to #i_watch.
+ **/
+void
+produce_postponed_diff (struct i_watch *iw)
+{
+    struct watch *w;
+    uint32_t fflags;
+
+    assert (iw != NULL);
+
+    fflags = iw->diff_fflags;
+    if (fflags == 0) {
         return;
     }
 
-    memset (&ctx, 0, sizeof (ctx));
-    ctx.iw = iw;
-    ctx.fflags = event->fflags;
+    TAILQ_REMOVE (&iw->wrk->diffs, iw, diff_link);
+    iw->diff_fflags = 0;
 
-    dl_calculate (&iw->deps, changes, &cbs, &ctx);
+#ifdef __OpenBSD__
+    /* OpenBSD notifies user with kevent about file moved in/out
+     * watched directory slightly BEFORE change hits directory
+     * content. Workaround it with adding a small delay. */
+    {
+        struct timespec timeout = { 0, 5 };
+        nanosleep (&timeout, NULL);
+    }
+#endif
+    if (!produce_directory_diff (iw, fflags)) {
+        return;
+    }
+
+    /* Next kevent can be produced by readdir call */
+    w = watch_set_find (&iw->wrk->watches, iw->dev, iw->inode);
+    if (w != NULL) {
+        w->skip_next = true;
+    }
+}
+
+/**
+ * Run all directory diffs postponed while processing of kevent batch.
+ *
+ * @param[in] wrk A pointer to #worker.
+ **/
+static void
+produce_postponed_diffs (struct worker *wrk)
+{
+    struct i_watch *iw;
+
+    assert (wrk != NULL);
+
+    while ((iw = TAILQ_FIRST (&wrk->diffs)) != NULL) {
+        produce_postponed_diff (iw);
+        /* Oneshot watch can be closed by events produced by diff */
+        iw = iwatch_get_root (iw);
+        if (iw->is_closed) {
+            worker_remove_iwatch (wrk, iw);
+        }
+    }
 }
 
 /**
@@ -330,12 +603,37 @@ produce_notifications (struct worker *wrk, struct kevent *event)
 
     w = (struct watch *)event->udata;
     assert (w != NULL);
+
+    /*
+     * Keep events order. Report directory changes postponed earlier first.
+     * Diff can free the watch or close it to fit the descriptor budget, so
+     * it is looked up again after each diff. Kevent is cancelled then.
+     */
+    do {
+        reiterate = false;
+        WD_FOREACH (wd, w) {
+            if (wd->iw->diff_fflags != 0) {
+                produce_postponed_diff (wd->iw);
+                reiterate = true;
+                break;
+            }
+        }
+        if (event->udata == PTR_TO_UDATA (NULL)) {
+            return;
+        }
+    } while (reiterate);
+
     assert (w->fd == event->ident);
     assert (!watch_deps_empty (w));
 
     flags = event->fflags;
     mode = watch_get_mode (w);
 
+    /* Keep active subwatches away from descriptor budget eviction */
+    if (w->in_lru) {
+        worker_touch_watch (wrk, w);
+    }
+
     /* Set deleted flag if no more links exist */
     if (flags & NOTE_DELETE && (!S_ISREG (mode) || is_deleted (w->fd))) {
         deleted = true;
@@ -376,20 +674,19 @@ produce_notifications (struct worker *wrk, struct kevent *event)
 
             if (is_parent && ie_order[i] == IN_MODIFY &&
                 flags & NOTE_WRITE && S_ISDIR (iw->mode)) {
-#ifdef __OpenBSD__
-                /* OpenBSD notifies user with kevent about file moved in/out
-                 * watched directory slightly BEFORE change hits directory
-                 * content. Workaround it with adding a small delay. */
-                {
-                    struct timespec timeout = { 0, 5 };
-                    nanosleep (&timeout, NULL);
-                }
-#endif
-                produce_directory_diff (iw, event);
-                w->skip_next = true;
+
+                postpone_directory_diff (iw, event->fflags);
 
             } else if (i_flags & ie_order[i]) {
 
+                /*
+                 * Directory diff postponed by this kevent does not touch
+                 * the directory watch itself, so it is safe to run it here
+                 * to report directory changes ahead of its other events.
+                 */
+                if (is_parent) {
+                    produce_postponed_diff (iw);
+                }
                 /* Report deaggregated items */
                 enqueue_event (iw,
                                ie_order[i] | (i_flags & ~IN_ALL_EVENTS),
@@ -404,16 +701,21 @@ produce_notifications (struct worker *wrk, struct kevent *event)
     do {
         reiterate = false;
         WD_FOREACH (wd, w) {
-            if (wd->iw->is_closed || (watch_dep_is_parent (wd) &&
+            /* Closing of recursive watch removes all its subdirectories */
+            struct i_watch *iw = iwatch_get_root (wd->iw);
+            if (!iw->is_closed) {
+                iw = wd->iw;
+            }
+            if (iw->is_closed || (watch_dep_is_parent (wd) &&
                 (deleted || flags & NOTE_REVOKE))) {
                 /* Check are 2 or more #i_watch associated with #watch */
                 WD_FOREACH (wd2, w) {
-                    if (wd->iw != wd2->iw) {
+                    if (wd2->iw != iw && iwatch_get_root (wd2->iw) != iw) {
                         reiterate = true;
                         break;
                     }
                 }
-                worker_remove_iwatch (wrk, wd->iw);
+                worker_remove_iwatch (wrk, iw);
                 break;
             }
         }
@@ -421,82 +723,514 @@ produce_notifications (struct worker *wrk, struct kevent *event)
 }
 
 /**
- * The worker thread command loop.
+ * Resize kevent batch buffer to match current batch size limit.
  *
- * @param[in] arg A pointer to the associated #worker.
- * @return NULL. 
-**/
-void*
-worker_thread (void *arg)
+ * @param[in] wl A pointer to #worker_loop.
+ **/
+static void
+resize_kevents (struct worker_loop *wl)
 {
-    struct worker* wrk = (struct worker *) arg;
-    struct worker_cmd *cmd;
-#define SBEMPTY SIZE_MAX
-    size_t sbspace = SBEMPTY;
-#define MAXEVENTS 1
-    struct kevent received[MAXEVENTS];
+    struct kevent *kevents;
 
-    assert (wrk != NULL);
+    kevents = realloc (wl->kevents,
+                       sizeof (struct kevent) * wl->kevent_batch);
+    if (kevents == NULL) {
+        perror_msg (("Failed to resize kevent batch to %d items",
+                     wl->kevent_batch));
+        /* Keep on using old buffer */
+        wl->kevent_batch = wl->kevents_size;
+        return;
+    }
 
-    for (;;) {
-        size_t i;
-        int nevents;
+    wl->kevents = kevents;
+    wl->kevents_size = wl->kevent_batch;
+}
 
-        if (sbspace > 0 && wrk->eq.mem_events > 0) {
-            ssize_t sent;
-            if (sbspace == SBEMPTY) {
-                /* Try to track sockbufsize changes on the fly */
-                sbspace = wrk->sockbufsize;
-            }
-            sent = event_queue_flush (&wrk->eq, sbspace);
-            if (sent < 0) {
-                if (errno == EPIPE || errno == EBADF || errno == ENOTSOCK) {
-                    goto die;
-                } else {
-                    sent = 0; /* Ignore nonfatal errors */
-                }
-            }
-            sbspace = wrk->eq.mem_events == 0 ? sbspace - sent : 0;
-        }
+/**
+ * Find a worker the received kqueue event belongs to.
+ *
+ * @param[in] event A pointer to the received kqueue event.
+ * @return A pointer to #worker or NULL if event has been cancelled.
+ **/
+static struct worker *
+kevent_to_worker (struct kevent *event)
+{
+    struct watch *w;
 
-        nevents = kevent (wrk->kq, NULL, 0, received, MAXEVENTS, NULL);
-        if (nevents == -1) {
-            perror_msg (("kevent failed"));
+    if (event->udata == PTR_TO_UDATA (NULL)) {
+        return NULL;
+    }
+
+    if (event->filter == EVFILT_VNODE) {
+        w = (struct watch *)event->udata;
+        assert (!watch_deps_empty (w));
+        return SLIST_FIRST (&w->deps)->iw->wrk;
+    }
+
+    return (struct worker *)event->udata;
+}
+
+/**
+ * Execute all the commands submitted to a worker.
+ *
+ * Commands are completed all at once, so user threads are woken up only
+ * once per batch of commands. On worker close commands are failed.
+ * Asynchronous commands are released right after execution.
+ *
+ * @param[in] wrk   A pointer to #worker.
+ * @param[in] close Fail pending commands and stop accepting new ones.
+ **/
+static void
+process_commands (struct worker *wrk, bool close)
+{
+    struct worker_cmd *cmd, *next;
+
+    cmd = worker_take_cmds (wrk, close);
+    if (cmd == NULL) {
+        return;
+    }
+
+    if (!close) {
+        /* Commands should see directory content up to date */
+        produce_postponed_diffs (wrk);
+    }
+
+    for (; cmd != NULL; cmd = next) {
+        /* cmd can be released by user thread as soon as it is done */
+        next = cmd->next;
+        if (!close) {
+            process_command (wrk, cmd);
+        }
+        if (cmd->type == WCMD_ADD_ASYNC) {
+            /* Asynchronous commands are owned by worker */
+            worker_cmd_free (cmd);
             continue;
         }
-        for (i = 0; i < nevents; i++) {
-            if (received[i].ident == wrk->io[KQUEUE_FD]) {
-                if (received[i].flags & EV_EOF) {
-                    goto die;
+        if (close) {
+            cmd->retval = -1;
+            cmd->error = EBADF;
+        }
+        atomic_store (&cmd->done, true);
+    }
+
+    worker_post (wrk);
+}
+
+/**
+ * Adjust communication socket buffer size to the traffic on its drain.
+ *
+ * If events have been left in memory as the buffer is full, the buffer
+ * is doubled up to the limit. It is halved down to the size set by user
+ * after a few drains in a row with the most of buffer unused.
+ *
+ * @param[in] wrk A pointer to #worker.
+ **/
+static void
+tune_sockbufsize (struct worker *wrk)
+{
+    int bufsize = wrk->sockbufsize;
+
+    if (wrk->sbspace == 0 && wrk->eq.mem_events > 0) {
+        wrk->sblight = 0;
+        if (bufsize < wrk->sockbufsize_max) {
+            bufsize = bufsize > wrk->sockbufsize_max / 2 ?
+                      wrk->sockbufsize_max : bufsize * 2;
+        }
+    } else if (wrk->sbused <= (size_t)bufsize / 4 &&
+               bufsize > wrk->sockbufsize_min) {
+        if (++wrk->sblight >= SBSHRINK_DRAINS) {
+            wrk->sblight = 0;
+            bufsize = bufsize / 2 < wrk->sockbufsize_min ?
+                      wrk->sockbufsize_min : bufsize / 2;
+        }
+    } else {
+        wrk->sblight = 0;
+    }
+    wrk->sbused = 0;
+
+    if (bufsize > wrk->sockbufsize &&
+        worker_set_sockbufsize (wrk, bufsize) == -1) {
+        /* Do not try to exceed system limit again */
+        wrk->sockbufsize_max = wrk->sockbufsize;
+    } else if (bufsize < wrk->sockbufsize) {
+        worker_set_sockbufsize (wrk, bufsize);
+    }
+}
+
+/**
+ * Process kqueue event received on worker communication socket or timer.
+ *
+ * @param[in] wrk   A pointer to #worker.
+ * @param[in] event A pointer to the received kqueue event.
+ **/
+static void
+process_pipe_event (struct worker *wrk, struct kevent *event)
+{
+#ifndef EVFILT_USER
+    char buf[32];
+#endif
+
+    assert (event->ident == wrk->io[KQUEUE_FD] ||
+            event->ident == DORMANT_TIMER (wrk));
+
+    if (event->flags & EV_EOF) {
+        wrk->is_closed = true;
 #ifdef EVFILT_EMPTY
-                } else if (received[i].filter == EVFILT_EMPTY) {
+    } else if (event->filter == EVFILT_EMPTY) {
 #else
-                } else if (received[i].filter == EVFILT_WRITE) {
-                    assert (received[i].data >= wrk->sockbufsize);
+    } else if (event->filter == EVFILT_WRITE) {
+        assert (event->data >= wrk->sockbufsize);
 #endif
-                    sbspace = SBEMPTY;
-                    /* Tell event queue about empty communication pipe */
-                    event_queue_reset_last (&wrk->eq);
+        if (wrk->sockbufsize_max > 0 && wrk->eq.ring == NULL) {
+            tune_sockbufsize (wrk);
+        }
+        wrk->sbspace = SBEMPTY;
+        /* Tell event queue about empty communication pipe */
+        if (wrk->eq.ring == NULL) {
+            event_queue_reset_last (&wrk->eq);
+        }
+    } else if (event->filter == EVFILT_TIMER &&
+               event->ident == DORMANT_TIMER (wrk)) {
+        wrk->dormant_armed = false;
+        check_dormant_watches (wrk);
+    } else if (event->filter == EVFILT_TIMER) {
+        /* Latency window is over. Flush events held back */
+        wrk->timer_armed = false;
+        wrk->flush_due = true;
 #ifdef EVFILT_USER
-                } else if (received[i].filter == EVFILT_USER) {
-                    cmd = (struct worker_cmd *)(intptr_t)received[i].data;
-                    process_command (wrk, cmd);
+    } else if (event->filter == EVFILT_USER) {
+        process_commands (wrk, false);
 #else
-                } else if (received[i].filter == EVFILT_READ) {
-                    if (read (wrk->io[KQUEUE_FD], &cmd, sizeof (cmd)) != -1) {
-                        process_command (wrk, cmd);
-                    }
+    } else if (event->filter == EVFILT_READ) {
+        /* Every wakeup brings at least one byte so they never pile up */
+        read (wrk->io[KQUEUE_FD], buf, sizeof (buf));
+        process_commands (wrk, false);
 #endif
+    }
+}
+
+/**
+ * Check if kqueue event reports that communication socket has been drained.
+ *
+ * @param[in] event A pointer to the received kqueue event.
+ * @return true if all the data sent to socket has been read by user.
+ **/
+static inline bool
+is_pipe_drained (struct kevent *event)
+{
+    if (event->filter == EVFILT_VNODE || event->flags & EV_EOF) {
+        return false;
+    }
+#ifdef EVFILT_EMPTY
+    return (event->filter == EVFILT_EMPTY);
+#else
+    return (event->filter == EVFILT_WRITE);
+#endif
+}
+
+/**
+ * Flush queued events to the shared memory ring.
+ *
+ * Communication socket serves as a doorbell. A byte is sent to it when the
+ * ring holds events not consumed by user and the socket has been drained,
+ * so user sleeping in poll(2) or read(2) is woken up. As user drains the
+ * socket before parsing the ring, events published after that are either
+ * seen by user or followed by another doorbell when the drain is reported.
+ * Events not fitting into the ring stay queued until the next drain.
+ *
+ * @param[in] wrk A pointer to #worker.
+ * @return 0 on success, -1 if the socket has been closed.
+ **/
+static int
+ring_events (struct worker *wrk)
+{
+    int send_flags = 0;
+
+    if (wrk->eq.mem_events > 0) {
+        event_queue_flush (&wrk->eq, 0);
+    }
+
+    if (wrk->sbspace == 0 || event_ring_is_empty (wrk->eq.ring)) {
+        return 0;
+    }
+
+#if defined (MSG_NOSIGNAL)
+    send_flags |= MSG_NOSIGNAL;
+#endif
+    if (send (wrk->io[KQUEUE_FD], "", 1, send_flags) == -1) {
+        if (errno == EPIPE || errno == EBADF || errno == ENOTSOCK) {
+            return -1;
+        }
+        /* Ignore nonfatal errors */
+        return 0;
+    }
+    wrk->sbspace = 0;
+    return 0;
+}
+
+/**
+ * Send queued events to the communication socket.
+ *
+ * @param[in] wrk A pointer to #worker.
+ * @return 0 on success, -1 if the socket has been closed.
+ **/
+static int
+send_events (struct worker *wrk)
+{
+    ssize_t sent;
+
+    if (wrk->sbspace == 0 || wrk->eq.mem_events == 0) {
+        return 0;
+    }
+
+    if (wrk->sbspace == SBEMPTY) {
+        /* Try to track sockbufsize changes on the fly */
+        wrk->sbspace = wrk->sockbufsize;
+    }
+    sent = event_queue_flush (&wrk->eq, wrk->sbspace);
+    if (sent < 0) {
+        if (errno == EPIPE || errno == EBADF || errno == ENOTSOCK) {
+            return -1;
+        } else {
+            sent = 0; /* Ignore nonfatal errors */
+        }
+    }
+    wrk->sbspace = wrk->eq.mem_events == 0 ? wrk->sbspace - sent : 0;
+    wrk->sbused += sent;
+    return 0;
+}
+
+/**
+ * Start one-shot timer of latency window.
+ *
+ * @param[in] wrk A pointer to #worker.
+ * @return 0 if timer is running, -1 otherwise.
+ **/
+static int
+start_latency_timer (struct worker *wrk)
+{
+    struct kevent ev;
+
+    if (wrk->timer_armed) {
+        return 0;
+    }
+
+    EV_SET (&ev,
+            wrk->io[KQUEUE_FD],
+            EVFILT_TIMER,
+            EV_ADD | EV_ONESHOT,
+            0,
+            wrk->latency,
+            PTR_TO_UDATA (wrk));
+    if (kevent (wrk->kq, &ev, 1, NULL, 0, zero_tsp) == -1) {
+        perror_msg (("Failed to start latency timer"));
+        return -1;
+    }
+
+    wrk->timer_armed = true;
+    return 0;
+}
+
+/**
+ * Start one-shot timer of dormant watch checks.
+ *
+ * @param[in] wrk A pointer to #worker.
+ **/
+static void
+start_dormant_timer (struct worker *wrk)
+{
+    struct kevent ev;
+
+    if (wrk->dormant_armed) {
+        return;
+    }
+
+    EV_SET (&ev,
+            DORMANT_TIMER (wrk),
+            EVFILT_TIMER,
+            EV_ADD | EV_ONESHOT,
+            0,
+            DORMANT_CHECK_INTERVAL,
+            PTR_TO_UDATA (wrk));
+    if (kevent (wrk->kq, &ev, 1, NULL, 0, zero_tsp) == -1) {
+        perror_msg (("Failed to start dormant check timer"));
+        return;
+    }
+
+    wrk->dormant_armed = true;
+}
+
+/**
+ * Flush queued events to the communication socket or shared memory ring.
+ *
+ * If latency window is set, the first events queued start the timer and
+ * are held back along with following ones until the timer fires.
+ *
+ * @param[in] wrk A pointer to #worker.
+ * @return 0 on success, -1 if the socket has been closed.
+ **/
+static int
+flush_events (struct worker *wrk)
+{
+    int retval;
+
+    if (wrk->latency > 0 && !wrk->flush_due && wrk->eq.mem_events > 0 &&
+        start_latency_timer (wrk) == 0) {
+        return 0;
+    }
+
+    if (wrk->eq.ring != NULL) {
+        retval = ring_events (wrk);
+    } else {
+        retval = send_events (wrk);
+    }
+
+    /* Events left in memory do not wait for another latency window */
+    if (wrk->eq.mem_events == 0) {
+        wrk->flush_due = false;
+    }
+    return retval;
+}
+
+/**
+ * The worker thread event loop.
+ *
+ * @param[in] arg A pointer to the associated #worker_loop.
+ * @return NULL. 
+**/
+void*
+worker_thread (void *arg)
+{
+    struct worker_loop *wl = (struct worker_loop *) arg;
+    struct workers_list batch = SLIST_HEAD_INITIALIZER (&batch);
+    struct worker *wrk;
+    struct watch *w;
+    struct latency_hist *lh;
+    struct kevent *received;
+    uint64_t wakeup, start;
+    bool is_alive = true, is_full;
+
+    assert (wl != NULL);
+
+    while (is_alive) {
+        int i;
+
+        if (wl->kevents_size != wl->kevent_batch) {
+            resize_kevents (wl);
+        }
+
+        received = wl->kevents;
+        wl->nkevents = kevent (wl->kq, NULL, 0, received, wl->kevents_size,
+                               NULL);
+        if (wl->nkevents == -1) {
+            perror_msg (("kevent failed"));
+            wl->nkevents = 0;
+            continue;
+        }
+        /* Clocks are read only if someone collects latency histograms */
+        wakeup = wl->nlatency > 0 ? latency_now () : 0;
+        /* Generation 0 is reserved for watches without kevents in batch */
+        if (++wl->batch_gen == 0) {
+            ++wl->batch_gen;
+        }
+
+        /*
+         * Stamp watches to find out if they have kevents in the batch
+         * without a batch walk.
+         *
+         * Take drained sockets into account ahead of other kevents. If the
+         * batch is not full, all the sockets drained before kevent() call
+         * are known now, so last events sent to the rest of sockets were
+         * unread when the changes reported by kevents had been made.
+         * Event queue coalesces with such events. In full batches and
+         * after rescans the state of the socket is unknown, and events
+         * are not coalesced with ones already sent.
+         */
+        for (i = 0; i < wl->nkevents; i++) {
+            if (received[i].filter == EVFILT_VNODE) {
+                w = (struct watch *)received[i].udata;
+                w->batch_gen = wl->batch_gen;
+            } else if (is_pipe_drained (&received[i])) {
+                wrk = kevent_to_worker (&received[i]);
+                if (wrk != NULL && !wrk->is_closed) {
+                    process_pipe_event (wrk, &received[i]);
                 }
-            } else {
+            }
+        }
+        is_full = wl->nkevents == wl->kevents_size;
+
+        for (i = 0; i < wl->nkevents; i++) {
+            wrk = kevent_to_worker (&received[i]);
+            /* Skip events of watches removed earlier in this batch */
+            if (wrk == NULL || wrk->is_closed) {
+                continue;
+            }
+            ++wrk->stats.kevents;
+            if (!wrk->in_batch) {
+                wrk->in_batch = true;
+                wrk->eq.sb_unread = wrk->eq.last != NULL && !is_full &&
+                                    wrk->eq.ring == NULL;
+                SLIST_INSERT_HEAD (&batch, wrk, batch_link);
+            }
+            lh = wakeup != 0 ? wrk->eq.lat : NULL;
+            if (lh != NULL) {
+                start = latency_now ();
+                lh->wakeup = wakeup;
+                latency_hist_add (lh, IN_LAT_WAKEUP, start - wakeup, 1);
+            }
+            if (received[i].filter == EVFILT_VNODE) {
                 produce_notifications (wrk, &received[i]);
+                if (lh != NULL) {
+                    latency_hist_add (lh, IN_LAT_NOTIFY,
+                                      latency_now () - start, 1);
+                }
+            } else if (!is_pipe_drained (&received[i])) {
+                process_pipe_event (wrk, &received[i]);
+            }
+        }
+
+        while (!SLIST_EMPTY (&batch)) {
+            wrk = SLIST_FIRST (&batch);
+            SLIST_REMOVE_HEAD (&batch, batch_link);
+            wrk->in_batch = false;
+            wrk->eq.sb_unread = false;
+
+            if (!wrk->is_closed) {
+                /* Rescan directories changed in this batch only once */
+                lh = wrk->eq.lat;
+                if (lh != NULL && !TAILQ_EMPTY (&wrk->diffs)) {
+                    start = latency_now ();
+                    produce_postponed_diffs (wrk);
+                    latency_hist_add (lh, IN_LAT_DIFF,
+                                      latency_now () - start, 1);
+                } else {
+                    produce_postponed_diffs (wrk);
+                }
+                /* Closed files are checked until they are reopened */
+                if (wrk->ndormant > 0) {
+                    start_dormant_timer (wrk);
+                }
+                /* Socket is flushed once per batch of kevents */
+                if (flush_events (wrk) == -1) {
+                    wrk->is_closed = true;
+                }
+                if (wrk->eq.lat != NULL) {
+                    wrk->eq.lat->wakeup = 0;
+                }
+            }
+
+            if (wrk->is_closed) {
+                worker_erase (wrk);
+                /* Notify user threads waiting for cmd of grim news */
+                process_commands (wrk, true);
+                worker_free (wrk);
+                /* Dedicated thread serves only one worker */
+                is_alive = wl->is_shared;
             }
         }
+        wl->nkevents = 0;
     }
-die:
-    worker_erase (wrk);
-    /* Notify user threads waiting for cmd of grim news */
-    worker_post (wrk);
-    worker_free (wrk);
+
+    worker_loop_free (wl);
     return NULL;
 }
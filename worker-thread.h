@@ -25,6 +25,9 @@
 #ifndef __WORKER_THREAD_H__
 #define __WORKER_THREAD_H__
 
+struct i_watch;
+
 void* worker_thread (void *arg);
+void  produce_postponed_diff (struct i_watch *iw);
 
 #endif /* __WORKER_THREAD_H__ */
@@ -29,6 +29,7 @@
 
 #include <assert.h>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h> /* open() */
 #include <pthread.h>
 #include <signal.h> 
@@ -50,6 +51,13 @@
 static void
 worker_cmd_reset (struct worker_cmd *cmd);
 
+static struct worker_loop **pool = NULL; /* worker thread pool */
+static int pool_size = 0;                /* number of started pool threads */
+static int pool_threads = IN_DEF_WORKER_THREADS; /* requested pool size */
+static unsigned int pool_next = 0;       /* next loop to assign worker to */
+static int pool_kevent_batch = IN_DEF_KEVENT_BATCH; /* pool kevent batch */
+static pthread_mutex_t pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+
 
 /**
  * Prepare a command with the data of the inotify_add_watch() call.
@@ -69,6 +77,79 @@ worker_cmd_add (struct worker_cmd *cmd, const char *filename, uint32_t mask)
     cmd->cmd.add.mask = mask;
 }
 
+/**
+ * Prepare a command with the data of the inotify_add_watches() call.
+ *
+ * @param[in]     cmd       A pointer to #worker_cmd.
+ * @param[in]     filenames An array of file names of the watched entries.
+ * @param[in]     masks     An array of combinations of the inotify watch flags.
+ * @param[in,out] wds       An array of per-entry results. Only entries
+ *                          set to 0 are processed by the worker.
+ * @param[in]     n         A number of elements in the arrays.
+ **/
+void
+worker_cmd_add_many (struct worker_cmd *cmd,
+                     const char *const filenames[],
+                     const uint32_t masks[],
+                     int wds[],
+                     size_t n)
+{
+    assert (cmd != NULL);
+    worker_cmd_reset (cmd);
+
+    cmd->type = WCMD_ADD_MANY;
+    cmd->cmd.add_many.filenames = filenames;
+    cmd->cmd.add_many.masks = masks;
+    cmd->cmd.add_many.wds = wds;
+    cmd->cmd.add_many.n = n;
+}
+
+/**
+ * Allocate a command with the data of the inotify_add_watch_async() call.
+ *
+ * Unlike other commands it is owned by the worker after submission.
+ *
+ * @param[in] filename A file name of the watched entry.
+ * @param[in] mask     A combination of the inotify watch flags.
+ * @param[in] tag      A user tag to report with the completion event.
+ * @return A pointer to a new #worker_cmd or NULL on failure.
+ **/
+struct worker_cmd*
+worker_cmd_add_async (const char *filename, uint32_t mask, uint32_t tag)
+{
+    struct worker_cmd *cmd;
+
+    cmd = calloc (1, sizeof (struct worker_cmd));
+    if (cmd == NULL) {
+        return NULL;
+    }
+    worker_cmd_reset (cmd);
+
+    cmd->type = WCMD_ADD_ASYNC;
+    cmd->cmd.add_async.filename = strdup (filename);
+    if (cmd->cmd.add_async.filename == NULL) {
+        free (cmd);
+        return NULL;
+    }
+    cmd->cmd.add_async.mask = mask;
+    cmd->cmd.add_async.tag = tag;
+    return cmd;
+}
+
+/**
+ * Free a command allocated with worker_cmd_add_async().
+ *
+ * @param[in] cmd A pointer to #worker_cmd.
+ **/
+void
+worker_cmd_free (struct worker_cmd *cmd)
+{
+    assert (cmd != NULL);
+    assert (cmd->type == WCMD_ADD_ASYNC);
+
+    free (cmd->cmd.add_async.filename);
+    free (cmd);
+}
 
 /**
  * Prepare a command with the data of the inotify_rm_watch() call.
@@ -104,6 +185,38 @@ worker_cmd_param (struct worker_cmd *cmd, int param, intptr_t value)
     cmd->cmd.param.value = value;
 }
 
+/**
+ * Prepare a command with the data of the inotify_get_stats() call.
+ *
+ * @param[in] cmd   A pointer to #worker_cmd.
+ * @param[in] stats A pointer to #inotify_stats to be filled by worker.
+ **/
+void
+worker_cmd_stats (struct worker_cmd *cmd, struct inotify_stats *stats)
+{
+    assert (cmd != NULL);
+    worker_cmd_reset (cmd);
+
+    cmd->type = WCMD_STATS;
+    cmd->cmd.stats = stats;
+}
+
+/**
+ * Prepare a command with the data of the inotify_get_latency() call.
+ *
+ * @param[in] cmd A pointer to #worker_cmd.
+ * @param[in] lat A pointer to #inotify_latency to be filled by worker.
+ **/
+void
+worker_cmd_latency (struct worker_cmd *cmd, struct inotify_latency *lat)
+{
+    assert (cmd != NULL);
+    worker_cmd_reset (cmd);
+
+    cmd->type = WCMD_LATENCY;
+    cmd->cmd.lat = lat;
+}
+
 /**
  * Reset the worker command.
  *
@@ -115,12 +228,13 @@ worker_cmd_reset (struct worker_cmd *cmd)
     assert (cmd != NULL);
 
     memset (cmd, 0, sizeof (struct worker_cmd));
+    atomic_init (&cmd->done, false);
 }
 
 /**
- * Signal user thread if worker command is done
+ * Wake up user threads waiting for completion of worker commands.
  *
- * @param[in] cmd A pointer to #worker_cmd.
+ * @param[in] wrk A pointer to #worker.
  **/
 void
 worker_post (struct worker *wrk)
@@ -128,57 +242,132 @@ worker_post (struct worker *wrk)
     assert (wrk != NULL);
 
     worker_lock (wrk);
-    ++wrk->sema;
     pthread_cond_broadcast (&wrk->cv);
     worker_unlock (wrk);
-
 }
 
 /**
- * Wait for worker command to complete
+ * Wait for worker command to complete.
  *
- * @param[in] cmd A pointer to #worker_cmd.
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] cmd A pointer to #worker_cmd submitted to the #worker.
  **/
 void
-worker_wait (struct worker *wrk)
+worker_wait (struct worker *wrk, struct worker_cmd *cmd)
 {
     assert (wrk != NULL);
+    assert (cmd != NULL);
 
     worker_lock (wrk);
-    while (wrk->sema == 0) {
+    while (!atomic_load (&cmd->done)) {
         pthread_cond_wait (&wrk->cv, &wrk->mutex);
     }
-    --wrk->sema;
     worker_unlock (wrk);
 }
 
 /**
- * Signal worker thread that #worker_cmd should be executed.
+ * Signal worker thread that there are commands to be executed.
  *
  * @param[in] wrk A pointer to #worker.
- * @param[in] cmd A pointer to #worker_cmd passed to #worker.
  * @return positive number or 0 on success, -1 on error
  **/
 int
-worker_notify (struct worker *wrk, struct worker_cmd *cmd)
+worker_notify (struct worker *wrk)
 {
 #ifdef EVFILT_USER
     struct kevent ke;
 
-    /* Pass cmd in data field as DragonflyBSD does not copy udata */
     EV_SET (&ke,
             wrk->io[KQUEUE_FD],
             EVFILT_USER,
             0,
             NOTE_TRIGGER,
-            (intptr_t)cmd,
-            0);
+            0,
+            PTR_TO_UDATA (wrk));
     return kevent (wrk->kq, &ke, 1, NULL, 0, zero_tsp);
 #else
-    return write (wrk->io[INOTIFY_FD], &cmd, sizeof (cmd));
+    char c = 0;
+
+    return write (wrk->io[INOTIFY_FD], &c, sizeof (c));
 #endif
 }
 
+/**
+ * Submit a command to the worker thread.
+ *
+ * Commands are pushed onto the lock-free stack, so several user threads can
+ * submit commands to the same worker at once. Only the thread which finds
+ * the stack empty wakes the worker up, the worker then executes all the
+ * stacked commands at once.
+ *
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] cmd A pointer to #worker_cmd to execute.
+ * @return 0 on success, -1 on failure with errno set. Command is
+ *     completed asynchronously on success, see worker_wait().
+ **/
+int
+worker_submit (struct worker *wrk, struct worker_cmd *cmd)
+{
+    uintptr_t head;
+
+    assert (wrk != NULL);
+    assert (cmd != NULL);
+
+    head = atomic_load (&wrk->cmds);
+    do {
+        if (head == CMDS_CLOSED) {
+            errno = EBADF;
+            return -1;
+        }
+        cmd->next = (struct worker_cmd *)head;
+    } while (!atomic_compare_exchange_weak (&wrk->cmds, &head,
+                                            (uintptr_t)cmd));
+
+    if (head == 0 && worker_notify (wrk) == -1) {
+        perror_msg (("Failed to wake up worker thread"));
+        /*
+         * Try to withdraw the command. That fails if it has been stacked
+         * over or taken already. Worker will handle it on next wakeup then.
+         */
+        head = (uintptr_t)cmd;
+        if (atomic_compare_exchange_strong (&wrk->cmds, &head, 0)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Take all the commands submitted to the worker.
+ *
+ * @param[in] wrk   A pointer to #worker.
+ * @param[in] close Reject all further submissions if true.
+ * @return A list of taken commands in order of submission.
+ **/
+struct worker_cmd *
+worker_take_cmds (struct worker *wrk, bool close)
+{
+    struct worker_cmd *cmd, *next, *list = NULL;
+    uintptr_t head;
+
+    assert (wrk != NULL);
+
+    head = atomic_exchange (&wrk->cmds, close ? CMDS_CLOSED : 0);
+    if (head == CMDS_CLOSED) {
+        return NULL;
+    }
+
+    /* Stack keeps commands in reverse order */
+    for (cmd = (struct worker_cmd *)head; cmd != NULL; cmd = next) {
+        next = cmd->next;
+        cmd->next = list;
+        list = cmd;
+    }
+
+    return list;
+}
+
 /**
  * Set communication pipe buffer size
  * @param[in] wrk     A pointer to #worker.
@@ -208,7 +397,7 @@ worker_set_sockbufsize (struct worker *wrk, int bufsize)
                 EV_ADD | EV_ENABLE | EV_CLEAR,
                 NOTE_LOWAT,
                 bufsize,
-                0);
+                PTR_TO_UDATA (wrk));
 
         if (kevent (wrk->kq, &ev, 1, NULL, 0, zero_tsp) == -1) {
             int save_errno = errno;
@@ -283,17 +472,243 @@ pipe_init (int fildes[2], int flags)
 }
 
 /**
- * Create a new worker and start its thread.
+ * Create a new kqueue event loop.
+ *
+ * @param[in] is_shared true if loop is a part of worker thread pool.
+ * @return A pointer to a new event loop or NULL on failure.
+ **/
+static struct worker_loop*
+worker_loop_create (bool is_shared)
+{
+    struct worker_loop *wl = calloc (1, sizeof (struct worker_loop));
+    int batch = is_shared ? pool_kevent_batch : IN_DEF_KEVENT_BATCH;
+
+    if (wl == NULL) {
+        perror_msg (("Failed to create a new event loop"));
+        return NULL;
+    }
+
+    wl->is_shared = is_shared;
+    wl->kq = kqueue ();
+    if (wl->kq == -1) {
+        perror_msg (("Failed to create a new kqueue"));
+        free (wl);
+        return NULL;
+    }
+
+    wl->kevents = calloc (batch, sizeof (struct kevent));
+    if (wl->kevents == NULL) {
+        perror_msg (("Failed to allocate kevent batch"));
+        worker_loop_free (wl);
+        return NULL;
+    }
+    wl->nkevents = 0;
+    wl->kevents_size = batch;
+    wl->kevent_batch = batch;
+
+    return wl;
+}
+
+/**
+ * Start a thread running the event loop.
+ *
+ * @param[in] wl A pointer to #worker_loop.
+ * @return 0 on success, -1 on failure.
+ **/
+static int
+worker_loop_start (struct worker_loop *wl)
+{
+    pthread_attr_t attr;
+    sigset_t set, oset;
+    int result;
+
+    assert (wl != NULL);
+
+    /* create a run a worker thread */
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+
+    sigfillset (&set);
+    pthread_sigmask (SIG_BLOCK, &set, &oset);
+
+    result = pthread_create (&wl->thread, &attr, worker_thread, wl);
+
+    pthread_attr_destroy (&attr);
+    pthread_sigmask (SIG_SETMASK, &oset, NULL);
+
+    if (result != 0) {
+        errno = result;
+        perror_msg (("Failed to start a new worker thread"));
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Free an event loop and all the associated memory.
+ *
+ * @param[in] wl A pointer to #worker_loop.
+ **/
+void
+worker_loop_free (struct worker_loop *wl)
+{
+    assert (wl != NULL);
+
+    close (wl->kq);
+    free (wl->kevents);
+    free (wl);
+}
+
+/**
+ * Set size of worker thread pool.
+ *
+ * Only inotify instances created after the call are affected.
+ *
+ * @param[in] value Number of threads, 0 to disable pool, -1 for number of
+ *                  online CPUs.
+ * @return 0 on success, -1 on failure.
+ **/
+int
+worker_pool_set_size (intptr_t value)
+{
+    if (value == -1) {
+        long ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+        value = ncpu > 0 ? ncpu : 1;
+    }
+
+    if (value < 0 || value > INT_MAX / sizeof (struct worker_loop *)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock (&pool_mtx);
+    if (pool != NULL && value != 0 && value != pool_size) {
+        pthread_mutex_unlock (&pool_mtx);
+        errno = EBUSY;
+        return -1;
+    }
+    pool_threads = value;
+    pthread_mutex_unlock (&pool_mtx);
+
+    return 0;
+}
+
+/**
+ * Set number of kevents harvested at once by worker pool threads.
+ *
+ * Pool threads serve many instances so the value is global. It can not be
+ * changed once the pool has been started.
+ *
+ * @param[in] value Maximal number of kevents in a batch.
+ * @return 0 on success, -1 on failure.
+ **/
+int
+worker_pool_set_kevent_batch (intptr_t value)
+{
+    if (value <= 0 || value > INT_MAX / sizeof (struct kevent)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock (&pool_mtx);
+    if (pool != NULL && value != pool_kevent_batch) {
+        pthread_mutex_unlock (&pool_mtx);
+        errno = EBUSY;
+        return -1;
+    }
+    pool_kevent_batch = value;
+    pthread_mutex_unlock (&pool_mtx);
+
+    return 0;
+}
+
+/**
+ * Start worker thread pool.
+ *
+ * Pool threads are never stopped. If only some of threads can be started,
+ * pool is shrunk to the number of running threads.
+ *
+ * @return 0 on success, -1 on failure.
+ **/
+static int
+worker_pool_start (void)
+{
+    struct worker_loop **loops;
+    int i;
+
+    assert (pool == NULL);
+    assert (pool_threads > 0);
+
+    loops = calloc (pool_threads, sizeof (struct worker_loop *));
+    if (loops == NULL) {
+        perror_msg (("Failed to allocate worker thread pool"));
+        return -1;
+    }
+
+    for (i = 0; i < pool_threads; i++) {
+        loops[i] = worker_loop_create (true);
+        if (loops[i] == NULL) {
+            break;
+        }
+        if (worker_loop_start (loops[i]) == -1) {
+            worker_loop_free (loops[i]);
+            break;
+        }
+    }
+
+    if (i == 0) {
+        free (loops);
+        return -1;
+    }
+
+    pool = loops;
+    pool_size = i;
+    pool_threads = i;
+    return 0;
+}
+
+/**
+ * Pick a pool event loop for a new worker. Pool is started on first use.
+ *
+ * @param[out] wl A pointer to store #worker_loop to. NULL is stored if
+ *                the pool is disabled.
+ * @return 0 on success, -1 on failure.
+ **/
+static int
+worker_pool_get (struct worker_loop **wl)
+{
+    int retval = 0;
+
+    assert (wl != NULL);
+
+    *wl = NULL;
+    pthread_mutex_lock (&pool_mtx);
+    if (pool_threads > 0) {
+        if (pool == NULL) {
+            retval = worker_pool_start ();
+        }
+        if (retval == 0) {
+            /* Round-robin scheduling. Workers are never migrated */
+            *wl = pool[pool_next++ % pool_size];
+        }
+    }
+    pthread_mutex_unlock (&pool_mtx);
+
+    return retval;
+}
+
+/**
+ * Create a new worker and start its thread or attach it to the pool.
  *
  * @return A pointer to a new worker.
  **/
 struct worker*
 worker_create (int flags)
 {
-    pthread_attr_t attr;
+    struct worker_loop *wl = NULL;
     struct kevent ev[3];
-    sigset_t set, oset;
-    int result, nevents = 1;
+    int nevents = 0;
 
     struct worker* wrk = calloc (1, sizeof (struct worker));
 
@@ -302,14 +717,21 @@ worker_create (int flags)
         goto failure;
     }
 
+    wrk->kq = -1;
     wrk->io[INOTIFY_FD] = -1;
     wrk->io[KQUEUE_FD] = -1;
 
-    wrk->kq = kqueue ();
-    if (wrk->kq == -1) {
-        perror_msg (("Failed to create a new kqueue"));
+    if (worker_pool_get (&wl) == -1) {
         goto failure;
     }
+    if (wl == NULL) {
+        wl = worker_loop_create (false);
+        if (wl == NULL) {
+            goto failure;
+        }
+    }
+    wrk->loop = wl;
+    wrk->kq = wl->kq;
 
     if (pipe_init (wrk->io, flags) == -1) {
         perror_msg (("Failed to create a pipe"));
@@ -317,22 +739,71 @@ worker_create (int flags)
     }
 
     /* Set socket buffer size to IN_DEF_SOCKBUFSIZE bytes */
-    if (worker_set_sockbufsize(wrk, IN_DEF_SOCKBUFSIZE) == -1) {
+    if (set_sndbuf_size (wrk->io[KQUEUE_FD], IN_DEF_SOCKBUFSIZE)) {
+        perror_msg (("Failed to set send buffer size for socket"));
         goto failure;
     }
+    wrk->sockbufsize = IN_DEF_SOCKBUFSIZE;
+    wrk->sockbufsize_min = IN_DEF_SOCKBUFSIZE;
+    wrk->sockbufsize_max = IN_DEF_SOCKBUFSIZE_MAX;
+    wrk->sbused = 0;
+    wrk->sblight = 0;
+    wrk->sbspace = SBEMPTY;
+    wrk->is_closed = false;
+    wrk->in_batch = false;
+
+    LIST_INIT (&wrk->head);
+    iwatch_set_init (&wrk->wds);
+    TAILQ_INIT (&wrk->diffs);
+
+    wrk->wd_last = 0;
+    wrk->wd_overflow = false;
 
-    SLIST_INIT (&wrk->head);
+    atomic_init (&wrk->cmds, 0);
+    atomic_init (&wrk->mutex_rc, 0);
+    pthread_mutex_init (&wrk->mutex, NULL);
+    pthread_cond_init (&wrk->cv, NULL);
+    watch_cache_init (&wrk->wcache);
+    slab_cache_init (&wrk->iwcache, sizeof (struct i_watch));
+    slab_pool_init (&wrk->dipool, DI_POOL_MIN_SIZE);
+    dl_dirbuf_init (&wrk->dirbuf, IN_DEF_READDIR_BUFSIZE);
+    watch_set_init (&wrk->watches, &wrk->wcache);
+    TAILQ_INIT (&wrk->lru);
+    TAILQ_INIT (&wrk->dormant);
+    wrk->ndormant = 0;
+    wrk->max_fds = IN_DEF_MAX_WATCH_FDS;
+    wrk->latency = IN_DEF_LATENCY;
+    wrk->timer_armed = false;
+    wrk->flush_due = false;
+    wrk->dormant_armed = false;
+    if (event_queue_init (&wrk->eq) == -1) {
+        goto failure;
+    }
+    if (flags & IN_SHMRING && event_queue_map_ring (&wrk->eq) == -1) {
+        goto failure;
+    }
 
+    /*
+     * Shared event loop can start processing of worker kevents right after
+     * registration so register them last. Kevents which are reported at once
+     * go last too, so failed registration never leaves them in the loop.
+     */
 #ifdef EVFILT_USER
-    EV_SET (&ev[0], wrk->io[KQUEUE_FD], EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, 0);
+    EV_SET (&ev[nevents++],
+            wrk->io[KQUEUE_FD],
+            EVFILT_USER,
+            EV_ADD | EV_CLEAR,
+            0,
+            0,
+            PTR_TO_UDATA (wrk));
 #else
-    EV_SET (&ev[0],
+    EV_SET (&ev[nevents++],
             wrk->io[KQUEUE_FD],
             EVFILT_READ,
             EV_ADD | EV_ENABLE | EV_CLEAR,
             NOTE_LOWAT,
             1,
-            0);
+            PTR_TO_UDATA (wrk));
 #endif
 #ifdef EVFILT_EMPTY
     /*
@@ -343,15 +814,28 @@ worker_create (int flags)
      * to check available send buffer space. Note that we still use
      * EVFILT_WRITE with NOTE_LOWAT set too high to check EOF conditions.
      */
-    EV_SET (&ev[1],
+    EV_SET (&ev[nevents++],
             wrk->io[KQUEUE_FD],
             EVFILT_WRITE,
             EV_ADD | EV_ENABLE | EV_CLEAR,
             NOTE_LOWAT,
             INT_MAX,
-            0);
-    EV_SET (&ev[2], wrk->io[KQUEUE_FD], EVFILT_EMPTY, EV_ADD | EV_CLEAR, 0, 0, 0);
-    nevents = 3;
+            PTR_TO_UDATA (wrk));
+    EV_SET (&ev[nevents++],
+            wrk->io[KQUEUE_FD],
+            EVFILT_EMPTY,
+            EV_ADD | EV_CLEAR,
+            0,
+            0,
+            PTR_TO_UDATA (wrk));
+#else
+    EV_SET (&ev[nevents++],
+            wrk->io[KQUEUE_FD],
+            EVFILT_WRITE,
+            EV_ADD | EV_ENABLE | EV_CLEAR,
+            NOTE_LOWAT,
+            wrk->sockbufsize,
+            PTR_TO_UDATA (wrk));
 #endif
 
     if (kevent (wrk->kq, ev, nevents, NULL, 0, zero_tsp) == -1) {
@@ -359,36 +843,12 @@ worker_create (int flags)
         goto failure;
     }
 
-    wrk->wd_last = 0;
-    wrk->wd_overflow = false;
-
-    pthread_mutex_init (&wrk->cmd_mtx, NULL);
-    atomic_init (&wrk->mutex_rc, 0);
-    pthread_mutex_init (&wrk->mutex, NULL);
-    pthread_cond_init (&wrk->cv, NULL);
-    wrk->sema = 0;
-    event_queue_init (&wrk->eq);
-    watch_set_init (&wrk->watches);
-
-    /* create a run a worker thread */
-    pthread_attr_init (&attr);
-    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
-
-    sigfillset (&set);
-    pthread_sigmask (SIG_BLOCK, &set, &oset);
-
-    result = pthread_create (&wrk->thread, &attr, worker_thread, wrk);
-    
-    pthread_attr_destroy (&attr);
-    pthread_sigmask (SIG_SETMASK, &oset, NULL);
-
-    if (result != 0) {
-        perror_msg (("Failed to start a new worker thread"));
+    if (!wl->is_shared && worker_loop_start (wl) == -1) {
         goto failure;
     }
 
     return wrk;
-    
+
 failure:
     if (wrk != NULL) {
         if (wrk->io[INOTIFY_FD] != -1) {
@@ -396,12 +856,17 @@ failure:
         }
         worker_free (wrk);
     }
+    if (wl != NULL && !wl->is_shared) {
+        worker_loop_free (wl);
+    }
     return NULL;
 }
 
 /**
  * Free a worker and all the associated memory.
  *
+ * Event loop serving the worker is not freed.
+ *
  * @param[in] wrk A pointer to #worker.
  **/
 void
@@ -411,28 +876,59 @@ worker_free (struct worker *wrk)
 
     assert (wrk != NULL);
 
+    /*
+     * Wait for user thread(s) to release worker`s mutex before the socket
+     * is closed. Its descriptor number can be reused by other worker sharing
+     * the same kqueue so no command should be triggered after that.
+     */
+    while (atomic_load (&wrk->mutex_rc) > 0) {
+        worker_lock (wrk);
+        worker_unlock (wrk);
+    }
+
     if (wrk->io[KQUEUE_FD] != -1) {
+#ifdef EVFILT_USER
+        /* User event is not bound to descriptor, delete it from kqueue */
+        struct kevent ev;
+        EV_SET (&ev, wrk->io[KQUEUE_FD], EVFILT_USER, EV_DELETE, 0, 0, 0);
+        kevent (wrk->kq, &ev, 1, NULL, 0, zero_tsp);
+#endif
+        if (wrk->timer_armed) {
+            /* Timer is not bound to descriptor too */
+            struct kevent tev;
+            EV_SET (&tev, wrk->io[KQUEUE_FD], EVFILT_TIMER, EV_DELETE,
+                    0, 0, 0);
+            kevent (wrk->kq, &tev, 1, NULL, 0, zero_tsp);
+        }
+        if (wrk->dormant_armed) {
+            struct kevent tev;
+            EV_SET (&tev, DORMANT_TIMER (wrk), EVFILT_TIMER, EV_DELETE,
+                    0, 0, 0);
+            kevent (wrk->kq, &tev, 1, NULL, 0, zero_tsp);
+        }
         close (wrk->io[KQUEUE_FD]);
         wrk->io[KQUEUE_FD] = -1;
     }
 
-    close (wrk->kq);
+    if (wrk->eq.lat != NULL) {
+        /* Loop stops reading clocks when no one collects histograms */
+        --wrk->loop->nlatency;
+    }
 
 #ifdef WORKER_FAST_WATCHSET_DESTROY
    watch_set_free (&wrk->watches);
 #endif
-    while (!SLIST_EMPTY (&wrk->head)) {
-        iw = SLIST_FIRST (&wrk->head);
-        SLIST_REMOVE_HEAD (&wrk->head, next);
+    while (!LIST_EMPTY (&wrk->head)) {
+        iw = LIST_FIRST (&wrk->head);
+        LIST_REMOVE (iw, next);
         iwatch_free (iw);
     }
+    iwatch_set_free (&wrk->wds);
+    dl_dirbuf_free (&wrk->dirbuf);
+    slab_pool_destroy (&wrk->dipool);
+    slab_cache_destroy (&wrk->iwcache);
+    watch_cache_destroy (&wrk->wcache);
 
-    /* Wait for user thread(s) to release worker`s mutex */
-    while (atomic_load (&wrk->mutex_rc) > 0) {
-        worker_cmd_lock (wrk);
-        worker_cmd_unlock (wrk);
-    }
-    pthread_mutex_destroy (&wrk->cmd_mtx);
     /* And only after that destroy worker_cmd sync primitives */
     pthread_cond_destroy (&wrk->cv);
     pthread_mutex_destroy (&wrk->mutex);
@@ -443,31 +939,24 @@ worker_free (struct worker *wrk)
 /**
  * Allocate new inotify watch descriptor.
  *
+ * Descriptors are allocated sequentially. After wraparound descriptors still
+ * in use are skipped with hash lookups. Each of them is skipped at most once
+ * per wraparound cycle so allocation takes amortized constant time.
+ *
  * @param[in] wrk   A pointer to #worker.
  * @return An unique (per watch) newly allocated descriptor
  **/
 int
 worker_allocate_wd (struct worker *wrk)
 {
-    bool allocated;
-
     do {
         if (wrk->wd_last == INT_MAX) {
             wrk->wd_last = 0;
             wrk->wd_overflow = true;
         }
-        allocated = true;
         ++wrk->wd_last;
-        if (wrk->wd_overflow) {
-            struct i_watch *iw;
-            SLIST_FOREACH (iw, &wrk->head, next) {
-                if (iw->wd == wrk->wd_last) {
-                    allocated = false;
-                    break;
-                }
-            }
-        }
-    } while (!allocated);
+    } while (wrk->wd_overflow &&
+             iwatch_set_find (&wrk->wds, wrk->wd_last) != NULL);
 
     return wrk->wd_last;
 }
@@ -509,10 +998,16 @@ worker_add_or_modify (struct worker *wrk,
     w = watch_set_find (&wrk->watches, st.st_dev, st.st_ino);
     if (w != NULL) {
         struct watch_dep *wd;
-        close (fd);
+        if (watch_is_dormant (w)) {
+            /* Dormant subwatch takes descriptor opened by user */
+            worker_revive_watch (wrk, w, fd);
+        } else {
+            close (fd);
+        }
         fd = w->fd;
         WD_FOREACH (wd, w) {
-            if (watch_dep_is_parent (wd)) {
+            /* Subdirectories of recursive watches are not visible to user */
+            if (watch_dep_is_parent (wd) && wd->iw->root == NULL) {
                 iwatch_update_flags (wd->iw, flags);
                 return wd->iw->wd;
             }
@@ -520,17 +1015,68 @@ worker_add_or_modify (struct worker *wrk,
     }
 
     /* create a new entry if watch is not found */
-    iw = iwatch_init (wrk, fd, flags);
+    iw = iwatch_init (wrk, fd, flags, NULL);
     if (iw == NULL) {
+        /* Descriptor is not owned by any watch yet */
+        if (w == NULL) {
+            close (fd);
+        }
         return -1;
     }
 
     /* add inotify watch to worker`s watchlist */
-    SLIST_INSERT_HEAD (&wrk->head, iw, next);
+    if (iwatch_set_insert (&wrk->wds, iw) == -1) {
+        iwatch_free (iw);
+        return -1;
+    }
+    LIST_INSERT_HEAD (&wrk->head, iw, next);
+    iwatch_add_subdirs (iw);
 
     return iw->wd;
 }
 
+/**
+ * Add or modify a vector of watches.
+ *
+ * Entries of wds array which are not equal to 0 are considered already
+ * failed by caller and skipped.
+ *
+ * @param[in]     wrk   A pointer to #worker.
+ * @param[in]     paths An array of file paths to watch.
+ * @param[in]     flags An array of combinations of inotify watch flags.
+ * @param[in,out] wds   An array to store ids of added watches or negated
+ *                      errno values to.
+ * @param[in]     n     A number of elements in the arrays.
+ * @return A number of successfully added or modified watches.
+ **/
+int
+worker_add_many (struct worker *wrk,
+                 const char *const paths[],
+                 const uint32_t flags[],
+                 int wds[],
+                 size_t n)
+{
+    size_t i;
+    int added = 0;
+
+    assert (wrk != NULL);
+    assert (n == 0 || (paths != NULL && flags != NULL && wds != NULL));
+
+    for (i = 0; i < n; i++) {
+        if (wds[i] != 0) {
+            continue;
+        }
+        wds[i] = worker_add_or_modify (wrk, paths[i], flags[i]);
+        if (wds[i] == -1) {
+            wds[i] = -errno;
+        } else {
+            ++added;
+        }
+    }
+
+    return added;
+}
+
 /**
  * Stop and remove a watch.
  *
@@ -546,15 +1092,14 @@ worker_remove (struct worker *wrk, int id)
     assert (wrk != NULL);
     assert (id >= 0);
 
-    SLIST_FOREACH (iw, &wrk->head, next) {
-
-        if (iw->wd == id) {
-            worker_remove_iwatch (wrk, iw);
-            return 0;
-        }
+    iw = iwatch_set_find (&wrk->wds, id);
+    if (iw == NULL) {
+        errno = EINVAL;
+        return -1;
     }
-    errno = EINVAL;
-    return -1;
+
+    worker_remove_iwatch (wrk, iw);
+    return 0;
 }
 
 /**
@@ -569,8 +1114,18 @@ worker_remove_iwatch (struct worker *wrk, struct i_watch *iw)
     assert (wrk != NULL);
     assert (iw != NULL);
 
+    /* Report pending directory changes before IN_IGNORED */
+    if (!iw->is_closed) {
+        produce_postponed_diff (iw);
+    }
+    /* Subdirectory of recursive watch is removed silently */
+    if (iw->root != NULL) {
+        iwatch_free (iw);
+        return;
+    }
     event_queue_enqueue (&wrk->eq, iw->wd, IN_IGNORED, 0, NULL);
-    SLIST_REMOVE (&wrk->head, iw, i_watch, next);
+    iwatch_set_delete (&wrk->wds, iw);
+    LIST_REMOVE (iw, next);
     iwatch_free (iw);
 }
 
@@ -589,11 +1144,338 @@ worker_set_param (struct worker *wrk, int param, intptr_t value)
 
     switch (param) {
     case IN_SOCKBUFSIZE:
-        return worker_set_sockbufsize (wrk, value);
+        if (value > INT_MAX) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (worker_set_sockbufsize (wrk, value) == -1) {
+            return -1;
+        }
+        wrk->sockbufsize_min = value;
+        return 0;
+    case IN_SOCKBUFSIZE_MAX:
+        if (value < 0 || value > INT_MAX) {
+            errno = EINVAL;
+            return -1;
+        }
+        /* Cut autotuned buffer down to the new limit */
+        if (value != 0 && wrk->sockbufsize > value &&
+            worker_set_sockbufsize (wrk, value > wrk->sockbufsize_min ?
+                                    value : wrk->sockbufsize_min) == -1) {
+            return -1;
+        }
+        wrk->sockbufsize_max = value;
+        wrk->sblight = 0;
+        return 0;
     case IN_MAX_QUEUED_EVENTS:
         return event_queue_set_max_events (&wrk->eq, value);
+    case IN_MAX_QUEUED_BYTES:
+        if (value < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        return event_queue_set_max_bytes (&wrk->eq, value);
+    case IN_COALESCE_WINDOW:
+        if (value > INT_MAX) {
+            errno = EINVAL;
+            return -1;
+        }
+        return event_queue_set_window (&wrk->eq, value);
+    case IN_LATENCY:
+        if (value < 0 || value > INT_MAX) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (event_queue_set_merge (&wrk->eq, value > 0) == -1) {
+            return -1;
+        }
+        /* Events held back are flushed at the end of current batch */
+        wrk->latency = value;
+        return 0;
+    case IN_LATENCY_HIST:
+        if (value != 0 && value != 1) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (value == 1 && wrk->eq.lat == NULL) {
+            ++wrk->loop->nlatency;
+        } else if (value == 0 && wrk->eq.lat != NULL) {
+            --wrk->loop->nlatency;
+        }
+        if (event_queue_set_latency_hist (&wrk->eq, value == 1) == -1) {
+            --wrk->loop->nlatency;
+            return -1;
+        }
+        return 0;
+    case IN_KEVENT_BATCH:
+        /* Shared loop batch is global, see worker_pool_set_kevent_batch() */
+        if (wrk->loop->is_shared ||
+            value <= 0 || value > INT_MAX / sizeof (struct kevent)) {
+            errno = EINVAL;
+            return -1;
+        }
+        /* Batch buffer is resized by worker thread before next kevent() */
+        wrk->loop->kevent_batch = value;
+        return 0;
+    case IN_MAX_WATCH_FDS:
+        if (value < 0 || value > INT_MAX) {
+            errno = EINVAL;
+            return -1;
+        }
+        wrk->max_fds = value;
+        /* Shrink to the new budget at once as far as possible */
+        while (wrk->max_fds != 0 &&
+               wrk->watches.count - wrk->ndormant > (size_t)wrk->max_fds &&
+               worker_reserve_fd (wrk, true));
+        return 0;
+    case IN_READDIR_BUFSIZE:
+        if (value != 0 &&
+            (value < (intptr_t)sizeof (struct dirent) || value > INT_MAX)) {
+            errno = EINVAL;
+            return -1;
+        }
+        /* Buffer of the new size is allocated by next directory read */
+        dl_dirbuf_free (&wrk->dirbuf);
+        dl_dirbuf_init (&wrk->dirbuf, value);
+        return 0;
     default:
         errno = EINVAL;
     }
     return -1;
 }
+
+/**
+ * Fill inotify_get_stats() result with worker activity counters.
+ *
+ * @param[in]  wrk   A pointer to #worker.
+ * @param[out] stats A pointer to #inotify_stats.
+ **/
+void
+worker_get_stats (struct worker *wrk, struct inotify_stats *stats)
+{
+    assert (wrk != NULL);
+    assert (stats != NULL);
+
+    stats->kevents = wrk->stats.kevents;
+    stats->events_enqueued = wrk->eq.stats.enqueued;
+    stats->events_coalesced = wrk->eq.stats.coalesced;
+    stats->events_dropped = wrk->eq.stats.dropped;
+    stats->overflows = wrk->eq.stats.overflows;
+    stats->rescans = wrk->stats.rescans;
+    stats->rescans_skipped = wrk->stats.rescans_skipped;
+    stats->entries_scanned = wrk->stats.entries_scanned;
+    stats->bytes_flushed = wrk->eq.stats.flushed;
+    stats->open_fds = wrk->watches.count - wrk->ndormant;
+    stats->watches = wrk->watches.count;
+    stats->queued_events = wrk->eq.mem_events;
+    stats->peak_queued_events = wrk->eq.stats.peak_events;
+    stats->sockbufsize = wrk->sockbufsize;
+}
+
+/**
+ * Fill inotify_get_latency() result with worker latency histograms.
+ *
+ * @param[in]  wrk A pointer to #worker.
+ * @param[out] lat A pointer to #inotify_latency.
+ * @return 0 on success, -1 if histograms are not collected.
+ **/
+int
+worker_get_latency (struct worker *wrk, struct inotify_latency *lat)
+{
+    assert (wrk != NULL);
+    assert (lat != NULL);
+
+    if (wrk->eq.lat == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memcpy (lat, &wrk->eq.lat->lat, sizeof (*lat));
+    return 0;
+}
+
+/**
+ * Drop kevents referencing a watch being freed from the current batch.
+ *
+ * Kevents are harvested in batches so the batch can still contain events
+ * for a watch removed while processing of preceeding events. Watches are
+ * stamped with the batch generation on harvesting, so the batch is walked
+ * only for watches which have kevents in it.
+ *
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] w   A pointer to #watch.
+ **/
+void
+worker_cancel_kevents (struct worker *wrk, struct watch *w)
+{
+    struct worker_loop *wl;
+    int i;
+
+    assert (wrk != NULL);
+    assert (w != NULL);
+
+    wl = wrk->loop;
+    if (w->batch_gen != wl->batch_gen) {
+        return;
+    }
+    w->batch_gen = 0;
+
+    for (i = 0; i < wl->nkevents; i++) {
+        if (wl->kevents[i].filter == EVFILT_VNODE &&
+            wl->kevents[i].udata == PTR_TO_UDATA (w)) {
+            wl->kevents[i].udata = PTR_TO_UDATA (NULL);
+        }
+    }
+}
+
+/**
+ * Check if the current kevent batch contains kevents of a watch.
+ *
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] w   A pointer to #watch.
+ * @return true if kevents of the watch are found, false otherwise.
+ **/
+static bool
+worker_has_kevents (struct worker *wrk, struct watch *w)
+{
+    return w->batch_gen == wrk->loop->batch_gen;
+}
+
+/**
+ * Check if a new watch descriptor fits the budget. Close the least recently
+ * active subwatch to free a descriptor if it does not.
+ *
+ * Watches opened by user are never closed. Subwatches closed here are
+ * checked with fstatat() on parent directory rescans and periodically.
+ *
+ * @param[in] wrk   A pointer to #worker.
+ * @param[in] evict Allow to close other subwatch to get a descriptor.
+ * @return true if new descriptor can be opened, false otherwise.
+ **/
+bool
+worker_reserve_fd (struct worker *wrk, bool evict)
+{
+    struct watch *w, *busy = NULL;
+    struct watch_dep *wd;
+    struct stat st;
+
+    assert (wrk != NULL);
+
+    if (wrk->max_fds == 0 ||
+        wrk->watches.count - wrk->ndormant < (size_t)wrk->max_fds) {
+        return true;
+    }
+
+    while (evict && !TAILQ_EMPTY (&wrk->lru)) {
+        w = TAILQ_FIRST (&wrk->lru);
+        if (w == busy) {
+            /* All the remaining subwatches have events pending */
+            break;
+        }
+        TAILQ_REMOVE (&wrk->lru, w, lru_link);
+        w->in_lru = false;
+
+        /* Watch opened by user. It is relinked when user watch is removed */
+        WD_FOREACH (wd, w) {
+            if (watch_dep_is_parent (wd)) {
+                break;
+            }
+        }
+        if (wd != NULL) {
+            continue;
+        }
+
+        /* Closing would drop events of current batch, so keep it open */
+        if (worker_has_kevents (wrk, w)) {
+            worker_touch_watch (wrk, w);
+            if (busy == NULL) {
+                busy = w;
+            }
+            continue;
+        }
+
+        if (fstat (w->fd, &st) == -1) {
+            perror_msg (("Failed to stat subwatch %d", w->fd));
+            memset (&st, 0, sizeof (st));
+        }
+        watch_save_stat (w, &st);
+        worker_cancel_kevents (wrk, w);
+        close (w->fd);
+        w->fd = -1;
+        w->fflags = 0;
+        TAILQ_INSERT_TAIL (&wrk->dormant, w, lru_link);
+        ++wrk->ndormant;
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Mark subwatch as recently active.
+ *
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] w   A pointer to #watch.
+ **/
+void
+worker_touch_watch (struct worker *wrk, struct watch *w)
+{
+    assert (wrk != NULL);
+    assert (w != NULL);
+    assert (!watch_is_dormant (w));
+
+    if (w->in_lru) {
+        TAILQ_REMOVE (&wrk->lru, w, lru_link);
+    }
+    TAILQ_INSERT_TAIL (&wrk->lru, w, lru_link);
+    w->in_lru = true;
+}
+
+/**
+ * Drop descriptor budget accounting of a watch being freed.
+ *
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] w   A pointer to #watch.
+ **/
+void
+worker_forget_watch (struct worker *wrk, struct watch *w)
+{
+    assert (wrk != NULL);
+    assert (w != NULL);
+
+    if (w->in_lru) {
+        TAILQ_REMOVE (&wrk->lru, w, lru_link);
+        w->in_lru = false;
+    }
+    if (watch_is_dormant (w)) {
+        assert (wrk->ndormant > 0);
+        TAILQ_REMOVE (&wrk->dormant, w, lru_link);
+        --wrk->ndormant;
+    }
+}
+
+/**
+ * Reopen dormant watch with a new file descriptor.
+ *
+ * @param[in] wrk A pointer to #worker.
+ * @param[in] w   A pointer to dormant #watch.
+ * @param[in] fd  A file descriptor of a watched entry.
+ **/
+void
+worker_revive_watch (struct worker *wrk, struct watch *w, int fd)
+{
+    assert (wrk != NULL);
+    assert (w != NULL);
+    assert (watch_is_dormant (w));
+    assert (!watch_deps_empty (w));
+    assert (wrk->ndormant > 0);
+
+    w->fd = fd;
+    w->fflags = 0;
+    TAILQ_REMOVE (&wrk->dormant, w, lru_link);
+    --wrk->ndormant;
+    if (watch_update_event (w) == -1) {
+        perror_msg (("Failed to register revived watch %d", fd));
+    }
+    worker_touch_watch (wrk, w);
+}
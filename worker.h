@@ -33,7 +33,10 @@
 #include "compat.h"
 #include "event-queue.h"
 #include "inotify-watch.h"
+#include "iwatch-set.h"
+#include "slab.h"
 #include "watch-set.h"
+#include "watch.h"
 
 /* Optimized watch destruction on freeing of worker thread */
 #define WORKER_FAST_WATCHSET_DESTROY 1
@@ -44,8 +47,12 @@
 typedef enum {
     WCMD_NONE = 0,   /* uninitialized state */
     WCMD_ADD,        /* add or modify a watch */
+    WCMD_ADD_MANY,   /* add or modify a vector of watches */
+    WCMD_ADD_ASYNC,  /* add or modify a watch without waiting for result */
     WCMD_REMOVE,     /* remove a watch */
-    WCMD_PARAM       /* set worker thread parameter */
+    WCMD_PARAM,      /* set worker thread parameter */
+    WCMD_STATS,      /* collect worker thread statistics */
+    WCMD_LATENCY     /* collect worker thread latency histograms */
 } worker_cmd_type_t;
 
 /**
@@ -56,6 +63,8 @@ struct worker_cmd {
     worker_cmd_type_t type;
     int retval;
     int error;
+    atomic_bool done;         /* command has been completed by worker */
+    struct worker_cmd *next;  /* next command in worker command stack */
 
     union {
         struct {
@@ -63,12 +72,29 @@ struct worker_cmd {
             uint32_t mask;
         } add;
 
+        struct {
+            const char *const *filenames;
+            const uint32_t *masks;
+            int *wds;
+            size_t n;
+        } add_many;
+
+        struct {
+            char *filename;
+            uint32_t mask;
+            uint32_t tag;
+        } add_async;
+
         int rm_id;
 
         struct {
             int param;
             intptr_t value;
         } param;
+
+        struct inotify_stats *stats;
+
+        struct inotify_latency *lat;
     } cmd;
 
 };
@@ -76,28 +102,100 @@ struct worker_cmd {
 void worker_cmd_add    (struct worker_cmd *cmd,
                         const char *filename,
                         uint32_t mask);
+void worker_cmd_add_many (struct worker_cmd *cmd,
+                         const char *const filenames[],
+                         const uint32_t masks[],
+                         int wds[],
+                         size_t n);
+struct worker_cmd* worker_cmd_add_async (const char *filename,
+                                         uint32_t mask,
+                                         uint32_t tag);
+void worker_cmd_free   (struct worker_cmd *cmd);
 void worker_cmd_remove (struct worker_cmd *cmd, int watch_id);
 void worker_cmd_param  (struct worker_cmd *cmd, int param, intptr_t value);
+void worker_cmd_stats  (struct worker_cmd *cmd, struct inotify_stats *stats);
+void worker_cmd_latency (struct worker_cmd *cmd, struct inotify_latency *lat);
 
 SLIST_HEAD(workers_list, worker);
+TAILQ_HEAD(watch_lru, watch);
 
-struct worker {
+/**
+ * This structure represents a kqueue event loop run by a worker thread.
+ * The loop serves either a single worker or, if it belongs to the worker
+ * thread pool, all workers assigned to it.
+ **/
+struct worker_loop {
     int kq;                /* kqueue descriptor */
+    pthread_t thread;      /* worker thread */
+    bool is_shared;        /* loop belongs to the worker thread pool */
+    struct kevent *kevents; /* batch of kevents harvested from kqueue */
+    int nkevents;          /* number of kevents in the current batch */
+    int kevents_size;      /* number of kevents allocated */
+    int kevent_batch;      /* max number of kevents harvested at once */
+    unsigned int batch_gen; /* generation of the current batch */
+    int nlatency;          /* number of workers collecting latency histograms */
+};
+
+/* Communication socket buffer is known to be empty */
+#define SBEMPTY SIZE_MAX
+
+/* Number of light drains in a row to shrink autotuned socket buffer after */
+#define SBSHRINK_DRAINS 8
+
+/* Interval in ms of checks of dormant watches for changes */
+#define DORMANT_CHECK_INTERVAL 1000
+/* Dormant check timer ident. Latency timer is identified by socket */
+#define DORMANT_TIMER(wrk) ((uintptr_t)(wrk))
+
+/* Worker command stack does not accept commands anymore */
+#define CMDS_CLOSED ((uintptr_t)1)
+
+/* Worker activity counters */
+struct worker_stats {
+    uint64_t rescans;         /* directory listings read */
+    uint64_t rescans_skipped; /* listings skipped as directory is unchanged */
+    uint64_t entries_scanned; /* directory entries read by rescans */
+    uint64_t kevents;         /* kevents received from kqueue */
+};
+
+struct worker {
+    int kq;                /* kqueue descriptor, owned by event loop */
     int io[2];             /* a socket pair */
     int sockbufsize;       /* socket buffer size */
-    pthread_t thread;      /* worker thread */
+    int sockbufsize_min;   /* socket buffer size set by user */
+    int sockbufsize_max;   /* socket buffer autotuning limit, 0 for off */
+    size_t sbused;         /* bytes sent since socket has been drained */
+    int sblight;           /* drains in a row with buffer mostly unused */
+    size_t sbspace;        /* free space in socket buffer or SBEMPTY */
+    bool is_closed;        /* communication socket has been closed */
+    bool in_batch;         /* worker has events in current kevent batch */
+    struct worker_loop *loop; /* event loop serving the worker */
     struct i_watch_list head; /* linked list of inotify watches */
+    struct iwatch_set wds; /* inotify watches indexed by watch descriptor */
+    struct i_watch_queue diffs; /* directories to rescan at end of batch */
     int wd_last;           /* last allocated inotify watch descriptor */
     bool wd_overflow;      /* if watch descriptor have been overflown */
 
-    pthread_mutex_t cmd_mtx;  /* worker command execution serializer */
+    atomic_uintptr_t cmds;    /* lock-free stack of submitted commands */
     atomic_uint mutex_rc;     /* worker mutexes sleepers/holders refcount */
-    int sema;                 /* worker <-> user syncronization semaphore */
     pthread_mutex_t mutex;    /* worker data access serializer */
     pthread_cond_t cv;        /* worker <-> user syncronization condvar */
     struct event_queue eq;    /* inotify events queue */
+    int latency;              /* event latency window in ms, 0 for off */
+    bool timer_armed;         /* latency timer is started */
+    bool flush_due;           /* latency window is over, flush events */
+    bool dormant_armed;       /* dormant check timer is started */
     struct watch_set watches; /* kqueue watches */
-    SLIST_ENTRY(worker) next; /* next worker */
+    struct watch_cache wcache; /* slab caches of kqueue watches */
+    struct slab_cache iwcache; /* slab cache of inotify watches */
+    struct slab_pool dipool;  /* slab pool of directory listing items */
+    struct dl_dirbuf dirbuf;  /* buffer for raw directory reads */
+    struct watch_lru lru;     /* subwatches, least recently active first */
+    struct watch_lru dormant; /* subwatches closed to fit descriptor budget */
+    size_t ndormant;          /* watches closed to fit descriptor budget */
+    int max_fds;              /* descriptor budget, 0 for unlimited */
+    struct worker_stats stats; /* activity counters */
+    SLIST_ENTRY(worker) batch_link; /* next worker in kevent batch */
 };
 
 #define container_of(p, s, f) ((s *)(((uint8_t *)(p)) - offsetof(s, f)))
@@ -106,28 +204,35 @@ struct worker {
 struct worker* worker_create  (int flags);
 void           worker_free    (struct worker *wrk);
 void           worker_post    (struct worker *wrk);
-void           worker_wait    (struct worker *wrk);
-int            worker_notify  (struct worker *wrk, struct worker_cmd *cmd);
+void           worker_wait    (struct worker *wrk, struct worker_cmd *cmd);
+int            worker_notify  (struct worker *wrk);
+int            worker_submit  (struct worker *wrk, struct worker_cmd *cmd);
+struct worker_cmd* worker_take_cmds (struct worker *wrk, bool close);
 
 int     worker_add_or_modify  (struct worker *wrk,
                                const char *path,
                                uint32_t flags);
+int     worker_add_many       (struct worker *wrk,
+                               const char *const paths[],
+                               const uint32_t flags[],
+                               int wds[],
+                               size_t n);
 int     worker_allocate_wd    (struct worker *wrk);
 int     worker_remove         (struct worker *wrk, int id);
 void    worker_remove_iwatch  (struct worker *wrk, struct i_watch *iw);
 int     worker_set_param      (struct worker *wrk, int param, intptr_t value);
+void    worker_get_stats      (struct worker *wrk, struct inotify_stats *stats);
+int     worker_get_latency    (struct worker *wrk, struct inotify_latency *lat);
+int     worker_set_sockbufsize (struct worker *wrk, int bufsize);
+void    worker_cancel_kevents (struct worker *wrk, struct watch *w);
+bool    worker_reserve_fd     (struct worker *wrk, bool evict);
+void    worker_touch_watch    (struct worker *wrk, struct watch *w);
+void    worker_forget_watch   (struct worker *wrk, struct watch *w);
+void    worker_revive_watch   (struct worker *wrk, struct watch *w, int fd);
 
-static inline void
-worker_cmd_lock (struct worker *wrk)
-{
-    pthread_mutex_lock (&wrk->cmd_mtx);
-}
-
-static inline void
-worker_cmd_unlock (struct worker *wrk)
-{
-    pthread_mutex_unlock (&wrk->cmd_mtx);
-}
+void    worker_loop_free      (struct worker_loop *wl);
+int     worker_pool_set_size  (intptr_t value);
+int     worker_pool_set_kevent_batch (intptr_t value);
 
 static inline void
 worker_lock (struct worker *wrk)